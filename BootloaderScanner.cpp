@@ -0,0 +1,81 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "BootloaderScanner.h"
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+const char bannerPrefix[] = "BOOTLOADER version ";
+const char bannerChipId[] = " Chip ID ";
+const char readyWindow[] = "Ready window ";
+
+template<std::size_t N>
+bool starts_with(const char *line, std::size_t len, const char (&prefix)[N]) {
+    return len >= N - 1 && memcmp(line, prefix, N - 1) == 0;
+}
+
+}
+
+bool BootloaderScanner::parse_banner(const char *line, std::size_t length, std::string &version,
+                                     std::string &chip_id) {
+    //the '\r' the bootloader terminates its lines with
+    if (length && line[length - 1] == '\r') length--;
+    const size_t prefix_len = sizeof(bannerPrefix) - 1, chip_id_len = sizeof(bannerChipId) - 1;
+    if (!starts_with(line, length, bannerPrefix)) return false;
+    //the version may contain anything, the Chip ID follows the last separator
+    size_t digits = length;
+    while (digits > prefix_len && ((line[digits - 1] >= '0' && line[digits - 1] <= '9') ||
+                                   (line[digits - 1] >= 'A' && line[digits - 1] <= 'F')))
+        digits--;
+    if (digits == length || digits < prefix_len + 1 + chip_id_len ||
+        memcmp(line + digits - chip_id_len, bannerChipId, chip_id_len) != 0)
+        return false;
+    version.assign(line + prefix_len, digits - chip_id_len - prefix_len);
+    chip_id.assign(line + digits, length - digits);
+    return true;
+}
+
+BootloaderScanner::token BootloaderScanner::classify() {
+    if (overflow) return LINE;
+    size_t len = length && line[length - 1] == '\r' ? length - 1 : length;
+    if (len == 1 && line[0] == '?') return UNKNOWN;
+    if (len == 5 && memcmp(line, "Ready", 5) == 0) return READY;
+    const size_t window_len = sizeof(readyWindow) - 1;
+    if (len > window_len && len <= window_len + 9 && starts_with(line, len, readyWindow)) {
+        unsigned int frames = 0;
+        for (size_t i = window_len; i < len; i++) {
+            if (line[i] < '0' || line[i] > '9') return LINE;
+            frames = frames * 10 + static_cast<unsigned int>(line[i] - '0');
+        }
+        window = frames;
+        return READY_WINDOW;
+    }
+    return parse_banner(line, length, version, chip_id) ? BANNER : LINE;
+}
+
+BootloaderScanner::token BootloaderScanner::feed(uint8_t c, bool ncg) {
+    if (c == '\n') {
+        complete = true;
+        return classify();
+    }
+    if (complete) reset();
+    if (!length && ncg && c == 'C') return NCG;
+    if (length < scannerMaxLine) line[length++] = static_cast<char>(c);
+    else overflow = true;
+    return NONE;
+}
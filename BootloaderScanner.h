@@ -0,0 +1,114 @@
+#ifndef WANDSTEM_FLASH_UTILITY_BOOTLOADERSCANNER_H
+#define WANDSTEM_FLASH_UTILITY_BOOTLOADERSCANNER_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+static const std::size_t scannerMaxLine=256;
+
+/**
+ * This class recognizes the replies of the bootloader in the bytes it sends, one byte at a time, so that the
+ * handshake moves on the moment a reply is complete: the banner, the '?' to an unknown command, the "Ready" of the
+ * upload modes and the 'C' asking for an XMODEM-CRC transfer.
+ * The matchers are written out by hand: nothing is compiled or allocated per line, and the bytes of a line are looked
+ * at only once more when it ends.
+ */
+class BootloaderScanner {
+public:
+    ///The replies recognized, as bits so that a set of them can be awaited at once.
+    enum token {
+        NONE = 0,
+        ///"BOOTLOADER version <version> Chip ID <hexadecimal Chip ID>".
+        BANNER = 1,
+        ///"?", the reply to an unknown command.
+        UNKNOWN = 2,
+        ///"Ready", the classic upload mode started.
+        READY = 4,
+        ///"Ready window <frames>", the windowed upload mode started.
+        READY_WINDOW = 8,
+        ///A 'C' at the beginning of a line, when asked for.
+        NCG = 16,
+        ///Any other line.
+        LINE = 32
+    };
+
+private:
+    ///The line being received, without its terminator.
+    char line[scannerMaxLine];
+
+    ///The bytes in line.
+    std::size_t length = 0;
+
+    ///If the bytes of the current line went beyond scannerMaxLine and were dropped.
+    bool overflow = false;
+
+    ///If line was terminated, so that it is cleared by the next byte.
+    bool complete = false;
+
+    std::string version;
+    std::string chip_id;
+    unsigned int window = 0;
+
+    /**
+     * Classifies a complete line.
+     * \return the token of the line.
+     */
+    token classify();
+
+public:
+    /**
+     * Scans a byte.
+     * \param c the byte received
+     * \param ncg if a 'C' at the beginning of a line is the request of an XMODEM transfer, rather than the beginning
+     * of a line
+     * \return the token the byte completed, NONE if none.
+     */
+    token feed(uint8_t c, bool ncg);
+
+    /**
+     * Forgets the line being received, after the link was reset.
+     * \return
+     */
+    void reset() {
+        length = 0;
+        overflow = false;
+        complete = false;
+    }
+
+    /**
+     * Gets the last line completed, with the '\r' of the bootloader if any.
+     * \return the line.
+     */
+    std::string get_line() const { return std::string(line, length); }
+
+    /**
+     * Gets the version in the last banner.
+     * \return the version.
+     */
+    const std::string &get_version() const { return version; }
+
+    /**
+     * Gets the Chip ID in the last banner.
+     * \return the Chip ID.
+     */
+    const std::string &get_chip_id() const { return chip_id; }
+
+    /**
+     * Gets the frames in flight accepted by the last windowed upload mode started.
+     * \return the number of frames.
+     */
+    unsigned int get_window() const { return window; }
+
+    /**
+     * Checks if a line is a bootloader banner, extracting its fields.
+     * \param line the line, with or without the trailing '\r'
+     * \param length the length of the line
+     * \param version where the version is stored
+     * \param chip_id where the Chip ID is stored
+     * \return if the line is a banner.
+     */
+    static bool parse_banner(const char *line, std::size_t length, std::string &version, std::string &chip_id);
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_BOOTLOADERSCANNER_H
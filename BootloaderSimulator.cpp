@@ -0,0 +1,446 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "BootloaderSimulator.h"
+#include "XmodemPacket.h"
+#include "Crc16.h"
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+using namespace std;
+
+BootloaderSimulator::BootloaderSimulator(SimulatorOptions options) : options(std::move(options)), running(false),
+                                                                     rng(this->options.seed) {
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd < 0 || grantpt(master_fd) || unlockpt(master_fd))
+        throw runtime_error("Cannot create the pseudo-terminal");
+    const char *name = ptsname(master_fd);
+    if (name == nullptr)
+        throw runtime_error("Cannot obtain the pseudo-terminal slave name");
+    slave_path = name;
+    slave_fd = open(slave_path.c_str(), O_RDWR | O_NOCTTY);
+    if (slave_fd < 0)
+        throw runtime_error("Cannot open the pseudo-terminal slave");
+    //the bootloader talks raw bytes, no line discipline must get in the way
+    struct termios tio{};
+    tcgetattr(slave_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave_fd, TCSANOW, &tio);
+
+    if (!this->options.link_path.empty()) {
+        unlink(this->options.link_path.c_str());
+        if (symlink(slave_path.c_str(), this->options.link_path.c_str()))
+            throw runtime_error("Cannot create the symlink " + this->options.link_path);
+    }
+}
+
+BootloaderSimulator::~BootloaderSimulator() {
+    if (!options.link_path.empty()) unlink(options.link_path.c_str());
+    if (slave_fd >= 0) close(slave_fd);
+    if (master_fd >= 0) close(master_fd);
+}
+
+const std::string &BootloaderSimulator::get_device_path() const {
+    return options.link_path.empty() ? slave_path : options.link_path;
+}
+
+void BootloaderSimulator::stop() {
+    running = false;
+}
+
+unsigned int BootloaderSimulator::line_speed() const {
+    //the master shares the termios of the slave, where the utility configured the baud rate
+    struct termios tio{};
+    if (tcgetattr(master_fd, &tio)) return 0;
+    switch (cfgetospeed(&tio)) {
+        case B9600:
+            return 9600;
+        case B19200:
+            return 19200;
+        case B38400:
+            return 38400;
+        case B57600:
+            return 57600;
+        case B115200:
+            return 115200;
+        case B230400:
+            return 230400;
+        case B460800:
+            return 460800;
+        case B921600:
+            return 921600;
+        case B1000000:
+            return 1000000;
+        default:
+            return 0;
+    }
+}
+
+void BootloaderSimulator::pace(std::chrono::steady_clock::time_point &busy_until, std::size_t bytes) {
+    unsigned int rate = options.baud ? options.baud : options.line_baud ? current_baud : 0;
+    if (!rate && !options.byte_delay_us) return;
+    //10 bits per byte: start bit, 8 data bits, stop bit
+    chrono::nanoseconds per_byte = chrono::microseconds(options.byte_delay_us);
+    if (rate) per_byte += chrono::nanoseconds(10000000000ull / rate);
+    auto now = chrono::steady_clock::now();
+    //a sleep overshooting by less than a slice is made up for by the following bytes, a longer idle link is not
+    auto slice = chrono::microseconds(simulatorPaceSliceUsec);
+    if (busy_until < now - slice) busy_until = now - slice;
+    busy_until += per_byte * bytes;
+    //sleeping for every single byte would overshoot at high baud rates, the debt is paid in slices instead
+    if (busy_until - now > slice)
+        this_thread::sleep_until(busy_until);
+}
+
+bool BootloaderSimulator::read_byte(uint8_t &c, int timeout_msec) {
+    flush_replies(false);
+    if (input_pos < input.size()) {
+        c = input[input_pos++];
+        pace(rx_busy_until, 1);
+        return true;
+    }
+    auto end = chrono::steady_clock::now() + chrono::milliseconds(timeout_msec);
+    while (running) {
+        flush_replies(false);
+        //wake up periodically to honour stop requests
+        int wait = 100;
+        if (timeout_msec > 0) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(end - chrono::steady_clock::now()).count();
+            if (left <= 0) return false;
+            if (left < wait) wait = static_cast<int>(left);
+        } else if (timeout_msec == 0) {
+            //just a look at what arrived
+            wait = 0;
+        }
+        if (!pending_replies.empty()) {
+            //wake up for the next reply, spinning through its last millisecond
+            auto due = chrono::duration_cast<chrono::milliseconds>(pending_replies.front().first -
+                                                                   chrono::steady_clock::now()).count();
+            wait = min(wait, static_cast<int>(max<decltype(due)>(due, 0)));
+        }
+        struct pollfd pfd{master_fd, POLLIN, 0};
+        int ret = poll(&pfd, 1, wait);
+        if (ret < 0 && errno != EINTR)
+            throw runtime_error("Pseudo-terminal poll failed");
+        if (ret <= 0 && timeout_msec == 0) return false;
+        if (ret <= 0) continue;
+        input.resize(simulatorInputBuffer);
+        ssize_t got = read(master_fd, input.data(), input.size());
+        if (got > 0) {
+            current_baud = line_speed();
+            input.resize(static_cast<size_t>(got));
+            input_pos = 1;
+            c = input[0];
+            pace(rx_busy_until, 1);
+            return true;
+        }
+        input.clear();
+        input_pos = 0;
+        if (got < 0 && errno != EINTR && errno != EAGAIN && errno != EIO)
+            throw runtime_error("Pseudo-terminal read failed");
+        if (got < 0 && errno == EIO)
+            this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return false;
+}
+
+bool BootloaderSimulator::read_bytes(uint8_t *data, std::size_t len) {
+    for (std::size_t i = 0; i < len; i++)
+        if (!read_byte(data[i], simulatorInterCharTimeoutMsec)) return false;
+    return true;
+}
+
+void BootloaderSimulator::write_bytes(const void *data, std::size_t len) {
+    auto bytes = static_cast<const uint8_t *>(data);
+    //the bytes are delivered once the emulated link would have carried all of them
+    pace(tx_busy_until, len);
+    for (std::size_t done = 0; done < len;) {
+        ssize_t written = write(master_fd, bytes + done, len - done);
+        if (written < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            throw runtime_error("Pseudo-terminal write failed");
+        }
+        done += written;
+    }
+}
+
+void BootloaderSimulator::write_line(const std::string &line) {
+    write_bytes((line + "\r\n").data(), line.size() + 2);
+}
+
+void BootloaderSimulator::write_reply(uint8_t reply, int block) {
+    if (block >= 0) {
+        //in windowed mode the target keeps receiving while its replies are on their way
+        pending_replies.emplace_back(chrono::steady_clock::now() + chrono::microseconds(options.turnaround_us),
+                                     vector<uint8_t>{reply, static_cast<uint8_t>(block)});
+        flush_replies(false);
+        return;
+    }
+    flush_replies(true);
+    //the time the target and the adapters need to turn the line around
+    if (options.turnaround_us)
+        this_thread::sleep_for(chrono::microseconds(options.turnaround_us));
+    write_bytes(&reply, 1);
+}
+
+void BootloaderSimulator::flush_replies(bool all) {
+    while (!pending_replies.empty()) {
+        auto &reply = pending_replies.front();
+        if (reply.first > chrono::steady_clock::now()) {
+            if (!all) return;
+            this_thread::sleep_until(reply.first);
+        }
+        write_bytes(reply.second.data(), reply.second.size());
+        pending_replies.pop_front();
+    }
+}
+
+bool BootloaderSimulator::inject(double rate) {
+    return rate > 0 && uniform_real_distribution<double>(0, 1)(rng) < rate;
+}
+
+void BootloaderSimulator::purge() {
+    uint8_t c;
+    while (read_byte(c, simulatorInterCharTimeoutMsec));
+}
+
+void BootloaderSimulator::store_image(const std::vector<uint8_t> &image) {
+    if (options.output_path.empty()) return;
+    ofstream out(options.output_path, ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char *>(image.data()), image.size());
+}
+
+void BootloaderSimulator::handle_command(uint8_t c) {
+    //too fast for the autobaud: the bytes are lost as line noise
+    if (state != FIRMWARE && options.max_baud && current_baud > options.max_baud) return;
+    //a byte at another rate reads as a framing error, the bootloader syncs again on the next 'U'
+    if (state == COMMAND && options.require_autobaud && current_baud != locked_baud) state = AUTOBAUD;
+    switch (state) {
+        case AUTOBAUD:
+            if (c != 'U') {
+                //before the autobaud every other byte is line noise
+                if (options.require_autobaud) return;
+                state = COMMAND;
+                break;
+            }
+            state = COMMAND;
+            locked_baud = current_baud;
+            stats.autobauds++;
+            write_line("BOOTLOADER version " + options.version + " Chip ID " + options.chip_id);
+            return;
+        case FIRMWARE:
+            return;
+        case COMMAND:
+            break;
+    }
+    switch (c) {
+        case 'i':
+            write_line("BOOTLOADER version " + options.version + " Chip ID " + options.chip_id);
+            break;
+        case 'u':
+            write_line("Ready");
+            receive_xmodem(false);
+            break;
+        case 'W':
+            if (!options.window) {
+                write_line("?");
+                break;
+            }
+            write_line("Ready window " + to_string(options.window));
+            receive_xmodem(true);
+            break;
+        case 'b':
+            state = FIRMWARE;
+            firmware_started = chrono::steady_clock::now();
+            for (auto &line : options.firmware_lines)
+                write_line(line);
+            break;
+        case '\r':
+        case '\n':
+            break;
+        default:
+            write_line("?");
+            break;
+    }
+}
+
+bool BootloaderSimulator::receive_xmodem(bool windowed) {
+    vector<uint8_t> image;
+    uint8_t expected = 1;
+    unsigned int packets = 0;
+    bool started = false;
+    chrono::steady_clock::time_point start;
+    //in windowed mode the frames following a rejected one are dropped silently, the sender goes back anyway
+    bool nak_sent = false;
+    pending_replies.clear();
+    auto acknowledge = [&] { write_reply(xmodemAck, windowed ? static_cast<uint8_t>(expected - 1) : -1); };
+    auto reject = [&] {
+        if (!windowed) write_reply(xmodemNak);
+        else if (!nak_sent) write_reply(xmodemNak, expected);
+        nak_sent = true;
+    };
+
+    uint8_t header;
+    for (;;) {
+        //until the first packet the receiver keeps asking for a CRC mode transfer
+        if (!started) write_bytes("C", 1);
+        if (!read_byte(header, started ? simulatorInterCharTimeoutMsec * 10 : simulatorNcgPeriodMsec)) {
+            if (!running) return false;
+            if (started) {
+                cerr << "sim: transfer timed out" << endl;
+                return false;
+            }
+            continue;
+        }
+        if (!started) start = chrono::steady_clock::now();
+        started = true;
+
+        if (header == xmodemEot) {
+            write_reply(xmodemAck);
+            break;
+        }
+        if (header == xmodemCan) {
+            cerr << "sim: transfer cancelled by the sender" << endl;
+            return false;
+        }
+        if (header != xmodemSoh && header != xmodemStx) {
+            stats.bad_packets++;
+            //in windowed mode more frames are coming, the next header is looked for byte by byte
+            if (!windowed) purge();
+            reject();
+            continue;
+        }
+        if (header == xmodemStx && !options.accept_1k) {
+            if (!windowed) purge();
+            if (options.cancel_1k) {
+                uint8_t can[] = {xmodemCan, xmodemCan, xmodemCan};
+                write_bytes(can, sizeof(can));
+                return false;
+            }
+            reject();
+            continue;
+        }
+
+        int data_size = header == xmodemStx ? xmodem1kDataSize : xmodemDataSize;
+        uint8_t frame[xmodem1kPacketSize - 1];
+        if (!read_bytes(frame, static_cast<size_t>(data_size + 4))) {
+            stats.bad_packets++;
+            reject();
+            continue;
+        }
+        uint8_t block_num = frame[0];
+        const uint8_t *payload = frame + 2;
+        auto received_crc = static_cast<uint16_t>(frame[2 + data_size] << 8 | frame[3 + data_size]);
+        if (static_cast<uint8_t>(~frame[1]) != block_num ||
+            Crc16::compute(payload, static_cast<size_t>(data_size)) != received_crc) {
+            stats.bad_packets++;
+            reject();
+            continue;
+        }
+        //a window never spans half the block numbers, so the older ones are behind
+        uint8_t behind = static_cast<uint8_t>(expected - block_num);
+        if (behind == 1 || (windowed && behind && behind <= 128)) {
+            //our ACK got lost, the sender is repeating itself
+            stats.duplicates++;
+            acknowledge();
+            continue;
+        }
+        if (block_num != expected) {
+            if (windowed) {
+                //a frame before this one was lost
+                reject();
+                continue;
+            }
+            uint8_t can[] = {xmodemCan, xmodemCan, xmodemCan};
+            write_bytes(can, sizeof(can));
+            cerr << "sim: out of sequence packet, transfer cancelled" << endl;
+            return false;
+        }
+        //the frame asked for arrived, a new failure deserves a new NAK
+        nak_sent = false;
+
+        if (options.cancel_at && packets + 1 == options.cancel_at) {
+            stats.injected_cancels++;
+            uint8_t can[] = {xmodemCan, xmodemCan, xmodemCan};
+            write_bytes(can, sizeof(can));
+            return false;
+        }
+        if (inject(options.nak_rate)) {
+            stats.injected_naks++;
+            reject();
+            continue;
+        }
+        if (options.noisy_baud && current_baud > options.noisy_baud && inject(options.noise_rate)) {
+            //the packet was corrupted on a marginal link
+            stats.noise_errors++;
+            reject();
+            continue;
+        }
+        packets++;
+        image.insert(image.end(), payload, payload + data_size);
+        expected++;
+        stats.packets++;
+        if (inject(options.drop_rate)) {
+            //the packet is stored, but the sender never hears about it
+            stats.injected_drops++;
+            continue;
+        }
+        acknowledge();
+    }
+
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stats.transfers++;
+    stats.bytes += image.size();
+    cerr << "sim: received " << packets << " packets (" << image.size() << " bytes) in " << elapsed << " s, "
+         << (elapsed > 0 ? image.size() / elapsed : 0) << " B/s" << endl;
+    store_image(image);
+    return true;
+}
+
+void BootloaderSimulator::write_firmware_log() {
+    static const string payload(64, '=');
+    auto now = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - firmware_started).count();
+    write_line("[" + to_string(now) + "] sample " + to_string(stats.firmware_lines++) + " " + payload);
+}
+
+void BootloaderSimulator::run() {
+    running = true;
+    if (options.start_in_firmware) {
+        state = FIRMWARE;
+        firmware_started = chrono::steady_clock::now();
+    }
+    uint8_t c;
+    while (running) {
+        if (state == FIRMWARE && options.firmware_stream) {
+            //the link is the only limit, the input is only checked in passing
+            write_firmware_log();
+            if (read_byte(c, 0)) handle_command(c);
+            continue;
+        }
+        if (state == FIRMWARE && options.firmware_msec &&
+            chrono::steady_clock::now() - firmware_started > chrono::milliseconds(options.firmware_msec))
+            state = AUTOBAUD; //the board was reset into the bootloader
+        if (read_byte(c, 100))
+            handle_command(c);
+    }
+}
@@ -0,0 +1,275 @@
+#ifndef WANDSTEM_FLASH_UTILITY_BOOTLOADERSIMULATOR_H
+#define WANDSTEM_FLASH_UTILITY_BOOTLOADERSIMULATOR_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <random>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+static const int simulatorInterCharTimeoutMsec=1000;
+static const int simulatorNcgPeriodMsec=3000;
+static const int simulatorPaceSliceUsec=500;
+static const int simulatorInputBuffer=4096;
+
+///The parameters driving a BootloaderSimulator.
+struct SimulatorOptions {
+    ///If not empty, a symlink to the pseudo-terminal slave is created at this path.
+    std::string link_path;
+    ///The version string printed in the banner.
+    std::string version = "1.0";
+    ///The Chip ID printed in the banner.
+    std::string chip_id = "0123456789ABCDEF";
+    ///The emulated baud rate, 0 for no emulation.
+    unsigned int baud = 0;
+    ///If the transfer time is emulated at the baud rate the utility set on the line, when baud is 0.
+    bool line_baud = false;
+    ///The highest baud rate the autobaud locks on, faster bytes are lost as line noise. 0 for no limit.
+    unsigned int max_baud = 0;
+    ///The baud rate above which packets get corrupted with probability noise_rate, 0 for never.
+    unsigned int noisy_baud = 0;
+    ///The probability of corrupting a packet above noisy_baud.
+    double noise_rate = 0.5;
+    ///An additional delay applied to every byte crossing the link.
+    unsigned int byte_delay_us = 0;
+    ///The delay before every reply to a packet, emulating the turnaround of the target and the adapters.
+    unsigned int turnaround_us = 0;
+    ///If the bootloader must see an 'U' before understanding anything else.
+    bool require_autobaud = true;
+    ///If XMODEM-1K packets are accepted.
+    bool accept_1k = true;
+    ///If XMODEM-1K packets are refused by cancelling the transfer rather than by replying NAK.
+    bool cancel_1k = false;
+    ///The probability of replying NAK to a correct packet.
+    double nak_rate = 0;
+    ///The probability of not replying at all to a correct packet.
+    double drop_rate = 0;
+    ///The packet number (counted from 1) at which the transfer is cancelled, 0 for never.
+    unsigned int cancel_at = 0;
+    ///The seed of the fault injection generator.
+    unsigned int seed = 1;
+    ///If not empty, every received image is stored at this path.
+    std::string output_path;
+    ///How long the firmware runs before the board is reset into the bootloader again, 0 for forever.
+    unsigned int firmware_msec = 0;
+    ///The lines printed by the firmware after a reboot.
+    std::vector<std::string> firmware_lines = {"Wandstem firmware booted", "Hello world"};
+    ///If the board starts running the firmware instead of the bootloader.
+    bool start_in_firmware = false;
+    ///If the firmware keeps printing log lines as fast as the link allows.
+    bool firmware_stream = false;
+    ///The frames the windowed mode accepts in flight, 0 if the mode is not supported.
+    unsigned int window = 0;
+};
+
+/**
+ * This class emulates the Miosix bootloader of a Wandstem board on a pseudo-terminal.
+ * It answers the same commands and receives images using XMODEM-CRC, so that the real utility can be
+ * pointed at the pseudo-terminal slave and timed end to end.
+ */
+class BootloaderSimulator {
+public:
+    ///The counters of the simulator activity.
+    struct statistics_t {
+        unsigned int transfers = 0;
+        unsigned int packets = 0;
+        unsigned int duplicates = 0;
+        unsigned int bad_packets = 0;
+        unsigned int injected_naks = 0;
+        unsigned int injected_drops = 0;
+        unsigned int injected_cancels = 0;
+        unsigned int noise_errors = 0;
+        unsigned int autobauds = 0;
+        unsigned int firmware_lines = 0;
+        std::size_t bytes = 0;
+    };
+
+private:
+    ///The states of the emulated board.
+    enum state_t {
+        AUTOBAUD, COMMAND, FIRMWARE
+    };
+
+    SimulatorOptions options;
+
+    ///The pseudo-terminal master, used by the simulator.
+    int master_fd = -1;
+
+    ///The pseudo-terminal slave, kept open so the master does not hang up when the utility closes it.
+    int slave_fd = -1;
+
+    ///The path of the pseudo-terminal slave.
+    std::string slave_path;
+
+    state_t state = AUTOBAUD;
+
+    ///The controller variable for the run loop.
+    std::atomic<bool> running;
+
+    std::mt19937 rng;
+
+    statistics_t stats;
+
+    ///When the emulated firmware was started.
+    std::chrono::steady_clock::time_point firmware_started;
+
+    ///The bytes read from the pseudo-terminal and not consumed yet.
+    std::vector<uint8_t> input;
+
+    ///The position of the next byte to be consumed in input.
+    std::size_t input_pos = 0;
+
+    ///The baud rate the utility set on the line when the last bytes were received.
+    unsigned int current_baud = 0;
+
+    ///The baud rate the autobaud locked on.
+    unsigned int locked_baud = 0;
+
+    ///The point in time until which the emulated link is busy receiving: the link is full duplex.
+    std::chrono::steady_clock::time_point rx_busy_until;
+
+    ///The point in time until which the emulated link is busy sending.
+    std::chrono::steady_clock::time_point tx_busy_until;
+
+    ///The replies of the windowed mode waiting for the turnaround delay, with the time they are due.
+    std::deque<std::pair<std::chrono::steady_clock::time_point, std::vector<uint8_t>>> pending_replies;
+
+    /**
+     * Waits for the time the emulated link needs for transferring some bytes.
+     * \param busy_until the direction of the link carrying the bytes
+     * \param bytes the number of bytes crossing the link
+     * \return
+     */
+    void pace(std::chrono::steady_clock::time_point &busy_until, std::size_t bytes);
+
+    /**
+     * Writes the pending replies of the windowed mode.
+     * \param all if the replies not due yet are waited for and written too
+     * \return
+     */
+    void flush_replies(bool all);
+
+    /**
+     * Reads the baud rate the utility set on the line.
+     * \return the baud rate, 0 if unknown.
+     */
+    unsigned int line_speed() const;
+
+    /**
+     * Reads a byte from the link.
+     * \param c where the byte is stored
+     * \param timeout_msec the maximum waiting period, negative for infinite
+     * \return false if the timeout expired or the simulator was stopped.
+     */
+    bool read_byte(uint8_t &c, int timeout_msec);
+
+    /**
+     * Reads a sequence of bytes from the link, each one within the inter character timeout.
+     * \return false if the timeout expired or the simulator was stopped.
+     */
+    bool read_bytes(uint8_t *data, std::size_t len);
+
+    /**
+     * Writes raw bytes to the link.
+     * \return
+     */
+    void write_bytes(const void *data, std::size_t len);
+
+    /**
+     * Writes the reply to a packet after the turnaround delay.
+     * \param reply the reply
+     * \param block the block number the reply refers to in windowed mode, negative for a classic XMODEM reply
+     * \return
+     */
+    void write_reply(uint8_t reply, int block = -1);
+
+    /**
+     * Writes a line terminated the way the bootloader does.
+     * \return
+     */
+    void write_line(const std::string &line);
+
+    /**
+     * Handles a byte received in command mode.
+     * \return
+     */
+    void handle_command(uint8_t c);
+
+    /**
+     * Receives an image using XMODEM-CRC, also accepting XMODEM-1K packets.
+     * In windowed mode the sender does not wait for the reply to a frame before sending the next ones, and every
+     * reply is followed by a block number: ACK with the last frame received in sequence, NAK with the frame expected
+     * next. The frames out of sequence are dropped, the sender going back to the one named by the NAK.
+     * \param windowed if the transfer uses the windowed mode
+     * \return if the image was completely received.
+     */
+    bool receive_xmodem(bool windowed);
+
+    /**
+     * Discards the input until the link stays silent for the inter character timeout.
+     * \return
+     */
+    void purge();
+
+    /**
+     * Stores a received image at SimulatorOptions::output_path.
+     * \return
+     */
+    void store_image(const std::vector<uint8_t> &image);
+
+    /**
+     * Prints the next log line of a chatty firmware.
+     * \return
+     */
+    void write_firmware_log();
+
+    /**
+     * Draws from the fault injection generator.
+     * \param rate the probability of the fault
+     * \return if the fault should be injected.
+     */
+    bool inject(double rate);
+
+public:
+    /**
+     * Constructor. Opens the pseudo-terminal.
+     * \throws std::runtime_error if the pseudo-terminal could not be created.
+     * \param options the simulator parameters
+     * \return
+     */
+    explicit BootloaderSimulator(SimulatorOptions options);
+
+    BootloaderSimulator(BootloaderSimulator const &) = delete;
+
+    void operator=(BootloaderSimulator const &) = delete;
+
+    ~BootloaderSimulator();
+
+    /**
+     * Returns the path to be used by the utility for connecting to the simulator.
+     * \return the slave path, or the symlink to it if requested.
+     */
+    const std::string &get_device_path() const;
+
+    /**
+     * Serves the utility until stop is called.
+     * \return
+     */
+    void run();
+
+    /**
+     * Stops the run loop. It is safe to call it from another thread.
+     * \return
+     */
+    void stop();
+
+    /**
+     * Returns the counters of the simulator activity.
+     * \return the statistics.
+     */
+    const statistics_t &get_statistics() const { return stats; }
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_BOOTLOADERSIMULATOR_H
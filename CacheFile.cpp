@@ -0,0 +1,92 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "CacheFile.h"
+#include <cstdlib>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+std::string CacheFile::default_path(const std::string &name) {
+    string dir;
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg != nullptr && *xdg)
+        dir = xdg;
+    else if (home != nullptr && *home)
+        dir = string(home) + "/.cache";
+    else
+        dir = "/tmp";
+    return dir + "/wandstem-flash/" + name;
+}
+
+std::map<std::string, std::string> CacheFile::load() const {
+    if (path.empty()) return memory;
+    map<string, string> result;
+    ifstream in(path);
+    string line;
+    while (getline(in, line)) {
+        auto tab = line.find('\t');
+        if (tab == string::npos) continue;
+        result[line.substr(0, tab)] = line.substr(tab + 1);
+    }
+    return result;
+}
+
+std::string CacheFile::get(const std::string &key) {
+    lock_guard<mutex> lock(mtx);
+    auto all = load();
+    auto it = all.find(key);
+    return it == all.end() ? "" : it->second;
+}
+
+std::map<std::string, std::string> CacheFile::entries() {
+    lock_guard<mutex> lock(mtx);
+    return load();
+}
+
+bool CacheFile::put(const std::string &key, const std::string &value) {
+    lock_guard<mutex> lock(mtx);
+    if (path.empty()) {
+        memory[key] = value;
+        return true;
+    }
+    //create the directories leading to the file
+    for (auto slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1))
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    //the lock file serializes the read-modify-write cycles of concurrent processes
+    int lock_fd = open((path + ".lock").c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0) return false;
+    flock(lock_fd, LOCK_EX);
+    auto all = load();
+    all[key] = value;
+    string tmp_path = path + ".tmp." + to_string(getpid());
+    bool written;
+    {
+        ofstream out(tmp_path, ios::trunc);
+        for (auto &entry : all)
+            out << entry.first << '\t' << entry.second << '\n';
+        written = static_cast<bool>(out.flush());
+    }
+    written = written && rename(tmp_path.c_str(), path.c_str()) == 0;
+    if (!written) unlink(tmp_path.c_str());
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+    return written;
+}
@@ -0,0 +1,68 @@
+#ifndef WANDSTEM_FLASH_UTILITY_CACHEFILE_H
+#define WANDSTEM_FLASH_UTILITY_CACHEFILE_H
+
+#include <string>
+#include <map>
+#include <mutex>
+
+/**
+ * This class models a small persistent key-value record, stored as a text file with one tab separated entry per
+ * line. Updates are atomic and serialized, both among threads and among processes.
+ * A cache with an empty path lives only in memory, for runs that must not touch the persistent records.
+ */
+class CacheFile {
+private:
+    /// The path of the file.
+    std::string path;
+
+    /// Serializes the updates of the threads of this process.
+    std::mutex mtx;
+
+    /// The entries of a cache living only in memory.
+    std::map<std::string, std::string> memory;
+
+    /**
+     * Reads every entry of the file.
+     * \return the entries, empty if the file does not exist.
+     */
+    std::map<std::string, std::string> load() const;
+
+public:
+    /**
+     * Constructor.
+     * \param path the path of the file, which is created on the first update, empty for a cache in memory
+     * \return
+     */
+    explicit CacheFile(std::string path) : path(std::move(path)) {}
+
+    /**
+     * Returns the path of a cache file in the user cache directory ($XDG_CACHE_HOME/wandstem-flash, or
+     * ~/.cache/wandstem-flash).
+     * \param name the name of the file
+     * \return the path.
+     */
+    static std::string default_path(const std::string &name);
+
+    /**
+     * Gets the value of a key.
+     * \param key the key
+     * \return the value, empty if the key is not present.
+     */
+    std::string get(const std::string &key);
+
+    /**
+     * Sets the value of a key, replacing the file atomically.
+     * \param key the key, without whitespace
+     * \param value the value, without newlines
+     * \return false if the file could not be written.
+     */
+    bool put(const std::string &key, const std::string &value);
+
+    /**
+     * Gets every entry.
+     * \return the entries.
+     */
+    std::map<std::string, std::string> entries();
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_CACHEFILE_H
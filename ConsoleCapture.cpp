@@ -0,0 +1,170 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "ConsoleCapture.h"
+#include "Device.h"
+#include "Exceptions.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+
+using namespace std;
+
+namespace {
+
+void write_all(int fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t written = ::write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw FileIOException(string("Cannot write the device output: ") + strerror(errno));
+        }
+        data += written;
+        len -= static_cast<size_t>(written);
+    }
+}
+
+}
+
+ConsoleCapture::ConsoleCapture(int out_fd) : out_fd(out_fd), buffer(captureBufferSize) {}
+
+ConsoleCapture::~ConsoleCapture() {
+    if (tee_fd >= 0) ::close(tee_fd);
+}
+
+void ConsoleCapture::tee(const std::string &path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw FileIOException("Cannot open " + path + ": " + strerror(errno));
+    if (tee_fd >= 0) ::close(tee_fd);
+    tee_fd = fd;
+}
+
+void ConsoleCapture::emit(std::size_t len) {
+    if (!len) return;
+    write_all(out_fd, buffer.data(), len);
+    if (tee_fd >= 0) write_all(tee_fd, buffer.data(), len);
+    memmove(buffer.data(), buffer.data() + len, used - len);
+    used -= len;
+}
+
+void ConsoleCapture::record(const char *data, std::size_t len, const ring_stamp_t &stamp) {
+    while (len) {
+        if (!line_started) {
+            line_started = true;
+            line_stamp = stamp;
+        }
+        auto end = static_cast<const char *>(memchr(data, '\n', len));
+        size_t take = end != nullptr ? static_cast<size_t>(end - data) : len;
+        //an endless line is recorded in pieces
+        take = min(take, ringLogMaxLine - line.size());
+        line.append(data, take);
+        data += take;
+        len -= take;
+        if (len && *data == '\n') {
+            data++;
+            len--;
+            commit_line();
+        } else if (line.size() == ringLogMaxLine) {
+            commit_line();
+        }
+    }
+}
+
+void ConsoleCapture::commit_line() {
+    size_t len = line.size();
+    if (len && line[len - 1] == '\r') len--;
+    ring->append(line_stamp, line.data(), len);
+    line.clear();
+    line_started = false;
+}
+
+void ConsoleCapture::add_trigger(const std::string &pattern, bool stop, int exit_code) {
+    matcher.add(pattern);
+    triggers.push_back({pattern, stop, exit_code, 0});
+}
+
+bool ConsoleCapture::watch(const char *data, std::size_t len) {
+    matcher.scan(data, len, [this](size_t id, size_t) {
+        triggers[id].count++;
+        //the first pattern stopping the capture wins
+        if (triggers[id].stop && fired < 0) fired = static_cast<int>(id);
+        return fired < 0;
+    });
+    return fired >= 0;
+}
+
+ConsoleCapture::stop_reason ConsoleCapture::run(Device &device) {
+    //when the oldest byte not written yet must be written at the latest
+    chrono::steady_clock::time_point flush_deadline;
+    //when the device is idle for too long, unless it sends something
+    auto idle_deadline = chrono::steady_clock::now() + chrono::milliseconds(idle_msec);
+    if (!triggers.empty()) matcher.build();
+    fired = -1;
+    try {
+        for (;;) {
+            int timeout = 0;
+            auto now = chrono::steady_clock::now();
+            if (used) {
+                auto left = chrono::duration_cast<chrono::milliseconds>(flush_deadline - now);
+                timeout = static_cast<int>(left.count());
+                if (timeout <= 0) {
+                    emit(used);
+                    continue;
+                }
+            }
+            if (idle_msec) {
+                auto left = static_cast<int>(chrono::duration_cast<chrono::milliseconds>(idle_deadline - now).count());
+                if (left <= 0) {
+                    emit(used);
+                    if (ring != nullptr && line_started) commit_line();
+                    return IDLE;
+                }
+                if (!timeout || left < timeout) timeout = left;
+            }
+            size_t got;
+            try {
+                got = device.read_some(buffer.data() + used, buffer.size() - used, timeout);
+                if (ring != nullptr) record(buffer.data() + used, got, RingLog::now());
+            } catch (TimeoutException &ex) {
+                //the device paused, the partial line goes out too
+                emit(used);
+                continue;
+            }
+            if (idle_msec) idle_deadline = chrono::steady_clock::now() + chrono::milliseconds(idle_msec);
+            bool matched = !triggers.empty() && watch(buffer.data() + used, got);
+            if (!used) flush_deadline = chrono::steady_clock::now() + chrono::milliseconds(captureFlushMsec);
+            used += got;
+            total_bytes += got;
+            if (matched) {
+                //the result is out the moment it arrived, with the rest of what was read along with it
+                emit(used);
+                if (ring != nullptr && line_started) commit_line();
+                return MATCHED;
+            }
+            if (used < captureFlushBytes) continue;
+            //a full block, cut at the last line boundary unless there is none
+            auto last = static_cast<const char *>(memrchr(buffer.data(), '\n', used));
+            emit(last != nullptr ? static_cast<size_t>(last - buffer.data()) + 1 : used);
+            if (used) flush_deadline = chrono::steady_clock::now() + chrono::milliseconds(captureFlushMsec);
+        }
+    } catch (ios::failure &ex) {
+        if (dynamic_cast<FileIOException *>(&ex) == nullptr) emit(used);
+        if (ring != nullptr && line_started) commit_line();
+        throw;
+    }
+}
@@ -0,0 +1,187 @@
+#ifndef WANDSTEM_FLASH_UTILITY_CONSOLECAPTURE_H
+#define WANDSTEM_FLASH_UTILITY_CONSOLECAPTURE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unistd.h>
+#include "RingLog.h"
+#include "PatternMatcher.h"
+
+class Device;
+
+static const std::size_t captureBufferSize=64*1024;
+static const std::size_t captureFlushBytes=16*1024;
+static const int captureFlushMsec=50;
+static const int captureIdleExitCode=124;
+
+/**
+ * This class copies the output of a device to the terminal, and optionally to a file, keeping up with fast links.
+ * The bytes are read in bulk as they arrive and written out in large blocks ending at a line boundary, once enough
+ * of them piled up or the oldest one waited captureFlushMsec. The same buffer goes to the terminal and to the file.
+ * The lines can also be recorded in a RingLog, each stamped with the host clocks read right after the read returning
+ * its first byte.
+ * Patterns can be watched for in the output, to count them or to stop the capture the moment one appears, as well as
+ * a silence of the device: all of them are found by a single PatternMatcher as the bytes arrive.
+ */
+class ConsoleCapture {
+public:
+    ///Why run returned.
+    enum stop_reason {
+        ///A pattern stopping the capture appeared.
+        MATCHED,
+        ///The device was silent for the idle timeout.
+        IDLE
+    };
+
+    ///A pattern watched for in the output.
+    struct trigger_t {
+        std::string pattern;
+        ///If the capture stops when the pattern appears, rather than just counting it.
+        bool stop;
+        ///The exit status of the process when the pattern stops the capture.
+        int exit_code;
+        uint64_t count;
+    };
+
+private:
+    int out_fd;
+
+    ///The file the output is copied to, -1 if none.
+    int tee_fd = -1;
+
+    std::vector<char> buffer;
+
+    ///The bytes in buffer not written yet.
+    std::size_t used = 0;
+
+    uint64_t total_bytes = 0;
+
+    ///The log the lines are recorded in, nullptr if none.
+    RingLog *ring = nullptr;
+
+    ///The line being received, not recorded yet.
+    std::string line;
+
+    ///If the first byte of line was received, since a line can be empty.
+    bool line_started = false;
+
+    ///When the first byte of line was received.
+    ring_stamp_t line_stamp;
+
+    ///The patterns watched for, by PatternMatcher id.
+    std::vector<trigger_t> triggers;
+
+    PatternMatcher matcher;
+
+    ///The trigger that stopped the capture, -1 if none.
+    int fired = -1;
+
+    ///How long the device may be silent before the capture stops, 0 for ever.
+    int idle_msec = 0;
+
+    /**
+     * Looks for the patterns in the received bytes, counting them.
+     * \param data the bytes
+     * \param len the number of bytes
+     * \return if a trigger stops the capture.
+     */
+    bool watch(const char *data, std::size_t len);
+
+    /**
+     * Splits the received bytes in lines and records the complete ones.
+     * \param data the bytes
+     * \param len the number of bytes
+     * \param stamp when the bytes were received
+     * \return
+     */
+    void record(const char *data, std::size_t len, const ring_stamp_t &stamp);
+
+    /**
+     * Records the line being received, without its terminator.
+     * \return
+     */
+    void commit_line();
+
+    /**
+     * Writes the first bytes of the buffer and moves the rest to its front.
+     * \throws FileIOException If a write failed.
+     * \param len the number of bytes to be written
+     * \return
+     */
+    void emit(std::size_t len);
+
+public:
+    /**
+     * Constructor.
+     * \param out_fd the file descriptor the output is written to
+     */
+    explicit ConsoleCapture(int out_fd = STDOUT_FILENO);
+
+    ConsoleCapture(ConsoleCapture const &) = delete;
+
+    void operator=(ConsoleCapture const &) = delete;
+
+    ~ConsoleCapture();
+
+    /**
+     * Copies the output to a file too, appending to it.
+     * \throws FileIOException If the file could not be opened.
+     * \param path the path of the file
+     * \return
+     */
+    void tee(const std::string &path);
+
+    /**
+     * Records the lines in a log too.
+     * \param log the log, which must outlive the capture
+     * \return
+     */
+    void record(RingLog &log) { ring = &log; }
+
+    /**
+     * Watches for a pattern in the output. The patterns can span lines, they are matched against the bytes as they
+     * arrive.
+     * \param pattern the bytes to be found, not empty
+     * \param stop if the capture stops when the pattern appears, rather than just counting it
+     * \param exit_code the exit status of the process when the pattern stops the capture
+     * \return
+     */
+    void add_trigger(const std::string &pattern, bool stop, int exit_code = 0);
+
+    /**
+     * Stops the capture when the device is silent for a while.
+     * \param msec the silence, 0 for never
+     * \return
+     */
+    void set_idle_timeout(int msec) { idle_msec = msec; }
+
+    /**
+     * Gets the patterns watched for, with the times they appeared.
+     * \return the triggers, in the order they were added.
+     */
+    const std::vector<trigger_t> &get_triggers() const { return triggers; }
+
+    /**
+     * Gets the trigger that stopped the capture.
+     * \return the trigger, nullptr if none did.
+     */
+    const trigger_t *get_fired() const { return fired < 0 ? nullptr : &triggers[fired]; }
+
+    /**
+     * Copies the output of the device until the program is interrupted, a trigger stops it or the device is idle.
+     * \throws InterruptedException When the program is interrupted, after writing what was received.
+     * \throws std::ios_base::failure If the communication with the device failed.
+     * \param device the device, with its communication open
+     * \return why the capture stopped, after writing what was received.
+     */
+    stop_reason run(Device &device);
+
+    /**
+     * Gets the number of bytes copied so far.
+     * \return the number of bytes.
+     */
+    uint64_t get_total_bytes() const { return total_bytes; }
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_CONSOLECAPTURE_H
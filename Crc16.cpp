@@ -0,0 +1,160 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "Crc16.h"
+#include <array>
+#include <random>
+#include <vector>
+#include <boost/crc.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC16_HAVE_CLMUL
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+typedef array<array<uint16_t, 256>, 8> crc16_table_t;
+
+/// Shifts the remainder by some bits, dividing by the polynomial.
+constexpr uint16_t crc16_shift(uint16_t crc, int bits) {
+    return bits == 0 ? crc : crc16_shift(static_cast<uint16_t>(crc & 0x8000 ? (crc << 1) ^ crc16Polynomial : crc << 1),
+                                         bits - 1);
+}
+
+/// Feeds a zero byte to the remainder.
+constexpr uint16_t crc16_zero_byte(uint16_t crc) {
+    return static_cast<uint16_t>((crc << 8) ^ crc16_shift(static_cast<uint16_t>(crc & 0xFF00), 8));
+}
+
+/// The remainder of a byte followed by slice zero bytes.
+constexpr uint16_t crc16_entry(int slice, unsigned int byte) {
+    return slice == 0 ? crc16_shift(static_cast<uint16_t>(byte << 8), 8) : crc16_zero_byte(crc16_entry(slice - 1, byte));
+}
+
+/// The remainder of x^n, used as folding constant.
+constexpr uint64_t crc16_xpow(int n) {
+    return n < 16 ? 1ull << n : crc16_shift(static_cast<uint16_t>(crc16_xpow(n - 1)), 1);
+}
+
+template<size_t... I>
+struct index_list {};
+
+template<size_t N, size_t... I>
+struct make_index_list : make_index_list<N - 1, N - 1, I...> {};
+
+template<size_t... I>
+struct make_index_list<0, I...> {
+    typedef index_list<I...> type;
+};
+
+template<size_t... I>
+constexpr crc16_table_t make_table(index_list<I...>) {
+    return {{{{crc16_entry(0, I)...}}, {{crc16_entry(1, I)...}}, {{crc16_entry(2, I)...}}, {{crc16_entry(3, I)...}},
+             {{crc16_entry(4, I)...}}, {{crc16_entry(5, I)...}}, {{crc16_entry(6, I)...}}, {{crc16_entry(7, I)...}}}};
+}
+
+/// table[k][b] is the remainder of the byte b followed by k zero bytes.
+constexpr crc16_table_t table = make_table(make_index_list<256>::type());
+
+static_assert(table[0][1] == crc16Polynomial, "CRC table generation is broken");
+
+inline uint16_t update_byte(uint16_t crc, uint8_t byte) {
+    return static_cast<uint16_t>((crc << 8) ^ table[0][(crc >> 8) ^ byte]);
+}
+
+#ifdef CRC16_HAVE_CLMUL
+/// Folding constants: a 128 bits block times x^128 is congruent to hi * x^192 + lo * x^128.
+constexpr uint64_t foldHi = crc16_xpow(192);
+constexpr uint64_t foldLo = crc16_xpow(128);
+
+__attribute__((target("pclmul,ssse3")))
+uint16_t clmul_kernel(const uint8_t *data, size_t len, uint16_t crc) {
+    //the CRC is not reflected: the first byte holds the highest powers, so every block is loaded big endian
+    const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m128i fold = _mm_set_epi64x(static_cast<long long>(foldHi), static_cast<long long>(foldLo));
+    __m128i acc = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)), bswap);
+    acc = _mm_xor_si128(acc, _mm_set_epi64x(static_cast<long long>(static_cast<uint64_t>(crc) << 48), 0));
+    data += 16;
+    len -= 16;
+    for (; len >= 16; data += 16, len -= 16) {
+        __m128i block = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)), bswap);
+        __m128i hi = _mm_clmulepi64_si128(acc, fold, 0x11);
+        __m128i lo = _mm_clmulepi64_si128(acc, fold, 0x00);
+        acc = _mm_xor_si128(_mm_xor_si128(hi, lo), block);
+    }
+    //the folded 128 bits are congruent to everything processed so far, reduce them with the tables
+    alignas(16) uint8_t folded[16];
+    _mm_store_si128(reinterpret_cast<__m128i *>(folded), _mm_shuffle_epi8(acc, bswap));
+    crc = Crc16::compute_sliced(folded, sizeof(folded));
+    return Crc16::compute_sliced(data, len, crc);
+}
+#endif
+
+}
+
+uint16_t Crc16::compute_sliced(const uint8_t *data, std::size_t len, uint16_t crc) {
+    for (; len >= 8; data += 8, len -= 8) {
+        crc ^= static_cast<uint16_t>(data[0] << 8 | data[1]);
+        crc = table[7][crc >> 8] ^ table[6][crc & 0xFF] ^ table[5][data[2]] ^ table[4][data[3]] ^
+              table[3][data[4]] ^ table[2][data[5]] ^ table[1][data[6]] ^ table[0][data[7]];
+    }
+    for (; len; len--)
+        crc = update_byte(crc, *data++);
+    return crc;
+}
+
+bool Crc16::has_clmul() {
+#ifdef CRC16_HAVE_CLMUL
+    static const bool supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+uint16_t Crc16::compute_clmul(const uint8_t *data, std::size_t len, uint16_t crc) {
+#ifdef CRC16_HAVE_CLMUL
+    //below two blocks the setup costs more than the folding saves
+    if (len >= 32) return clmul_kernel(data, len, crc);
+#endif
+    return compute_sliced(data, len, crc);
+}
+
+uint16_t Crc16::compute(const uint8_t *data, std::size_t len, uint16_t crc) {
+    return has_clmul() ? compute_clmul(data, len, crc) : compute_sliced(data, len, crc);
+}
+
+bool Crc16::self_test() {
+    mt19937 rng(0x1021);
+    vector<uint8_t> data(4096);
+    for (auto &byte : data)
+        byte = static_cast<uint8_t>(rng());
+
+    for (size_t len = 0; len <= data.size(); len += len < 300 ? 1 : 127) {
+        for (size_t offset = 0; offset < 4 && offset + len <= data.size(); offset++) {
+            auto initial = static_cast<uint16_t>(rng());
+            boost::crc_optimal<16, crc16Polynomial, 0, 0, false, false> reference(initial);
+            reference.process_bytes(data.data() + offset, len);
+            if (compute_sliced(data.data() + offset, len, initial) != reference.checksum())
+                return false;
+            if (has_clmul() && compute_clmul(data.data() + offset, len, initial) != reference.checksum())
+                return false;
+        }
+    }
+    return true;
+}
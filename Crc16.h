@@ -0,0 +1,59 @@
+#ifndef WANDSTEM_FLASH_UTILITY_CRC16_H
+#define WANDSTEM_FLASH_UTILITY_CRC16_H
+
+#include <cstddef>
+#include <cstdint>
+
+static const uint16_t crc16Polynomial=0x1021;
+
+/**
+ * This class computes the CRC16-CCITT variant used by XMODEM-CRC (remainder initialized to zero, no reflection).
+ * Every function is reentrant: the lookup tables are generated at compile time and no state is shared, so any
+ * number of threads can compute CRCs concurrently.
+ */
+class Crc16 {
+public:
+    Crc16() = delete;
+
+    /**
+     * Computes the CRC of a block using the fastest kernel available on this CPU.
+     * \param data the bytes to be processed
+     * \param len the number of bytes
+     * \param crc the CRC of the preceding bytes, for computing it incrementally
+     * \return the CRC.
+     */
+    static uint16_t compute(const uint8_t *data, std::size_t len, uint16_t crc = 0);
+
+    /**
+     * Computes the CRC of a block using the portable slice-by-8 kernel.
+     * \param data the bytes to be processed
+     * \param len the number of bytes
+     * \param crc the CRC of the preceding bytes, for computing it incrementally
+     * \return the CRC.
+     */
+    static uint16_t compute_sliced(const uint8_t *data, std::size_t len, uint16_t crc = 0);
+
+    /**
+     * Computes the CRC of a block using the carry-less multiplication kernel.
+     * It must be called only if has_clmul returned true.
+     * \param data the bytes to be processed
+     * \param len the number of bytes
+     * \param crc the CRC of the preceding bytes, for computing it incrementally
+     * \return the CRC.
+     */
+    static uint16_t compute_clmul(const uint8_t *data, std::size_t len, uint16_t crc = 0);
+
+    /**
+     * Checks if the CPU supports the carry-less multiplication kernel.
+     * \return if compute_clmul can be used.
+     */
+    static bool has_clmul();
+
+    /**
+     * Checks every kernel against the boost::crc reference implementation.
+     * \return if all the kernels agree with the reference.
+     */
+    static bool self_test();
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_CRC16_H
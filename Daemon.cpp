@@ -0,0 +1,285 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "Daemon.h"
+#include "DaemonProtocol.h"
+#include "ImageLoader.h"
+#include "SerialPort.h"
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using namespace std;
+
+Daemon::job_t::~job_t() {
+    ::close(fd);
+}
+
+void Daemon::job_t::send(const std::vector<std::string> &fields) {
+    string line = join_fields(fields);
+    const char *data = line.data();
+    size_t len = line.size();
+    while (len && !aborted) {
+        ssize_t sent = ::send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) {
+            //the client went away, its job is not wanted anymore
+            aborted = true;
+            return;
+        }
+        data += sent;
+        len -= static_cast<size_t>(sent);
+    }
+}
+
+Daemon::~Daemon() {
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto &entry : sessions)
+        if (entry.second->worker.joinable()) entry.second->worker.join();
+    if (listen_fd >= 0) {
+        ::close(listen_fd);
+        unlink(socket_path.c_str());
+    }
+}
+
+void Daemon::run() {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        throw runtime_error("The socket path is too long: " + socket_path);
+    strcpy(addr.sun_path, socket_path.c_str());
+    auto address = reinterpret_cast<const sockaddr *>(&addr);
+
+    //a socket nobody answers on is a leftover of a daemon that crashed
+    int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool in_use = probe_fd >= 0 && connect(probe_fd, address, sizeof(addr)) == 0;
+    if (probe_fd >= 0) ::close(probe_fd);
+    if (in_use)
+        throw runtime_error("Another daemon is serving " + socket_path);
+    unlink(socket_path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        throw runtime_error("Cannot serve " + socket_path + ": " + strerror(errno));
+    //the socket must never be reachable by other users, not even between its creation and a chmod: it is created
+    //0600, no other thread runs yet to be affected by the umask
+    mode_t mask = umask(0077);
+    int bound = bind(listen_fd, address, sizeof(addr));
+    int bind_errno = errno;
+    umask(mask);
+    errno = bind_errno;
+    if (bound || listen(listen_fd, SOMAXCONN))
+        throw runtime_error("Cannot serve " + socket_path + ": " + strerror(errno));
+
+    int interrupt_fd = SerialPort::interrupt_descriptor();
+    for (;;) {
+        pollfd fds[2] = {{listen_fd, POLLIN, 0}, {interrupt_fd, POLLIN, 0}};
+        if (poll(fds, interrupt_fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) break;
+        if (!(fds[0].revents & POLLIN)) continue;
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) accept_request(fd);
+    }
+    if (interrupt_fd >= 0) ::close(interrupt_fd);
+
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto &entry : sessions)
+        if (entry.second->worker.joinable()) entry.second->worker.join();
+}
+
+void Daemon::accept_request(int fd) {
+    //the request is a single short line sent right away, a client stalling does not hold the others for long
+    string line;
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(daemonRequestTimeoutMsec);
+    char buffer[512];
+    while (line.find('\n') == string::npos && line.size() < daemonMaxRequest) {
+        auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        pollfd p{fd, POLLIN, 0};
+        ssize_t got = left > 0 && poll(&p, 1, static_cast<int>(left)) > 0 ? ::read(fd, buffer, sizeof(buffer)) : 0;
+        if (got <= 0) break;
+        line.append(buffer, static_cast<size_t>(got));
+    }
+    unique_ptr<job_t> job(new job_t(vector<string>(), fd));
+    auto end = line.find('\n');
+    if (end == string::npos) {
+        job->send({"error", "Incomplete request"});
+        return;
+    }
+    line.resize(end);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    job->fields = split_fields(line);
+    auto &kind = job->fields[0];
+    if (kind == "status" && job->fields.size() == 1) {
+        send_status(*job);
+        return;
+    }
+    bool known = (kind == "flash" && job->fields.size() >= 3) || (kind == "reboot" && job->fields.size() == 2) ||
+                 (kind == "monitor" && job->fields.size() == 3);
+    if (!known) {
+        job->send({"error", "Unknown request: " + line});
+        return;
+    }
+    //aliases of a port, e.g. its /dev/serial/by-id link, share its session
+    string path = job->fields[1];
+    char real[PATH_MAX];
+    if (realpath(path.c_str(), real) != nullptr) path = real;
+
+    lock_guard<mutex> lock(mtx);
+    auto &session = sessions[path];
+    if (!session) {
+        session.reset(new session_t);
+        session->path = path;
+        session->worker = thread(&Daemon::work, this, ref(*session));
+    }
+    job->send({"queued", to_string(session->queue.size() + (session->busy ? 1 : 0))});
+    session->queue.push_back(move(job));
+    cv.notify_all();
+}
+
+void Daemon::send_status(job_t &job) {
+    lock_guard<mutex> lock(mtx);
+    for (auto &entry : sessions) {
+        auto &session = *entry.second;
+        job.send({"status", session.path, session.busy ? "busy" : "idle", to_string(session.queue.size()),
+                  to_string(session.done), session.chip_id});
+    }
+    job.send({"ok", to_string(sessions.size()) + " ports"});
+}
+
+void Daemon::work(session_t &session) {
+    unique_lock<mutex> lock(mtx);
+    for (;;) {
+        cv.wait(lock, [this, &session] { return stopping || !session.queue.empty(); });
+        if (stopping) break;
+        unique_ptr<job_t> job = move(session.queue.front());
+        session.queue.pop_front();
+        session.busy = true;
+        lock.unlock();
+
+        FlashSession::result_t result;
+        try {
+            result = run_job(session, *job);
+        } catch (exception &ex) {
+            result.code = FlashSession::UNEXPECTED_ERROR;
+            result.message = ex.what();
+        }
+        string chip_id = session.board ? session.board->get_device().get_chip_id() : "";
+        //a failed job may have left the port or the bootloader in any state, the next one starts afresh
+        if (result.code != FlashSession::OK) session.board.reset();
+        job->send({result.code == FlashSession::OK ? "ok" : "error", result.message});
+        job.reset();
+
+        lock.lock();
+        session.busy = false;
+        session.done++;
+        if (!chip_id.empty()) session.chip_id = chip_id;
+    }
+    for (auto &job : session.queue)
+        job->send({"error", "The daemon is stopping"});
+    session.queue.clear();
+}
+
+FlashSession::result_t Daemon::run_job(session_t &session, job_t &job) {
+    if (!session.board) session.board.reset(new FlashSession(unique_ptr<Device>(factory(session.path))));
+    FlashSession &board = *session.board;
+    FlashSession::callbacks_t callbacks;
+    callbacks.log = [&job](const string &message) { job.send({"log", message}); };
+    FlashSession::result_t result;
+    auto &kind = job.fields[0];
+    if (kind == "flash") result = run_flash(board, job, callbacks);
+    else if (kind == "monitor") result = run_monitor(board, job, callbacks);
+    else result = run_reboot(board, callbacks);
+    //the callbacks refer to the job, which is gone once answered
+    board.set_callbacks(FlashSession::callbacks_t());
+    return result;
+}
+
+FlashSession::result_t Daemon::run_flash(FlashSession &board, job_t &job, FlashSession::callbacks_t callbacks) {
+    flash_options_t options = defaults;
+    for (size_t i = 3; i < job.fields.size(); i++) {
+        auto &option = job.fields[i];
+        if (option == "xmodem-1k") options.xmodem_1k = true;
+        else if (option == "skip-unchanged") options.skip_unchanged = true;
+        else if (option == "no-trim") options.trim_erased = false;
+        else if (option.compare(0, 7, "format=") == 0) {
+            if (!ImageLoader::parse_format(option.substr(7), options.format))
+                throw runtime_error("Unknown image format: " + option.substr(7));
+        } else throw runtime_error("Unknown flash option: " + option);
+    }
+
+    chrono::steady_clock::time_point last_progress;
+    //the total of a compressed image is known only once it has been decompressed, and is then 0
+    callbacks.progress = [&job, &board, &last_progress](size_t bytes, size_t total) {
+        auto now = chrono::steady_clock::now();
+        if (bytes != total && now - last_progress < chrono::milliseconds(daemonProgressPeriodMsec)) return;
+        last_progress = now;
+        job.send({"progress", to_string(bytes), to_string(total)});
+        if (job.aborted) board.cancel();
+    };
+    board.set_callbacks(std::move(callbacks));
+
+    //whatever the firmware printed since the last job is of no interest
+    board.get_device().discard_input();
+    auto result = board.flash(job.fields[2], options);
+    if (result.code != FlashSession::OK) return result;
+    auto &device = board.get_device();
+    if (result.report.skipped) {
+        result.message = "The device " + device.get_chip_id() + " already has this image";
+        return result;
+    }
+    ostringstream summary;
+    summary << "Flashed " << result.report.bytes << " bytes on " << device.get_chip_id() << " in " << fixed
+            << setprecision(3) << result.report.transfer_seconds << " s, " << result.report.retransmissions
+            << " retransmissions";
+    result.message = summary.str();
+    return result;
+}
+
+FlashSession::result_t Daemon::run_monitor(FlashSession &board, job_t &job, FlashSession::callbacks_t callbacks) {
+    callbacks.output = [&job](const string &line) { job.send({"output", line}); };
+    callbacks.keep_monitoring = [&job] {
+        //the client sends nothing after the request, anything readable means it hung up
+        pollfd p{job.fd, POLLIN | POLLRDHUP, 0};
+        return !job.aborted && poll(&p, 1, 0) <= 0;
+    };
+    board.set_callbacks(std::move(callbacks));
+    return board.monitor(atof(job.fields[2].c_str()));
+}
+
+FlashSession::result_t Daemon::run_reboot(FlashSession &board, FlashSession::callbacks_t callbacks) {
+    board.set_callbacks(std::move(callbacks));
+    auto result = board.reboot();
+    if (result.code == FlashSession::OK) result.message = "Rebooted " + board.get_device().get_chip_id();
+    return result;
+}
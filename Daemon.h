@@ -0,0 +1,135 @@
+#ifndef WANDSTEM_FLASH_UTILITY_DAEMON_H
+#define WANDSTEM_FLASH_UTILITY_DAEMON_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include "Device.h"
+#include "Fleet.h"
+#include "FlashSession.h"
+
+static const int daemonRequestTimeoutMsec=1000;
+static const int daemonProgressPeriodMsec=100;
+
+/**
+ * This class serves flash, monitor and reboot jobs received over a Unix domain socket, see DaemonProtocol.h.
+ * Every port gets a session: a queue of jobs run in order by its own thread, and a FlashSession kept open between
+ * them, so the port is opened, configured and autobauded once and every later job only pays for the handshake that
+ * synchronizes with the bootloader and for the transfer. Progress and messages are streamed back to the client
+ * while the job runs; a client disconnecting aborts its job.
+ */
+class Daemon {
+private:
+    ///A request of a client, owning its connection.
+    struct job_t {
+        std::vector<std::string> fields;
+        int fd;
+        ///Becomes true when the client disconnects.
+        std::atomic<bool> aborted;
+
+        job_t(std::vector<std::string> fields, int fd) : fields(std::move(fields)), fd(fd), aborted(false) {}
+
+        ~job_t();
+
+        /**
+         * Sends a line to the client, marking the job aborted if it disconnected.
+         * \return
+         */
+        void send(const std::vector<std::string> &fields);
+    };
+
+    ///The jobs of a port and the device serving them.
+    struct session_t {
+        std::string path;
+        std::deque<std::unique_ptr<job_t>> queue;
+        bool busy = false;
+        unsigned int done = 0;
+        ///The Chip ID of the device, as of the last job.
+        std::string chip_id;
+        ///Drives the device, kept open between jobs, accessed only by the worker.
+        std::unique_ptr<FlashSession> board;
+        std::thread worker;
+    };
+
+    std::string socket_path;
+
+    Fleet::device_factory_t factory;
+
+    ///The options every flash job starts from.
+    flash_options_t defaults;
+
+    int listen_fd = -1;
+
+    ///Protects the sessions and their queues.
+    std::mutex mtx;
+
+    std::condition_variable cv;
+
+    std::map<std::string, std::unique_ptr<session_t>> sessions;
+
+    bool stopping = false;
+
+    /**
+     * Reads the request of a client and queues or answers it.
+     * \param fd the connection, taken over
+     * \return
+     */
+    void accept_request(int fd);
+
+    /**
+     * Runs the jobs of a session until the daemon stops.
+     * \return
+     */
+    void work(session_t &session);
+
+    /**
+     * Runs a job on a session.
+     * \throws std::exception If the request is malformed.
+     * \return the result, whose message is the summary of the outcome on success.
+     */
+    FlashSession::result_t run_job(session_t &session, job_t &job);
+
+    FlashSession::result_t run_flash(FlashSession &board, job_t &job, FlashSession::callbacks_t callbacks);
+
+    FlashSession::result_t run_monitor(FlashSession &board, job_t &job, FlashSession::callbacks_t callbacks);
+
+    FlashSession::result_t run_reboot(FlashSession &board, FlashSession::callbacks_t callbacks);
+
+    /**
+     * Sends the state of every session.
+     * \return
+     */
+    void send_status(job_t &job);
+
+public:
+    /**
+     * Constructor.
+     * \param socket_path the path of the socket
+     * \param factory the function instantiating the Device of a path
+     * \param defaults the options every flash job starts from
+     * \return
+     */
+    Daemon(std::string socket_path, Fleet::device_factory_t factory, flash_options_t defaults)
+            : socket_path(std::move(socket_path)), factory(std::move(factory)), defaults(std::move(defaults)) {}
+
+    Daemon(Daemon const &) = delete;
+
+    void operator=(Daemon const &) = delete;
+
+    ~Daemon();
+
+    /**
+     * Serves the clients until the program is interrupted.
+     * \throws std::runtime_error If the socket could not be created or another daemon is using it.
+     * \return
+     */
+    void run();
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_DAEMON_H
@@ -0,0 +1,74 @@
+#ifndef WANDSTEM_FLASH_UTILITY_DAEMONPROTOCOL_H
+#define WANDSTEM_FLASH_UTILITY_DAEMONPROTOCOL_H
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+
+/*
+ * The flash daemon and its clients talk over a Unix domain socket with lines of tab separated fields.
+ * The client sends one request:
+ *   flash <port> <image> [xmodem-1k] [skip-unchanged] [no-trim] [format=<raw|elf|ihex|srec>]
+ *   reboot <port>
+ *   monitor <port> <seconds, 0 for until the client disconnects>
+ *   status
+ * The daemon replies with any number of
+ *   queued <jobs ahead>
+ *   progress <bytes sent> <bytes total>, the total being 0 while a compressed image is being decompressed
+ *   log <message>
+ *   output <line printed by the device>
+ *   status <port> <idle|busy> <jobs queued> <jobs done> <Chip ID>
+ * and ends with exactly one of
+ *   ok <summary>
+ *   error <message>
+ */
+
+static const char daemonFieldSeparator='\t';
+static const std::size_t daemonMaxRequest=4096;
+
+/**
+ * Gets the default path of the daemon socket: $XDG_RUNTIME_DIR/wandstem-flash.sock, or
+ * /tmp/wandstem-flash-<uid>.sock.
+ * \return the path.
+ */
+inline std::string daemon_socket_path() {
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime != nullptr && *runtime)
+        return std::string(runtime) + "/wandstem-flash.sock";
+    return "/tmp/wandstem-flash-" + std::to_string(getuid()) + ".sock";
+}
+
+/**
+ * Splits a protocol line in its fields.
+ * \param line the line, without terminator
+ * \return the fields.
+ */
+inline std::vector<std::string> split_fields(const std::string &line) {
+    std::vector<std::string> fields;
+    std::size_t start = 0;
+    for (;;) {
+        auto end = line.find(daemonFieldSeparator, start);
+        fields.push_back(line.substr(start, end - start));
+        if (end == std::string::npos) return fields;
+        start = end + 1;
+    }
+}
+
+/**
+ * Joins fields in a protocol line. Separators and line terminators in the fields are replaced by spaces.
+ * \param fields the fields
+ * \return the line, with its terminator.
+ */
+inline std::string join_fields(const std::vector<std::string> &fields) {
+    std::string line;
+    for (std::size_t i = 0; i < fields.size(); i++) {
+        if (i) line += daemonFieldSeparator;
+        for (char c : fields[i])
+            line += c == daemonFieldSeparator || c == '\n' || c == '\r' ? ' ' : c;
+    }
+    line += '\n';
+    return line;
+}
+
+#endif //WANDSTEM_FLASH_UTILITY_DAEMONPROTOCOL_H
@@ -17,166 +17,693 @@
 
 #include "Device.h"
 #include "XmodemPacket.h"
+#include "ImageSource.h"
+#include "ImageLoader.h"
+#include "PacketProducer.h"
+#include "CacheFile.h"
 #include "Exceptions.h"
-#include <sys/stat.h>
+#include <sys/uio.h>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <deque>
+#include <cstring>
 
 using namespace std;
 
 
+Device *Device::create(const std::string &path, const connection_options_t &connection) {
+    string upper = path;
+    transform(upper.begin(), upper.end(), upper.begin(), [](unsigned char c) { return toupper(c); });
+    if (upper.find("ACM") != string::npos) {
+        if (!connection.baud)
+            return new USBDevice(path, connection.infinite_timeout);
+        return new USBDevice(path, connection.baud, connection.infinite_timeout);
+    }
+    if (connection.auto_baud) {
+        //the connection starts at the rate that worked last time, to spare a reopen
+        unsigned int recorded = 0;
+        if (connection.baud_record != nullptr)
+            recorded = static_cast<unsigned int>(strtoul(connection.baud_record->get(path).c_str(), nullptr, 10));
+        auto device = new UARTDevice(path, recorded ? recorded : autobaudRates.front(), connection.infinite_timeout);
+        device->set_auto_baud(autobaudRates, connection.baud_record);
+        return device;
+    }
+    if (!connection.baud)
+        return new UARTDevice(path, connection.infinite_timeout);
+    return new UARTDevice(path, connection.baud, connection.infinite_timeout);
+}
+
 bool Device::open_comm() {
     if (comm_opened) return true;
-    serial_stream.exceptions(ios::badbit | ios::failbit);
-    comm_opened = serial_stream.good();
+    try {
+        port->open(path, baud);
+        scanner.reset();
+        stray_banners = 0;
+        comm_opened = true;
+    } catch (ios::failure &ex) {
+        comm_opened = false;
+    }
     return comm_opened;
 }
 
 template<>
 std::string Device::read_and_print<std::string>() {
-    std::string retval;
-    getline(serial_stream, retval);
-    std::cout << retval;
+    std::string retval = port->read_line(timeout_msec);
+    *console << retval;
     return retval;
 }
 
+void Device::set_baud(unsigned int new_baud) {
+    if (new_baud == baud) return;
+    baud = new_baud;
+    if (comm_opened) port->set_baud(baud);
+    scanner.reset();
+    stray_banners = 0;
+}
+
 bool Device::check_device_present() {
-    struct stat buffer{};
-    return static_cast<bool>(stat(path.c_str(), &buffer) == 0);
+    return port->is_present(path);
 }
 
-bool Device::prepare_flash() {
-    if (!check_device_present())
-        throw DeviceNotFoundException("Device not found");
-    bool retval = open_comm();
+void Device::set_transport(std::unique_ptr<Transport> transport) {
+    close_comm();
+    port = std::move(transport);
+}
 
-    cout << " :: Enabling firmware upload mode ::" << endl;
-    //start the upload mode of the bootloader
-    serial_stream << "u" << flush;
-    return retval && check_output("^Ready(\\r)?$", chrono::milliseconds(1000));
+BootloaderScanner::token Device::await_reply(unsigned int accepted, int timeout_msec) {
+    auto end = chrono::steady_clock::now() + chrono::milliseconds(timeout_msec);
+    bool ncg = accepted & BootloaderScanner::NCG;
+    for (;;) {
+        int left = 0;
+        if (timeout_msec > 0) {
+            auto remaining = chrono::duration_cast<chrono::milliseconds>(end - chrono::steady_clock::now()).count();
+            if (remaining <= 0) return BootloaderScanner::NONE;
+            left = static_cast<int>(remaining);
+        }
+        uint8_t c;
+        try {
+            //the transport buffers what arrived, a byte at a time costs no system call
+            port->read(&c, 1, left);
+        } catch (TimeoutException &ex) {
+            return BootloaderScanner::NONE;
+        }
+        auto token = scanner.feed(c, ncg);
+        if (token == BootloaderScanner::NONE) continue;
+        //the replies come in order: any other reply means the banner expected first is not coming
+        bool stray = token == BootloaderScanner::BANNER && stray_banners;
+        if (token != BootloaderScanner::LINE && token != BootloaderScanner::NCG) stray_banners = 0;
+        if (token == BootloaderScanner::NCG) {
+            *console << 'C' << flush;
+            echo_mid_line = true;
+        } else if (!stray) {
+            //every line of the bootloader on its own, without the '\r' that would let the next text overwrite it
+            string line = scanner.get_line();
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (echo_mid_line) *console << endl;
+            *console << line << endl;
+            echo_mid_line = false;
+        }
+        if (token == BootloaderScanner::BANNER) {
+            bootloader_version = scanner.get_version();
+            chip_id = scanner.get_chip_id();
+        }
+        if (token & accepted && !stray) return token;
+    }
 }
 
-bool UARTDevice::prepare_flash() {
+bool Device::identify() {
+    send_byte('i');
+    return await_reply(BootloaderScanner::BANNER, 5000) == BootloaderScanner::BANNER;
+}
+
+bool Device::handshake() {
     if (!check_device_present())
         throw DeviceNotFoundException("Device not found");
-    if (!open_comm()) return false;
+    return open_comm();
+}
 
-    //send a 'U' for autobaud the interface
-    serial_stream << "U" << flush;
-    if (!detect_bootloader_mode(std::chrono::milliseconds(5000), false))
-        throw DeviceNotFoundException("Device not connected or not in bootloader mode");
+bool Device::probe() {
+    if (!check_device_present() || !open_comm()) return false;
+    send_byte('i');
+    return await_reply(BootloaderScanner::BANNER, autobaudProbeMsec) == BootloaderScanner::BANNER;
+}
 
-    cout << " :: Enabling firmware upload mode ::" << endl;
+bool Device::enable_upload() {
+    log("Enabling firmware upload mode");
+    windowed = false;
+    window = 1;
+    //a refusal is remembered across runs for the same bootloader, so that stock boards pay the question only once
+    string refusal_key = chip_id.empty() ? path : chip_id;
+    string refusal_version = bootloader_version.empty() ? "unknown" : bootloader_version;
+    if (windowed_record != nullptr && windowed_record->get(refusal_key) == refusal_version) windowed_refused = true;
+    if (max_window > 1 && !windowed_refused) {
+        //a bootloader not supporting the windowed mode answers '?' to its command, as to any unknown one
+        send_byte('W');
+        auto reply = await_reply(BootloaderScanner::READY_WINDOW | BootloaderScanner::UNKNOWN, 1000);
+        if (reply == BootloaderScanner::NONE) return false;
+        if (reply == BootloaderScanner::READY_WINDOW) {
+            windowed = true;
+            window = max(1u, min(max_window, scanner.get_window()));
+            log("The bootloader accepts up to " + to_string(scanner.get_window()) + " frames in flight, sending " +
+                to_string(window) + " at a time");
+            return true;
+        }
+        windowed_refused = true;
+        if (windowed_record != nullptr && !windowed_record->put(refusal_key, refusal_version))
+            log("Cannot record that the bootloader refused the windowed mode");
+    }
     //start the upload mode of the bootloader
-    serial_stream << "u" << flush;
-    return check_output("^Ready(\\r)?$", chrono::milliseconds(1000));
+    send_byte('u');
+    return await_reply(BootloaderScanner::READY, 1000) == BootloaderScanner::READY;
+}
+
+bool UARTDevice::handshake() {
+    if (!Device::handshake()) return false;
+
+    if (baud_rates.empty() || baud_locked) {
+        if (baud_locked) {
+            if (!probe_baud())
+                throw DeviceNotFoundException("Device not answering at " + to_string(baud) + " baud");
+            remember_baud();
+            return true;
+        }
+        //autobaud the interface, asking for the banner in the same breath
+        if (!probe_baud(5000) && !identify())
+            throw DeviceNotFoundException("Device not connected or not in bootloader mode");
+        return true;
+    }
+
+    //the recorded rate goes first, then from the fastest down
+    vector<size_t> order;
+    string recorded = baud_record != nullptr ? baud_record->get(path) : string();
+    for (size_t i = 0; i < baud_rates.size(); i++)
+        if (to_string(baud_rates[i]) == recorded) order.push_back(i);
+    for (size_t i = 0; i < baud_rates.size(); i++)
+        if (order.empty() || order.front() != i) order.push_back(i);
+    for (auto i : order) {
+        set_baud(baud_rates[i]);
+        if (!probe_baud()) continue;
+        baud_index = i;
+        baud_locked = true;
+        log("Bootloader answering at " + to_string(baud) + " baud", true);
+        remember_baud();
+        return true;
+    }
+    throw DeviceNotFoundException("Device not connected or not in bootloader mode at any baud rate");
+}
+
+bool UARTDevice::probe_baud(int timeout_msec) {
+    auto end = chrono::steady_clock::now() + chrono::milliseconds(timeout_msec);
+    auto left = [&end] {
+        return max(1, static_cast<int>(chrono::duration_cast<chrono::milliseconds>(end - chrono::steady_clock::now())
+                                               .count()));
+    };
+    send_commands("Ui");
+    auto first = await_reply(BootloaderScanner::BANNER | BootloaderScanner::UNKNOWN, timeout_msec);
+    if (first == BootloaderScanner::NONE) return false;
+    //a bootloader already synchronized replies '?' to the 'U', the banner comes from the 'i'
+    if (first == BootloaderScanner::UNKNOWN)
+        return await_reply(BootloaderScanner::BANNER, left()) == BootloaderScanner::BANNER;
+    //the 'U' got a banner of its own, the one of the 'i' is still coming and must not be taken for the next reply
+    stray_banners = 1;
+    return true;
+}
+
+bool UARTDevice::probe() {
+    if (!check_device_present() || !open_comm()) return false;
+    if (baud_rates.empty()) return probe_baud();
+    try {
+        return handshake();
+    } catch (DeviceNotFoundException &ex) {
+        return false;
+    }
+}
+
+void UARTDevice::remember_baud() {
+    if (baud_record != nullptr && baud_record->get(path) != to_string(baud) && !baud_record->put(path, to_string(baud)))
+        log("Cannot record the baud rate");
+}
+
+void UARTDevice::lower_baud() {
+    if (!has_lower_baud()) return;
+    set_baud(baud_rates[++baud_index]);
+    log("Too many errors, falling back to " + to_string(baud) + " baud", true);
+}
+
+void UARTDevice::set_auto_baud(std::vector<unsigned int> rates, CacheFile *record) {
+    baud_rates = std::move(rates);
+    baud_record = record;
+    baud_index = 0;
+    baud_locked = false;
+}
+
+void Device::log(const std::string &message, bool end_line) {
+    if (end_line) *console << endl;
+    *console << " :: " << message << " ::" << endl;
+    if (log_listener) log_listener(message);
+}
+
+void Device::reboot() {
+    log("Rebooting the device...");
+    send_byte('b');
+}
+
+void Device::send_byte(uint8_t data) {
+    port->write(&data, 1, timeout_msec);
+}
+
+void Device::send_commands(const char *commands) {
+    port->write(commands, strlen(commands), timeout_msec);
+}
+
+void Device::send_buffers(const struct iovec *buffers, int count) {
+    port->write(buffers, count, timeout_msec);
+}
+
+void Device::drain_replies(int silence_msec) {
+    uint8_t reply;
+    try {
+        for (;;) port->read(&reply, 1, silence_msec);
+    } catch (TimeoutException &ex) {
+        //silent at last
+    }
+}
+
+void Device::cancel_transfer() {
+    uint8_t can[] = {xmodemCan, xmodemCan, xmodemCan};
+    port->write(can, sizeof(can), timeout_msec);
+}
+
+void Device::wait_transfer_start() {
+    //wait for 'C' meaning the device is accepting an XMODEM transfer, as long as the retries of a packet would last
+    if (await_reply(BootloaderScanner::NCG, timeout_msec * maxRetransmission) != BootloaderScanner::NCG)
+        throw XmodemTransmissionException("The device is not accepting the transmission using XMODEM protocol");
+}
+
+void Device::set_rto_floor(std::size_t frame_bytes, std::size_t frames) {
+    int floor = rtoMarginMsec;
+    //10 bits per byte, the reply included
+    if (is_baud_limited() && baud)
+        floor += static_cast<int>(((frame_bytes + 1) * frames * 10 * 1000 + baud - 1) / baud);
+    rto.set_floor_msec(floor);
 }
 
-void Device::send_byte(uint8_t data, bool flush) {
-    char pkt[] = {static_cast<char>(data)};
-    serial_stream.write(pkt, sizeof(pkt));
-    if(flush) serial_stream.flush();
+uint8_t Device::send_packet(XmodemPacket &pkt, int attempts, bool allow_cancel) {
+    uint8_t reply = xmodemNak;
+    struct iovec buffers[xmodemPacketBuffers];
+    pkt.get_buffers(buffers);
+    set_rto_floor(pkt.get_size(), 1);
+    bool any_timeout = false;
+    for (int retry = 0; retry < attempts; retry++) {
+        if (retry) report.retransmissions++;
+        auto sent = chrono::steady_clock::now();
+        send_buffers(buffers, xmodemPacketBuffers);
+        bool timed_out = false;
+        try {
+            port->read(&reply, sizeof(reply), reply_timeout(retry + 1 == attempts));
+        } catch (InterruptedException &ex) {
+            //leave the target in a clean state, it would otherwise wait for the rest of the image
+            cancel_transfer();
+            *console << endl;
+            throw XmodemTransmissionException("Transmission interrupted");
+        } catch (TimeoutException &ex) {
+            //a lost reply counts as a NAK
+            reply = xmodemNak;
+            timed_out = any_timeout = true;
+            rto.back_off();
+        }
+        auto rtt = chrono::steady_clock::now() - sent;
+        //the reply to a retransmission may belong to any copy of the packet, it is no sample
+        if (!retry && !timed_out) rto.add_sample(rtt);
+        report.stats.record_packet(pkt.get_size(), rtt, reply == xmodemAck, pkt.get_data_size());
+        if (retry) *console << '\b' << flush;
+        else if (progress_column++ == progressColumns) {
+            progress_column = 1;
+            *console << endl;
+        }
+        switch (reply) {
+            case xmodemAck: //packet acknowledged
+                *console << '.' << flush;
+                //a copy sent after a timeout may still get its own reply, which must not be taken for the next one
+                if (any_timeout) {
+                    rto.clear_backoff();
+                    drain_replies(rto.get_timeout_msec());
+                }
+                return reply;
+            case xmodemCan: //cancelled by target
+                *console << 'C' << flush;
+                try {
+                    port->read(&reply, 1, timeout_msec);
+                } catch (TimeoutException &ex) {
+                    //a lone CAN is line noise, the packet is sent again
+                    reply = xmodemNak;
+                }
+                if (reply == xmodemCan) {
+                    try {
+                        port->read(&reply, 1, timeout_msec);
+                    } catch (TimeoutException &ex) {
+                        //two CANs are enough to confirm the cancellation
+                    }
+                    send_byte(xmodemAck);
+                    *console << endl;
+                    if (allow_cancel) return xmodemCan;
+                    throw XmodemTransmissionException("Transmission cancelled by target");
+                }
+                report.stats.record_retry(FlashStats::CANCEL);
+                break;
+            case xmodemNak: //otherwise retry
+                *console << 'N' << flush;
+                report.stats.record_retry(timed_out ? FlashStats::TIMEOUT : FlashStats::NAK);
+                break;
+            default:
+                report.stats.record_retry(FlashStats::OTHER);
+                break;
+        }
+    }
+    return reply == xmodemCan ? static_cast<uint8_t>(xmodemNak) : reply;
+}
+
+bool Device::send_windowed(PacketProducer &producer, const flash_options_t &options) {
+    //the frames not acknowledged yet, oldest first, and when they were last sent
+    deque<pair<XmodemPacket, chrono::steady_clock::time_point>> frames;
+    //how many of the frames were sent since the last go back
+    size_t sent = 0;
+    bool more = true;
+    //the go backs since the last frame acknowledged
+    int failures = 0;
+    bool any_timeout = false;
+    for (;;) {
+        while (more && frames.size() < window) {
+            auto wait_start = chrono::steady_clock::now();
+            XmodemPacket pkt;
+            try {
+                more = producer.pop(pkt);
+            } catch (FileIOException &ex) {
+                cancel_transfer();
+                throw ex;
+            }
+            report.host_stall_seconds += chrono::duration<double>(chrono::steady_clock::now() - wait_start).count();
+            if (more) frames.emplace_back(move(pkt), chrono::steady_clock::time_point());
+        }
+        if (frames.empty()) break;
+        if (options.abort != nullptr && *options.abort) {
+            cancel_transfer();
+            *console << endl;
+            throw XmodemTransmissionException("Transmission interrupted");
+        }
+
+        auto send_start = chrono::steady_clock::now();
+        for (; sent < frames.size(); sent++) {
+            struct iovec buffers[xmodemPacketBuffers];
+            frames[sent].first.get_buffers(buffers);
+            frames[sent].second = chrono::steady_clock::now();
+            send_buffers(buffers, xmodemPacketBuffers);
+        }
+        //wait for a reply, then take all those already arrived: the last frame may be queued behind all the others
+        set_rto_floor(frames.front().first.get_size(), sent);
+        bool go_back = false;
+        FlashStats::retry_cause reason = FlashStats::NAK;
+        try {
+            uint8_t reply[2];
+            port->read(reply, sizeof(reply), reply_timeout(failures + 1 == maxRetransmission));
+            for (;;) {
+                auto now = chrono::steady_clock::now();
+                if (reply[0] == xmodemCan && reply[1] == xmodemCan) {
+                    port->read(reply, 1, timeout_msec);
+                    send_byte(xmodemAck);
+                    *console << endl;
+                    throw XmodemTransmissionException("Transmission cancelled by target");
+                }
+                if (reply[0] != xmodemAck && reply[0] != xmodemNak) {
+                    //out of step with the replies, start over from a silent line
+                    drain_replies(rto.get_timeout_msec());
+                    go_back = true;
+                    reason = FlashStats::OTHER;
+                    break;
+                }
+                //a NAK names the frame expected next, so the ones before it arrived
+                size_t acked = 0;
+                for (size_t i = 0; i < sent; i++)
+                    if (frames[i].first.get_block_num() == reply[1]) acked = reply[0] == xmodemAck ? i + 1 : i;
+                for (size_t i = 0; i < acked; i++) {
+                    auto &frame = frames.front();
+                    auto rtt = now - frame.second;
+                    //a frame sent once has a clean sample, which includes the wait behind the frames before it
+                    if (!failures) rto.add_sample(rtt);
+                    report.stats.record_packet(frame.first.get_size(), rtt, true, frame.first.get_data_size());
+                    report.packets++;
+                    report.bytes += frame.first.get_data_size();
+                    if (progress_column++ == progressColumns) {
+                        progress_column = 1;
+                        *console << endl;
+                    }
+                    *console << '.';
+                    frames.pop_front();
+                    sent--;
+                }
+                if (acked) {
+                    failures = 0;
+                    *console << flush;
+                    if (options.progress) options.progress(report.bytes);
+                }
+                if (reply[0] == xmodemNak) {
+                    go_back = true;
+                    break;
+                }
+                if (port->buffered() < sizeof(reply)) break;
+                port->read(reply, sizeof(reply), timeout_msec);
+            }
+        } catch (InterruptedException &ex) {
+            cancel_transfer();
+            *console << endl;
+            throw XmodemTransmissionException("Transmission interrupted");
+        } catch (TimeoutException &ex) {
+            go_back = true;
+            reason = FlashStats::TIMEOUT;
+            any_timeout = true;
+            rto.back_off();
+        }
+        report.link_wait_seconds += chrono::duration<double>(chrono::steady_clock::now() - send_start).count();
+        if (!go_back || frames.empty()) continue;
+
+        //resend everything from the first frame not acknowledged
+        *console << 'N' << flush;
+        report.stats.record_retry(reason);
+        report.retransmissions += static_cast<unsigned int>(sent);
+        sent = 0;
+        //a baud rate too fast for the link shows up as errors on the first frames
+        if (report.packets < baudCheckPackets && has_lower_baud()) return false;
+        if (++failures == maxRetransmission) {
+            cancel_transfer();
+            *console << endl;
+            throw XmodemTransmissionException("Too many errors while sending packet, transmission aborted");
+        }
+    }
+    //the replies to frames resent after a timeout may still be coming
+    if (any_timeout) {
+        rto.clear_backoff();
+        drain_replies(rto.get_timeout_msec());
+    }
+    return true;
 }
 
-void Device::flash(std::string filename) {
-    //check the binary image file exists
-    struct stat stat_buffer{};
-    if (stat(filename.c_str(), &stat_buffer))
-        throw BinaryNotFoundException("Binary not found in the specified path");
-    cout << " :: Loading binary image file...";
-    ifstream file(filename, std::ios::binary);
-    if (!file)
-        throw BinaryNotFoundException("Binary not found in the specified path");
-    cout << "loaded! ::" << endl;
+flash_report_t Device::flash(std::string filename, const flash_options_t &options) {
+    ImageLoader::image_format format;
+    auto image = ImageLoader::load(filename, options.trim_erased, &format, options.format);
+    log("Loading binary image file...loaded " + ImageLoader::describe(*image, format) + "!");
+    return flash(*image, options);
+}
 
-    if (!prepare_flash())
+flash_report_t Device::flash(ImageSource &image, const flash_options_t &options) {
+    report = flash_report_t();
+    rto.reset();
+    max_window = min(max(options.window, 1u), maxWindow);
+    windowed_record = options.windowed_record;
+    report.stats.set_link(path, is_baud_limited() ? baud : 0);
+    auto handshake_start = chrono::steady_clock::now();
+    if (!handshake())
+        throw DeviceNotFoundException("Broken pipe");
+    bool chip_id_needed = options.skip_unchanged || !options.chip_id.empty();
+    if ((options.record != nullptr || chip_id_needed) && chip_id.empty()) {
+        //the Chip ID keys the record of the images flashed, it is mandatory only for skipping the transfer or for
+        //checking the board
+        try {
+            identify();
+        } catch (TimeoutException &ex) {
+            if (chip_id_needed) throw;
+        }
+        if (chip_id.empty() && chip_id_needed)
+            throw DeviceNotFoundException("Cannot read the Chip ID of the device");
+    }
+    if (!options.chip_id.empty() && chip_id != options.chip_id)
+        throw DeviceNotFoundException("The device has Chip ID " + chip_id + " instead of " + options.chip_id);
+    if (options.record != nullptr && options.skip_unchanged) {
+        if (options.record->get(chip_id) == image.digest()) {
+            log("Device " + chip_id + " already has this image, skipping the transfer", true);
+            report.skipped = true;
+            report.stats.add_handshake_step(FlashStats::SYNC, chrono::steady_clock::now() - handshake_start);
+            report.stats.add_phase(FlashStats::HANDSHAKE, chrono::steady_clock::now() - handshake_start);
+            reboot();
+            return report;
+        }
+    }
+    auto upload_start = chrono::steady_clock::now();
+    report.stats.add_handshake_step(FlashStats::SYNC, upload_start - handshake_start);
+    if (!enable_upload())
         throw DeviceNotFoundException("Broken pipe");
 
     //flash procedure by http://web.mit.edu/6.115/www/amulet/xmodem.htm
 
-    uint8_t reply;
-    bool ack = false;
+    auto ncg_start = chrono::steady_clock::now();
+    report.stats.add_handshake_step(FlashStats::UPLOAD_MODE, ncg_start - upload_start);
+    wait_transfer_start();
+    log("Ready to receive data in CRC mode. Starting to flash the image", true);
+    echo_mid_line = false;
+    progress_column = 0;
+    auto transfer_start = chrono::steady_clock::now();
+    report.stats.add_handshake_step(FlashStats::TRANSFER_START, transfer_start - ncg_start);
+    report.stats.add_phase(FlashStats::HANDSHAKE, transfer_start - handshake_start);
+    double host_work = 0;
+    //the first 1K packet tells whether the target supports them, the windowed mode implies they are
+    bool probing_1k = options.xmodem_1k && !windowed;
+    bool use_1k = options.xmodem_1k;
+    //a baud rate too fast for the link shows up as errors on the first packets
+    unsigned int checked_packets = 0;
+    unsigned int checked_retransmissions = 0;
+    //the packets are prepared in background while waiting for the replies
+    unique_ptr<PacketProducer> producer(new PacketProducer(image, use_1k));
     XmodemPacket pkt;
-    //wait for 'C' meaning the device is accepting an XMODEM transfer
-    for (int retry = 0; !ack && retry < maxRetransmission; retry++) {
-        reply = read_and_print<uint8_t>();
-        ack = reply == xmodemNcg;
+    while (windowed && !send_windowed(*producer, options)) {
+        //start over at a slower rate
+        cancel_transfer();
+        lower_baud();
+        if (!prepare_flash())
+            throw DeviceNotFoundException("Broken pipe");
+        wait_transfer_start();
+        report.packets = 0;
+        report.bytes = 0;
+        progress_column = 0;
+        rto.reset();
+        host_work += producer->get_work_seconds();
+        producer.reset(new PacketProducer(image, use_1k));
     }
-    if (!ack)
-        throw XmodemTransmissionException("The device is not accepting the transmission using XMODEM protocol");
-    cout << endl << " :: Ready to receive data in CRC mode. Starting to flash the image ::" << endl;
-    int column = 0;
-    int num_pkts;
-    for (num_pkts = 0; file; num_pkts++) {
-        //compose a packet
+    //classic stop-and-wait XMODEM
+    while (!windowed) {
+        auto wait_start = chrono::steady_clock::now();
+        bool more;
         try {
-            pkt.read_from_binfile(file);
+            more = producer->pop(pkt);
         } catch (FileIOException &ex) {
-            send_byte(xmodemCan);
-            send_byte(xmodemCan);
-            send_byte(xmodemCan);
+            cancel_transfer();
             throw ex;
         }
-        pkt.compute_crc();
-        ack = false;
+        auto send_start = chrono::steady_clock::now();
+        report.host_stall_seconds += chrono::duration<double>(send_start - wait_start).count();
+        if (!more) break;
+        if (options.abort != nullptr && *options.abort) {
+            cancel_transfer();
+            *console << endl;
+            throw XmodemTransmissionException("Transmission interrupted");
+        }
+        bool probe = probing_1k && pkt.get_data_size() == xmodem1kDataSize;
+        probing_1k = false;
         //send the packet
-        for (int retry = 0; !ack && retry < maxRetransmission; retry++) {
-            char* pkt_content = pkt.get_content();
-            serial_stream.write(pkt_content, xmodemPacketSize);
-            serial_stream.flush();
-            serial_stream.read(reinterpret_cast<char*>(&reply), sizeof(reply));
-            if (retry) cout << '\b' << flush;
-            else if (column++ == 80) {
-                column = 1;
-                cout << endl;
+        uint8_t reply = send_packet(pkt, probe ? 1 : maxRetransmission, probe);
+        report.link_wait_seconds += chrono::duration<double>(chrono::steady_clock::now() - send_start).count();
+        if (probe && reply != xmodemAck) {
+            log("The device refused XMODEM-1K packets, falling back to 128 bytes packets", true);
+            if (reply == xmodemCan) {
+                //the target left the upload mode, start over
+                if (!prepare_flash())
+                    throw DeviceNotFoundException("Broken pipe");
+                wait_transfer_start();
             }
-            switch (reply) {
-                case xmodemAck: //packet acknowledged
-                    cout << '.' << flush;
-                    ack = true;
-                    break;
-                case xmodemCan: //cancelled by target
-                    cout << 'C' << flush;
-                    serial_stream.read(reinterpret_cast<char *>(&reply), 1);
-                    if (reply == xmodemCan) {
-                        serial_stream.read(reinterpret_cast<char *>(&reply), 1);
-                        send_byte(xmodemAck);
-                        cout << endl;
-                        throw XmodemTransmissionException("Transmission cancelled by target");
-                    }
-                    break;
-                case xmodemNak: //otherwise retry
-                    cout << 'N' << flush;
-                default:
-                    break;
+            progress_column = 0;
+            use_1k = false;
+            rto.reset();
+            host_work += producer->get_work_seconds();
+            producer.reset(new PacketProducer(image, use_1k));
+            continue;
+        }
+        if (checked_packets < baudCheckPackets) {
+            if (reply == xmodemAck) checked_packets++;
+            bool noisy = reply != xmodemAck || (checked_packets == baudCheckPackets &&
+                    (report.retransmissions - checked_retransmissions) * 100 > baudCheckPackets * baudMaxNakPercent);
+            if (noisy && has_lower_baud()) {
+                //start over at a slower rate
+                cancel_transfer();
+                lower_baud();
+                if (!prepare_flash())
+                    throw DeviceNotFoundException("Broken pipe");
+                wait_transfer_start();
+                report.packets = 0;
+                report.bytes = 0;
+                checked_packets = 0;
+                checked_retransmissions = report.retransmissions;
+                progress_column = 0;
+                rto.reset();
+                host_work += producer->get_work_seconds();
+                producer.reset(new PacketProducer(image, use_1k));
+                continue;
             }
         }
         //too many errors, aborting
-        if (!ack) {
-            send_byte(xmodemCan);
-            send_byte(xmodemCan);
-            send_byte(xmodemCan);
-            cout << endl;
+        if (reply != xmodemAck) {
+            cancel_transfer();
+            *console << endl;
             throw XmodemTransmissionException("Too many errors while sending packet, transmission aborted");
         }
-        pkt = pkt.next();
+        report.packets++;
+        report.bytes += pkt.get_data_size();
+        if (options.progress) options.progress(report.bytes);
     }
-    ack = false;
-    cout << endl << " :: End of transmission, " << num_pkts << " packets sent ::" << endl;
+    report.host_work_seconds = host_work + producer->get_work_seconds();
+    producer.reset();
+    auto eot_start = chrono::steady_clock::now();
+    report.stats.add_phase(FlashStats::TRANSFER, eot_start - transfer_start);
+    //the baud rate may have been lowered during the transfer
+    report.stats.set_link(path, is_baud_limited() ? baud : 0);
+    bool ack = false;
+    uint8_t reply;
+    log("End of transmission, " + to_string(report.packets) + " packets sent", true);
     //communicate the end of the transmission and wait for its ack
     for (int retry = 0; !ack && retry < 2 * maxRetransmission; retry++) {
         send_byte(xmodemEot);
-        serial_stream.read(reinterpret_cast<char *>(&reply), 1);
+        try {
+            port->read(&reply, 1, reply_timeout(retry + 1 == 2 * maxRetransmission));
+        } catch (TimeoutException &ex) {
+            rto.back_off();
+            continue;
+        }
         ack = reply == xmodemAck;
     }
+    report.transfer_seconds = chrono::duration<double>(chrono::steady_clock::now() - transfer_start).count();
+    report.stats.add_phase(FlashStats::EOT, chrono::steady_clock::now() - eot_start);
     if (ack) {
-        cout << " :: Rebooting the device... ::" << endl;
-        serial_stream << "b" << flush;
-        return;
+        ostringstream timing;
+        timing << fixed << setprecision(3) << "Transfer took " << report.transfer_seconds << " s: "
+               << report.link_wait_seconds << " s waiting for the link, " << report.host_work_seconds
+               << " s preparing packets in background, " << report.host_stall_seconds
+               << " s waiting for packets to be ready";
+        log(timing.str());
+        //the record is written only once the device confirmed it has the whole image
+        if (options.record != nullptr && !chip_id.empty() && !options.record->put(chip_id, image.digest()))
+            log("Cannot record the flashed image");
+        reboot();
+        return report;
     }
     throw XmodemTransmissionException("Remote target did not ACK end of transmission");
 }
 
+void Device::discard_input() {
+    if (comm_opened) port->discard_input();
+}
+
 void Device::close_comm() {
     if (!comm_opened) return;
     comm_opened = false;
-    serial_stream.close();
+    port->close();
 }
@@ -8,19 +8,99 @@
 #include <string>
 #include <utility>
 #include <ios>
-#include <boost/date_time.hpp>
 #include <chrono>
 #include <thread>
 #include <condition_variable>
-#include <regex>
-#include "serial-port/6_stream/serialstream.h"
+#include <functional>
+#include <atomic>
+#include <vector>
+#include <iostream>
+#include <memory>
+#include "SerialPort.h"
+#include "BootloaderScanner.h"
+#include "FlashStats.h"
+#include "RetransmissionTimer.h"
+#include "ImageLoader.h"
 
 static const int maxRetransmission=5;
 static const int deviceTimeoutMsec=2500;
+static const int progressColumns=80;
+static const int rtoMarginMsec=30;
+static const int autobaudProbeMsec=1000;
+static const unsigned int baudCheckPackets=16;
+static const unsigned int baudMaxNakPercent=25;
+static const unsigned int defaultWindow=16;
+static const unsigned int maxWindow=64;
+
+///The baud rates tried by the automatic baud selection, fastest first.
+static const std::vector<unsigned int> autobaudRates={921600, 460800, 230400, 115200};
+
+
+class XmodemPacket;
+class PacketProducer;
+class ImageSource;
+class CacheFile;
+struct iovec;
+
+///The options driving a flash operation.
+struct flash_options_t {
+    ///If the image should be sent using XMODEM-1K packets, falling back to 128 bytes packets if refused.
+    bool xmodem_1k = false;
+    ///If set, it is called after every acknowledged packet with the number of image bytes sent so far.
+    std::function<void(std::size_t)> progress;
+    ///If set, the transfer is cancelled as soon as it becomes true.
+    const std::atomic<bool> *abort = nullptr;
+    ///If set, the digest of the image is recorded by Chip ID once the device acknowledges the end of transmission.
+    CacheFile *record = nullptr;
+    ///If the transfer is skipped when the record shows the device already has the image.
+    bool skip_unchanged = false;
+    ///If the trailing erased (0xFF) blocks of the image file are not sent.
+    bool trim_erased = true;
+    ///The format of the image file, AUTO for guessing it.
+    ImageLoader::image_format format = ImageLoader::AUTO;
+    ///If not empty, the transfer is refused unless the device has this Chip ID.
+    std::string chip_id;
+    ///The most frames sent ahead of their acknowledgement when the bootloader supports the windowed mode, 1 for
+    ///classic stop-and-wait XMODEM.
+    unsigned int window = defaultWindow;
+    ///If set, the bootloaders that refused the windowed mode are recorded by Chip ID, or by device path when it is
+    ///unknown, together with their version, so that they are not asked again until their version changes.
+    CacheFile *windowed_record = nullptr;
+};
 
-static const std::string bootloaderRegexStrict="^BOOTLOADER version (.+) Chip ID ([0-9A-F]+)(\\r)?$";
-static const std::string bootloaderRegexNoStrict="^(BOOTLOADER version (.+) Chip ID ([0-9A-F]+)|\\?)(\\r)?$";
+///How a board is reached, see Device::create.
+struct connection_options_t {
+    ///The baud rate, 0 for the default of the connection: 9600 for USB boards, 115200 for serial adapters.
+    unsigned int baud = 0;
+    ///If the fastest baud rate in autobaudRates the serial adapter handles is looked for, instead of baud.
+    bool auto_baud = false;
+    ///If set, where the rate that worked is remembered by device path with the automatic baud selection.
+    CacheFile *baud_record = nullptr;
+    ///If the reads from the device never time out.
+    bool infinite_timeout = false;
+};
 
+///The outcome of a flash operation.
+struct flash_report_t {
+    ///The number of packets sent, not counting retransmissions.
+    unsigned int packets = 0;
+    ///The number of image bytes sent, padding included.
+    std::size_t bytes = 0;
+    ///The number of packets sent again.
+    unsigned int retransmissions = 0;
+    ///The duration of the XMODEM transfer, from the first packet to the end of transmission.
+    double transfer_seconds = 0;
+    ///The time spent writing packets and waiting for their replies.
+    double link_wait_seconds = 0;
+    ///The time spent preparing packets in the background.
+    double host_work_seconds = 0;
+    ///The time the sender waited for a packet to be prepared.
+    double host_stall_seconds = 0;
+    ///If the transfer was skipped because the device already had the image.
+    bool skipped = false;
+    ///The per packet telemetry.
+    FlashStats stats;
+};
 
 /**
  * This class models the Device with which the program will operate.
@@ -29,25 +109,15 @@ class Device {
 
 protected:
     /**
-     * Checks that the serial outputs a string matching with the provided one within a certain timeout.
-     * @param regex_string the string to be match against.
-     * @param timeout the maximum waiting period.
-     * @return if the output matched.
-     */
-    template<typename _Rep, typename _Period>
-    bool check_output(const std::string &regex_string, const std::chrono::duration<_Rep, _Period> &timeout) {
-        std::chrono::time_point<std::chrono::system_clock> end = std::chrono::system_clock::now() + timeout;
-        std::regex r(regex_string);
-        bool detected = false;
-        std::string s;
-        while (!detected && std::chrono::system_clock::now() < end) {
-            s = read_and_print<std::string>();
-            if (regex_match(s, r))
-                detected = true;
-        }
-
-        return detected;
-    }
+     * Reads the device output until one of the accepted replies of the bootloader arrives, printing it. The bytes are
+     * taken one at a time, so that nothing following the reply is consumed. The fields of any banner are learnt, the
+     * stray banners are skipped.
+     * \throws InterruptedException If the program was interrupted.
+     * \param accepted the replies awaited, a combination of BootloaderScanner::token
+     * \param timeout_msec the deadline, 0 for infinite
+     * \return the reply received, BootloaderScanner::NONE if the deadline expired first.
+     */
+    BootloaderScanner::token await_reply(unsigned int accepted, int timeout_msec);
 
     /// The path to the device.
     std::string path;
@@ -55,12 +125,60 @@ protected:
     /// The baud used in the serial connection.
     unsigned int baud;
 
-    /// The stream related to the device.
-    SerialStream serial_stream;
+    /// The deadline of every read from the device, 0 for infinite.
+    int timeout_msec;
+
+    /// The link to the device, a SerialPort unless another transport was injected.
+    std::unique_ptr<Transport> port{new SerialPort};
 
     /// If the communication with the device is opened.
     bool comm_opened = false;
 
+    /// How long to wait for the reply to a packet, learnt from the previous replies.
+    RetransmissionTimer rto{deviceTimeoutMsec, rtoMarginMsec, deviceTimeoutMsec};
+
+    /// The column of the progress line printed while flashing.
+    int progress_column = 0;
+
+    /// The report of the current flash operation.
+    flash_report_t report;
+
+    /// The stream where the device output and the flash progress are printed.
+    std::ostream *console = &std::cout;
+
+    /// The recognizer of the bootloader replies.
+    BootloaderScanner scanner;
+
+    /// The banners still coming in reply to commands sent ahead, which must not be taken for the replies awaited.
+    unsigned int stray_banners = 0;
+
+    /// If the echo of the bootloader output left the console in the middle of a line, after a 'C'.
+    bool echo_mid_line = false;
+
+    /// Called with every message of the procedure, if set.
+    std::function<void(const std::string &)> log_listener;
+
+    /// The Chip ID printed in the bootloader banner, empty if not seen yet.
+    std::string chip_id;
+
+    /// The version printed in the bootloader banner, empty if not seen yet.
+    std::string bootloader_version;
+
+    /// The most frames the current flash operation may send ahead of their acknowledgement.
+    unsigned int max_window = 1;
+
+    /// If the bootloader agreed to receive the current image in windowed mode.
+    bool windowed = false;
+
+    /// The window agreed with the bootloader.
+    unsigned int window = 1;
+
+    /// If the bootloader did not understand the windowed upload command, so that it is not asked again.
+    bool windowed_refused = false;
+
+    /// Where the current flash operation finds and records the bootloaders refusing the windowed mode, if anywhere.
+    CacheFile *windowed_record = nullptr;
+
     /**
      * Constructor. Initializes the object.
      * \param path the path to the device
@@ -68,8 +186,33 @@ protected:
      * \param infinite_timeout if the timeout should be limited to 2,5s or infinite
      * \return
      */
-    Device(std::string path, unsigned int baud, bool infinite_timeout = false) : path(std::move(path)), baud(baud), serial_stream(
-            SerialOptions(this->path, baud, boost::posix_time::milliseconds(infinite_timeout? 0 : deviceTimeoutMsec))) {};
+    Device(std::string path, unsigned int baud, bool infinite_timeout = false) : path(std::move(path)), baud(baud),
+            timeout_msec(infinite_timeout ? 0 : deviceTimeoutMsec) {};
+
+    /**
+     * Switches the serial connection to another baud rate, discarding what was not read yet.
+     * \param new_baud the baud rate
+     * \return
+     */
+    void set_baud(unsigned int new_baud);
+
+    /**
+     * Checks if the connection can fall back to a slower baud rate.
+     * \return if lower_baud can be called.
+     */
+    virtual bool has_lower_baud() const { return false; }
+
+    /**
+     * Switches the connection to the next slower baud rate. The bootloader needs a new handshake afterwards.
+     * \return
+     */
+    virtual void lower_baud() {}
+
+    /**
+     * Checks if the baud rate limits the transfer speed, which is not the case for USB devices.
+     * \return if the baud rate is the bottleneck of the link.
+     */
+    virtual bool is_baud_limited() const { return false; }
 
     /**
      * Checks that the device is present at the specified Device::path.
@@ -78,45 +221,222 @@ protected:
     bool check_device_present();
 
     /**
-     * Checks wether the device is connected in bootloader mode.
-     * \param strict if the check doesn't also admit the '?' for unrecognized input
-     * \return if the device is in bootloader mode.
+     * Asks the bootloader for its banner, learning the Chip ID of the device.
+     * \return if the banner was received.
      */
-    template<typename _Rep, typename _Period>
-    bool detect_bootloader_mode(const std::chrono::duration<_Rep, _Period> &timeout, bool strict = true)  {
-        if(!check_output(strict? bootloaderRegexStrict: bootloaderRegexNoStrict, timeout)){
-            serial_stream << "i" << std::flush;
-            return check_output(bootloaderRegexStrict, timeout);
-        }
-        return true;
-    }
+    bool identify();
+
+    /**
+     * Establishes the communication with the bootloader.
+     * \throws DeviceNotFoundException If the device is not present or not in bootloader mode.
+     * \return if the communication was established.
+     */
+    virtual bool handshake();
+
+    /**
+     * Starts the upload mode of the bootloader, in windowed mode if both sides allow it.
+     * \return if the bootloader is ready to receive an image.
+     */
+    bool enable_upload();
 
     /**
      * Prepares the device to be flashed.
      * It initializes the bootloader for accepting binary images.
      * \return if the device is ready to be flashed.
      */
-    virtual bool prepare_flash();
+    bool prepare_flash() { return handshake() && enable_upload(); }
 
     /**
      * Sends a raw byte to the device.
      * \param data the raw byte to be sent
-     * \param path if the stream needs to be flushed
      * \return
      */
-    void send_byte(uint8_t data, bool flush = true);
+    void send_byte(uint8_t data);
+
+    /**
+     * Sends several commands to the bootloader with a single write, without waiting for the reply of each one.
+     * \param commands the command characters
+     * \return
+     */
+    void send_commands(const char *commands);
+
+    /**
+     * Sends a frame made of several buffers with a single write.
+     * \param buffers the pieces of the frame
+     * \param count the number of pieces
+     * \return
+     */
+    virtual void send_buffers(const struct iovec *buffers, int count);
+
+    /**
+     * Sets the shortest wait for a reply: the time the frames ahead of it take on the wire at the current baud rate,
+     * plus rtoMarginMsec for the turnaround of the device and the adapters.
+     * \param frame_bytes the size of the frames
+     * \param frames the frames sent and not acknowledged yet
+     * \return
+     */
+    void set_rto_floor(std::size_t frame_bytes, std::size_t frames);
+
+    /**
+     * Gets how long to wait for the reply to a packet. The last attempt falls back to the fixed timeout, in case
+     * the device is just slow rather than the reply lost.
+     * \param last_attempt if no retransmission follows
+     * \return the timeout in milliseconds, 0 for infinite.
+     */
+    int reply_timeout(bool last_attempt) const {
+        return !timeout_msec || last_attempt ? timeout_msec : rto.get_timeout_msec();
+    }
+
+    /**
+     * Discards the replies still coming from the device, until it stays silent.
+     * \param silence_msec how long the device must be silent
+     * \return
+     */
+    void drain_replies(int silence_msec);
+
+    /**
+     * Sends three CAN bytes, aborting the XMODEM transfer.
+     * \return
+     */
+    void cancel_transfer();
+
+    /**
+     * Waits for the 'C' meaning the device is accepting an XMODEM transfer in CRC mode.
+     * \throws XmodemTransmissionException If the device does not start the transfer.
+     * \return
+     */
+    void wait_transfer_start();
+
+    /**
+     * Sends a packet, retransmitting it until it gets acknowledged.
+     * \throws XmodemTransmissionException If the target cancelled the transmission and cancel was not allowed.
+     * \param pkt the packet to be sent
+     * \param attempts the maximum number of transmissions
+     * \param allow_cancel if a cancel request of the target is returned instead of being thrown
+     * \return the last reply of the target: xmodemAck if acknowledged, xmodemCan if cancelled.
+     */
+    uint8_t send_packet(XmodemPacket &pkt, int attempts, bool allow_cancel = false);
+
+    /**
+     * Sends the packets of the image in windowed mode: up to window frames travel ahead of their acknowledgement.
+     * The replies carry the block number they refer to: an ACK acknowledges every frame up to it, a NAK asks to go
+     * back to the frame it names, resending everything from there, and so does a timeout.
+     * \throws XmodemTransmissionException If the target cancelled the transmission or a frame could not be delivered.
+     * \throws FileIOException If the image could not be read.
+     * \param producer the source of the packets
+     * \param options the options of the flash operation
+     * \return false if the first frames found the link too noisy for the baud rate, true once every packet is
+     * acknowledged.
+     */
+    bool send_windowed(PacketProducer &producer, const flash_options_t &options);
 
 public:
 
     virtual ~Device() = default;
 
     /**
-     * Opens the SerialStream with the device.
+     * Instantiates the device connected at a path: a USBDevice for the ACM ports of the boards, a UARTDevice for
+     * the serial adapters.
+     * \param path the path to the device
+     * \param connection the parameters of the connection
+     * \return the device, owned by the caller.
+     */
+    static Device *create(const std::string &path, const connection_options_t &connection = connection_options_t());
+
+    /**
+     * Changes the deadline of the reads from the device, without touching the open communication.
+     * \param infinite if the reads never time out, rather than after 2,5s
+     * \return
+     */
+    void set_infinite_timeout(bool infinite) { timeout_msec = infinite ? 0 : deviceTimeoutMsec; }
+
+    /**
+     * Replaces the link to the device, closing the current one. The device path is handed to the transport as is.
+     * \param transport the transport, owned by the device from now on
+     * \return
+     */
+    void set_transport(std::unique_ptr<Transport> transport);
+
+    /**
+     * Sets the stream where the device output and the flash progress are printed, std::cout by default.
+     * \param stream the stream, which must outlive the device
+     * \return
+     */
+    void set_console(std::ostream &stream) { console = &stream; }
+
+    /**
+     * Sets the function called with every message of the procedure, e.g. "Rebooting the device...", in addition to
+     * printing it on the console. It is called by the thread driving the device.
+     * \param listener the function, empty to stop listening
+     * \return
+     */
+    void set_log_listener(std::function<void(const std::string &)> listener) { log_listener = std::move(listener); }
+
+    /**
+     * Reports a message of the procedure, printing it on the console and passing it to the log listener.
+     * \param message the message
+     * \param end_line if the console may be in the middle of a line, which is ended first
+     * \return
+     */
+    void log(const std::string &message, bool end_line = false);
+
+    /**
+     * Gets the Chip ID of the device, as printed by the bootloader.
+     * \return the Chip ID, empty if not known.
+     */
+    const std::string &get_chip_id() const { return chip_id; }
+
+    /**
+     * Gets the version of the bootloader, as printed in its banner.
+     * \return the version, empty if not known.
+     */
+    const std::string &get_bootloader_version() const { return bootloader_version; }
+
+    /**
+     * Checks quickly if a bootloader answers, learning its Chip ID. The communication stays open.
+     * \throws InterruptedException If the program was interrupted.
+     * \return if the bootloader sent its banner.
+     */
+    virtual bool probe();
+
+    /**
+     * Reboots the device, leaving the bootloader.
+     * \return
+     */
+    void reboot();
+
+    /**
+     * Gets the report of the last flash operation, even if it failed.
+     * \return the report.
+     */
+    const flash_report_t &get_report() const { return report; }
+
+    /**
+     * Gets the path to the device.
+     * \return the path.
+     */
+    const std::string &get_path() const { return path; }
+
+    /**
+     * Opens the serial port of the device.
      * \throws DeviceNotFoundException If the device unexpectedly stop responding.
      * \return if the stream was opened successfully.
      */
     virtual bool open_comm();
 
+    /**
+     * Reads the bytes the device sent, waiting only if there are none.
+     * \throws TimeoutException If nothing arrived within the timeout.
+     * \throws InterruptedException If the program was interrupted.
+     * \param data where the bytes are stored
+     * \param len the maximum number of bytes
+     * \param timeout_msec the deadline, 0 for infinite
+     * \return the number of bytes read, at least one.
+     */
+    std::size_t read_some(void *data, std::size_t len, int timeout_msec) {
+        return port->read_some(data, len, timeout_msec);
+    }
+
     /**
      * Reads something from the device and prints it to screen.
      * \tparam T the type of parameter to be read.
@@ -125,8 +445,8 @@ public:
     template<class T>
     T read_and_print() {
         T retval;
-        serial_stream.read(reinterpret_cast<char*>(&retval), sizeof(retval));
-        std::cout << retval << std::flush;
+        port->read(&retval, sizeof(retval), timeout_msec);
+        *console << retval << std::flush;
         return retval;
     }
 
@@ -139,15 +459,34 @@ public:
      * \throws FileIOException If there were problems opening or reading the binary file.
      * \throws ios::failure If the stream transmission to the device returned an error.
      * \param filename The binary image file path.
-     * \return
+     * \param options The options of the transfer.
+     * \return the report of the transfer.
+     */
+    flash_report_t flash(std::string filename, const flash_options_t &options = flash_options_t());
+
+    /**
+     * \internal
+     * Write to serial port.
+     * \throws XmodemTransmissionException If errors at XMODEM protocol level occurred.
+     * \throws DeviceNotFoundException If the device unexpectedly stop responding.
+     * \throws ios::failure If the stream transmission to the device returned an error.
+     * \param image The binary image.
+     * \param options The options of the transfer.
+     * \return the report of the transfer.
      */
-    void flash(std::string filename);
+    flash_report_t flash(ImageSource &image, const flash_options_t &options = flash_options_t());
 
     /**
      * Closes the stream communication with the device, if opened.
      * \return
      */
     void close_comm();
+
+    /**
+     * Discards what the device sent and was not read yet, if the communication is open.
+     * \return
+     */
+    void discard_input();
 };
 
 template<>
@@ -159,14 +498,58 @@ std::string Device::read_and_print<std::string>();
 class UARTDevice : public Device {
 
 private:
+    /// The baud rates of the automatic selection, fastest first. Empty if the baud rate is fixed.
+    std::vector<unsigned int> baud_rates;
+
+    /// The position in baud_rates of the rate in use.
+    std::size_t baud_index = 0;
+
+    /// If the bootloader confirmed the rate in use.
+    bool baud_locked = false;
+
+    /// If set, the rate confirmed by the bootloader is recorded here by device path.
+    CacheFile *baud_record = nullptr;
+
     /**
-     * Prepares the device to be flashed.
-     * It initializes the bootloader for accepting binary images.
-     * \return if the device is ready to be flashed.
+     * Sends the 'U' for autobauding the interface together with an 'i', then checks the bootloader answers with a
+     * clean banner. Whether the 'U' gets a banner or the '?' of a bootloader already synchronized, the 'i' gets a
+     * banner: a single round trip in both cases. The second banner, if any, is left to be skipped.
+     * \param timeout_msec the deadline of the banner
+     * \return if the banner was received.
+     */
+    bool probe_baud(int timeout_msec = autobaudProbeMsec);
+
+    /**
+     * Records the rate in use as the one that worked for the device path.
+     * \return
      */
-    bool prepare_flash() override;
+    void remember_baud();
+
+    /**
+     * Establishes the communication with the bootloader, autobauding its interface.
+     * With the automatic baud selection, the rates are tried from the fastest, starting from the recorded one.
+     * \throws DeviceNotFoundException If the device is not present or not in bootloader mode.
+     * \return if the communication was established.
+     */
+    bool handshake() override;
+
+    bool has_lower_baud() const override { return baud_index + 1 < baud_rates.size(); }
+
+    void lower_baud() override;
+
+    bool is_baud_limited() const override { return true; }
 
 public:
+    bool probe() override;
+
+    /**
+     * Enables the automatic baud selection.
+     * \param rates the baud rates to be tried, fastest first
+     * \param record if not null, where the rate that worked is remembered by device path
+     * \return
+     */
+    void set_auto_baud(std::vector<unsigned int> rates, CacheFile *record = nullptr);
+
     /**
      * Constructor. Initializes a default serial connected Wandstem: /dev/USB0 with 115200 baud rate.
      * \param infinite_timeout if the timeout should be limited to 2,5s or infinite
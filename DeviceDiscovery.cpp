@@ -0,0 +1,176 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "DeviceDiscovery.h"
+#include "SerialPort.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace {
+
+string base_name(const string &path) {
+    auto slash = path.find_last_of('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+string real_path(const string &path) {
+    char buffer[PATH_MAX];
+    return realpath(path.c_str(), buffer) != nullptr ? string(buffer) : string();
+}
+
+string read_attribute(const string &dir, const char *name) {
+    ifstream in(dir + "/" + name);
+    string value;
+    getline(in, value);
+    while (!value.empty() && isspace(static_cast<unsigned char>(value.back())))
+        value.pop_back();
+    return value;
+}
+
+bool exists(const string &path) {
+    struct stat buffer{};
+    return stat(path.c_str(), &buffer) == 0;
+}
+
+}
+
+tty_info_t DeviceDiscovery::describe(const std::string &path) const {
+    tty_info_t info;
+    info.path = path;
+    //a /dev/serial/by-id link names the same tty
+    string target = real_path(path);
+    string device = real_path(sysfs + "/" + base_name(target.empty() ? path : target) + "/device");
+    if (device.empty()) return info;
+    info.driver = base_name(real_path(device + "/driver"));
+    //the USB device is an ancestor of the tty, above the interface
+    for (string dir = device; dir.size() > 1; dir = dir.substr(0, dir.find_last_of('/'))) {
+        if (!exists(dir + "/idVendor")) continue;
+        info.vendor_id = read_attribute(dir, "idVendor");
+        info.product_id = read_attribute(dir, "idProduct");
+        info.serial = read_attribute(dir, "serial");
+        info.manufacturer = read_attribute(dir, "manufacturer");
+        info.product = read_attribute(dir, "product");
+        info.usb_port = base_name(dir);
+        break;
+    }
+    return info;
+}
+
+std::vector<tty_info_t> DeviceDiscovery::list(const std::vector<std::string> &specs) const {
+    vector<tty_info_t> result;
+    if (!specs.empty()) {
+        for (auto &path : Fleet::expand(specs))
+            result.push_back(describe(path));
+        return result;
+    }
+    //onboard UARTs are left out: they are rarely a board, and often the console of the host
+    DIR *dir = opendir(sysfs.c_str());
+    if (dir == nullptr) return result;
+    while (dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') continue;
+        auto info = describe("/dev/" + string(entry->d_name));
+        if (!info.vendor_id.empty() && exists(info.path)) result.push_back(info);
+    }
+    closedir(dir);
+    sort(result.begin(), result.end(), [](const tty_info_t &a, const tty_info_t &b) { return a.path < b.path; });
+    return result;
+}
+
+std::vector<discovered_t> DeviceDiscovery::probe(const std::vector<tty_info_t> &ports) {
+    vector<discovered_t> found(ports.size());
+    vector<char> answered(ports.size(), 0);
+    vector<thread> threads;
+    for (size_t i = 0; i < ports.size(); i++) {
+        threads.emplace_back([this, &ports, &found, &answered, i] {
+            ostream discard(nullptr);
+            try {
+                unique_ptr<Device> device(factory(ports[i].path));
+                device->set_console(discard);
+                if (!device->probe()) return;
+                found[i].tty = ports[i];
+                found[i].chip_id = device->get_chip_id();
+                found[i].bootloader_version = device->get_bootloader_version();
+                answered[i] = 1;
+            } catch (exception &ex) {
+                //not a board, or not in bootloader mode
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    if (SerialPort::interrupted())
+        throw InterruptedException("Interrupted");
+
+    vector<discovered_t> result;
+    for (size_t i = 0; i < ports.size(); i++) {
+        if (!answered[i]) continue;
+        auto &board = found[i];
+        if (record != nullptr && !board.chip_id.empty())
+            record->put(board.chip_id, board.tty.path + '\t' + board.tty.serial + '\t' + board.tty.usb_port);
+        result.push_back(board);
+    }
+    return result;
+}
+
+std::string DeviceDiscovery::resolve(const std::string &chip_id, const std::vector<tty_info_t> &ports) const {
+    if (record == nullptr) return "";
+    string entry = record->get(chip_id);
+    if (entry.empty()) return "";
+    auto first = entry.find('\t');
+    auto second = first == string::npos ? string::npos : entry.find('\t', first + 1);
+    string path = entry.substr(0, first);
+    string serial = first == string::npos ? "" : entry.substr(first + 1, second - first - 1);
+    string usb_port = second == string::npos ? "" : entry.substr(second + 1);
+    //the serial number follows the adapter to any port, the physical port comes next, the path last
+    if (!serial.empty())
+        for (auto &port : ports)
+            if (port.serial == serial) return port.path;
+    if (!usb_port.empty())
+        for (auto &port : ports)
+            if (port.usb_port == usb_port) return port.path;
+    //a port outside the candidates, e.g. an onboard UART, is taken as recorded
+    if (serial.empty() && usb_port.empty() && exists(path)) return path;
+    for (auto &port : ports)
+        if (port.path == path) return port.path;
+    return "";
+}
+
+void DeviceDiscovery::print(std::ostream &out, const std::vector<tty_info_t> &ports,
+                            const std::vector<discovered_t> &boards) {
+    for (auto &port : ports) {
+        out << port.path;
+        if (!port.vendor_id.empty()) {
+            out << "  " << port.vendor_id << ":" << port.product_id;
+            if (!port.manufacturer.empty()) out << " " << port.manufacturer;
+            if (!port.product.empty()) out << " " << port.product;
+            if (!port.serial.empty()) out << ", serial " << port.serial;
+            out << ", USB port " << port.usb_port;
+        }
+        if (!port.driver.empty()) out << ", driver " << port.driver;
+        auto board = find_if(boards.begin(), boards.end(),
+                             [&port](const discovered_t &b) { return b.tty.path == port.path; });
+        if (board == boards.end())
+            out << "  -- no bootloader answering" << endl;
+        else
+            out << "  -- Chip ID " << board->chip_id << ", bootloader " << board->bootloader_version << endl;
+    }
+}
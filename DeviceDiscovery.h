@@ -0,0 +1,97 @@
+#ifndef WANDSTEM_FLASH_UTILITY_DEVICEDISCOVERY_H
+#define WANDSTEM_FLASH_UTILITY_DEVICEDISCOVERY_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "Fleet.h"
+#include "CacheFile.h"
+
+///A candidate port, with the USB device it belongs to.
+struct tty_info_t {
+    std::string path;
+    ///The kernel driver of the port, e.g. ftdi_sio or cdc_acm.
+    std::string driver;
+    ///The USB identity, empty if the port is not on USB.
+    std::string vendor_id;
+    std::string product_id;
+    std::string serial;
+    std::string manufacturer;
+    std::string product;
+    ///The physical USB port, e.g. 1-1.2, which identifies the board when the adapter has no serial number.
+    std::string usb_port;
+};
+
+///A board found by the discovery.
+struct discovered_t {
+    tty_info_t tty;
+    std::string chip_id;
+    std::string bootloader_version;
+};
+
+/**
+ * This class finds the boards connected to the host. The candidate ports are listed from sysfs with the identity of
+ * their USB device, then probed concurrently for the bootloader banner, so the time taken is the one of the slowest
+ * port rather than the sum of all of them. The Chip ID of every board found is recorded with the USB serial number and
+ * the path of its port, so that a later run resolves a board from sysfs alone, even if the kernel numbered its port
+ * differently.
+ */
+class DeviceDiscovery {
+private:
+    ///The directory listing the ttys, /sys/class/tty.
+    std::string sysfs;
+
+    Fleet::device_factory_t factory;
+
+    ///The record of the boards found, by Chip ID.
+    CacheFile *record;
+
+public:
+    /**
+     * Constructor.
+     * \param factory the function instantiating the Device of a path
+     * \param record if not null, where the boards found are recorded by Chip ID
+     * \param sysfs the directory listing the ttys
+     * \return
+     */
+    DeviceDiscovery(Fleet::device_factory_t factory, CacheFile *record, std::string sysfs = "/sys/class/tty")
+            : sysfs(std::move(sysfs)), factory(std::move(factory)), record(record) {}
+
+    /**
+     * Describes a port, reading its USB identity from sysfs.
+     * \param path the path of the port
+     * \return the description, with only the path if the port is not in sysfs.
+     */
+    tty_info_t describe(const std::string &path) const;
+
+    /**
+     * Lists the candidate ports.
+     * \param specs paths, glob patterns or "auto"; if empty, every port on USB
+     * \return the sorted ports.
+     */
+    std::vector<tty_info_t> list(const std::vector<std::string> &specs) const;
+
+    /**
+     * Probes the ports concurrently for a bootloader, recording the boards found.
+     * \throws InterruptedException If the program was interrupted.
+     * \param ports the ports
+     * \return the boards that answered, in the order of the ports.
+     */
+    std::vector<discovered_t> probe(const std::vector<tty_info_t> &ports);
+
+    /**
+     * Finds the port of a board from the record, without probing.
+     * \param chip_id the Chip ID of the board
+     * \param ports the candidate ports
+     * \return the path of the port, empty if the board is not recorded or not among the ports.
+     */
+    std::string resolve(const std::string &chip_id, const std::vector<tty_info_t> &ports) const;
+
+    /**
+     * Prints the ports, with the Chip ID of the boards found on them.
+     * \return
+     */
+    static void print(std::ostream &out, const std::vector<tty_info_t> &ports, const std::vector<discovered_t> &boards);
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_DEVICEDISCOVERY_H
@@ -0,0 +1,184 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "FlashSession.h"
+#include "ImageSource.h"
+#include "ImageLoader.h"
+#include "Exceptions.h"
+#include <chrono>
+#include <vector>
+
+using namespace std;
+
+FlashSession::FlashSession(const std::string &path, const connection_options_t &connection, callbacks_t callbacks,
+                           std::unique_ptr<Transport> transport)
+        : FlashSession(unique_ptr<Device>(Device::create(path, connection)), std::move(callbacks)) {
+    if (transport) device->set_transport(std::move(transport));
+}
+
+FlashSession::FlashSession(std::unique_ptr<Device> device, callbacks_t callbacks)
+        : device(std::move(device)), callbacks(std::move(callbacks)), quiet(nullptr), cancelled(false) {
+    this->device->set_console(quiet);
+    this->device->set_log_listener([this](const string &message) {
+        if (this->callbacks.log) this->callbacks.log(message);
+    });
+}
+
+FlashSession::result_t FlashSession::guard(const std::function<void(result_t &)> &body) {
+    result_t result;
+    cancelled = false;
+    try {
+        body(result);
+        return result;
+    } catch (XmodemTransmissionException &ex) {
+        //a cancelled transfer is aborted as if the target had stopped answering
+        result.code = cancelled ? INTERRUPTED : TRANSMISSION_ERROR;
+        result.message = ex.what();
+    } catch (DeviceNotFoundException &ex) {
+        result.code = DEVICE_NOT_FOUND;
+        result.message = ex.what();
+    } catch (BinaryNotFoundException &ex) {
+        result.code = IMAGE_NOT_FOUND;
+        result.message = ex.what();
+    } catch (FileIOException &ex) {
+        result.code = IMAGE_READ_ERROR;
+        result.message = ex.what();
+    } catch (InterruptedException &ex) {
+        result.code = INTERRUPTED;
+        result.message = ex.what();
+    } catch (ios::failure &ex) {
+        result.code = LINK_ERROR;
+        result.message = ex.what();
+    } catch (exception &ex) {
+        result.code = UNEXPECTED_ERROR;
+        result.message = ex.what();
+    } catch (...) {
+        result.code = UNEXPECTED_ERROR;
+        result.message = "Unknown exception";
+    }
+    //the telemetry of a failed operation tells where it went wrong
+    result.report = device->get_report();
+    return result;
+}
+
+FlashSession::result_t FlashSession::flash(const std::string &image_path, flash_options_t options) {
+    unique_ptr<ImageSource> image;
+    auto loaded = guard([&](result_t &) {
+        ImageLoader::image_format format;
+        image = ImageLoader::load(image_path, options.trim_erased, &format, options.format);
+        device->log("Loading binary image file...loaded " + ImageLoader::describe(*image, format) + "!");
+    });
+    if (loaded.code != OK) {
+        loaded.report = flash_report_t();
+        return loaded;
+    }
+    return flash(*image, std::move(options));
+}
+
+FlashSession::result_t FlashSession::flash(ImageSource &image, flash_options_t options) {
+    return guard([&](result_t &result) {
+        options.abort = &cancelled;
+        if (callbacks.progress) {
+            auto chained = options.progress;
+            options.progress = [this, &image, chained](size_t bytes) {
+                if (chained) chained(bytes);
+                callbacks.progress(bytes, image.size_known() ? image.size() : 0);
+            };
+        }
+        result.report = device->flash(image, options);
+    });
+}
+
+FlashSession::result_t FlashSession::probe() {
+    return guard([this](result_t &) {
+        device->discard_input();
+        if (!device->probe())
+            throw DeviceNotFoundException("The bootloader of " + device->get_path() + " is not answering");
+    });
+}
+
+FlashSession::result_t FlashSession::reboot() {
+    return guard([this](result_t &) {
+        device->discard_input();
+        if (!device->probe())
+            throw DeviceNotFoundException("The bootloader of " + device->get_path() + " is not answering");
+        device->reboot();
+    });
+}
+
+FlashSession::result_t FlashSession::monitor(double seconds) {
+    return guard([this, seconds](result_t &result) {
+        if (!device->open_comm())
+            throw DeviceNotFoundException("Cannot open " + device->get_path());
+        //whatever the firmware printed before is of no interest
+        device->discard_input();
+        auto deadline = chrono::steady_clock::time_point::max();
+        if (seconds > 0)
+            deadline = chrono::steady_clock::now() + chrono::microseconds(static_cast<int64_t>(seconds * 1e6));
+        vector<char> buffer(serialReadChunk);
+        string line;
+        uint64_t lines = 0;
+        auto emit = [this, &line, &lines] {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (callbacks.output) callbacks.output(line);
+            line.clear();
+            lines++;
+        };
+        for (;;) {
+            if (cancelled || (callbacks.keep_monitoring && !callbacks.keep_monitoring())) break;
+            auto now = chrono::steady_clock::now();
+            if (now >= deadline) break;
+            int wait = sessionPollMsec;
+            if (deadline != chrono::steady_clock::time_point::max()) {
+                auto left = chrono::duration_cast<chrono::milliseconds>(deadline - now).count() + 1;
+                wait = static_cast<int>(min<int64_t>(wait, left));
+            }
+            size_t got;
+            try {
+                got = device->read_some(buffer.data(), buffer.size(), wait);
+            } catch (TimeoutException &ex) {
+                continue;
+            }
+            for (size_t i = 0; i < got; i++) {
+                if (buffer[i] == '\n') emit();
+                else line += buffer[i];
+            }
+        }
+        if (!line.empty()) emit();
+        result.message = to_string(lines) + " lines";
+    });
+}
+
+const char *FlashSession::describe(result_code code) {
+    switch (code) {
+        case OK:
+            return "Success";
+        case DEVICE_NOT_FOUND:
+            return "Error while establishing communication with device";
+        case TRANSMISSION_ERROR:
+            return "Xmodem transmission error";
+        case IMAGE_NOT_FOUND:
+            return "Error opening the binary image file";
+        case IMAGE_READ_ERROR:
+            return "Binary file reading error";
+        case INTERRUPTED:
+            return "Operation interrupted";
+        case LINK_ERROR:
+            return "Physical communication with the device error";
+        case UNEXPECTED_ERROR:
+        default:
+            return "Unexpected error";
+    }
+}
@@ -0,0 +1,163 @@
+#ifndef WANDSTEM_FLASH_UTILITY_FLASHSESSION_H
+#define WANDSTEM_FLASH_UTILITY_FLASHSESSION_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <ostream>
+#include "Device.h"
+
+static const int sessionPollMsec=100;
+
+class ImageSource;
+
+/**
+ * This class is the entry point for embedding the utility: a session drives a single board, flashing, monitoring
+ * and rebooting it, and keeps its port open between operations.
+ * Sessions share no state, so any number of them can run in parallel, each one from its own thread. Nothing is
+ * printed: messages, progress and the output of the firmware are passed to callbacks, called by the thread running
+ * the operation, and every operation returns a result code instead of throwing.
+ */
+class FlashSession {
+public:
+    ///The outcome of an operation.
+    enum result_code {
+        OK, DEVICE_NOT_FOUND, TRANSMISSION_ERROR, IMAGE_NOT_FOUND, IMAGE_READ_ERROR, INTERRUPTED, LINK_ERROR,
+        UNEXPECTED_ERROR
+    };
+
+    ///The result of an operation.
+    struct result_t {
+        result_code code = OK;
+        ///What went wrong, empty on success.
+        std::string message;
+        ///The report of the flash operation, even if it failed.
+        flash_report_t report;
+    };
+
+    ///The functions the session reports to, any of them can be left empty.
+    struct callbacks_t {
+        ///Called with every message of the flash procedure.
+        std::function<void(const std::string &)> log;
+        ///Called after every acknowledged packet with the image bytes sent so far and the size of the image, 0 while
+        ///a compressed image is still being decompressed.
+        std::function<void(std::size_t, std::size_t)> progress;
+        ///Called with every line printed by the firmware while monitoring, without terminator.
+        std::function<void(const std::string &)> output;
+        ///Called at least every sessionPollMsec while monitoring, which stops as soon as it returns false.
+        std::function<bool()> keep_monitoring;
+    };
+
+private:
+    std::unique_ptr<Device> device;
+
+    callbacks_t callbacks;
+
+    ///Swallows the console of the device, whose messages reach callbacks.log.
+    std::ostream quiet;
+
+    ///If the operation in progress was cancelled.
+    std::atomic<bool> cancelled;
+
+    /**
+     * Runs an operation, turning the exceptions it throws into a result code.
+     * \param body the operation, filling the result on success
+     * \return the result.
+     */
+    result_t guard(const std::function<void(result_t &)> &body);
+
+public:
+    /**
+     * Constructor. The device is not opened until the first operation.
+     * \param path the path to the device
+     * \param connection the parameters of the connection
+     * \param callbacks the functions the session reports to
+     * \param transport if not null, the link to the device, replacing its serial port
+     */
+    explicit FlashSession(const std::string &path, const connection_options_t &connection = connection_options_t(),
+                          callbacks_t callbacks = callbacks_t(), std::unique_ptr<Transport> transport = nullptr);
+
+    /**
+     * Constructor. Drives a device already instantiated.
+     * \param device the device, owned by the session from now on
+     * \param callbacks the functions the session reports to
+     */
+    explicit FlashSession(std::unique_ptr<Device> device, callbacks_t callbacks = callbacks_t());
+
+    FlashSession(FlashSession const &) = delete;
+
+    void operator=(FlashSession const &) = delete;
+
+    /**
+     * Prints the console of the device on a stream, as a terminal shows it, progress dots included. Messages still
+     * reach callbacks.log.
+     * \param stream the stream, which must outlive the session
+     * \return
+     */
+    void set_console(std::ostream &stream) { device->set_console(stream); }
+
+    /**
+     * Replaces the functions the session reports to, e.g. to report every operation to whoever asked for it.
+     * It must not be called while an operation is in progress.
+     * \param callbacks the functions
+     * \return
+     */
+    void set_callbacks(callbacks_t callbacks) { this->callbacks = std::move(callbacks); }
+
+    /**
+     * Loads an image file and flashes it, then reboots the device.
+     * \param image_path the path of the image, in any format ImageLoader reads, "-" for the standard input
+     * \param options the options of the transfer, whose abort flag is replaced by the one of cancel
+     * \return the result, OK also when the transfer was skipped.
+     */
+    result_t flash(const std::string &image_path, flash_options_t options = flash_options_t());
+
+    /**
+     * Flashes an image, then reboots the device.
+     * \param image the image
+     * \param options the options of the transfer, whose abort flag is replaced by the one of cancel
+     * \return the result, OK also when the transfer was skipped.
+     */
+    result_t flash(ImageSource &image, flash_options_t options = flash_options_t());
+
+    /**
+     * Checks if a bootloader answers, learning the Chip ID of the device.
+     * \return the result, DEVICE_NOT_FOUND if no bootloader answered.
+     */
+    result_t probe();
+
+    /**
+     * Reboots the device, leaving the bootloader.
+     * \return the result, DEVICE_NOT_FOUND if no bootloader answered.
+     */
+    result_t reboot();
+
+    /**
+     * Passes the lines printed by the firmware from now on to callbacks.output.
+     * \param seconds how long to listen, 0 until cancel is called
+     * \return the result, whose message is the number of lines received.
+     */
+    result_t monitor(double seconds);
+
+    /**
+     * Stops the operation in progress. It is safe to call it from another thread.
+     * A transfer stops after the packet in flight and returns INTERRUPTED, a monitor returns what it received.
+     * \return
+     */
+    void cancel() { cancelled = true; }
+
+    /**
+     * Gets the device driven by the session, for the operations the session does not wrap.
+     * \return the device.
+     */
+    Device &get_device() { return *device; }
+
+    /**
+     * Describes a result code.
+     * \return the description.
+     */
+    static const char *describe(result_code code);
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_FLASHSESSION_H
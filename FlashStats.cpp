@@ -0,0 +1,149 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "FlashStats.h"
+#include <iomanip>
+
+using namespace std;
+
+namespace {
+
+const char *retryNames[] = {"nak", "timeout", "cancel", "other"};
+const char *phaseNames[] = {"handshake", "transfer", "eot"};
+const char *handshakeStepNames[] = {"sync", "upload_mode", "transfer_start"};
+
+}
+
+void write_json_string(std::ostream &out, const std::string &s) {
+    out << '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') out << '\\' << c;
+        else if (c < 0x20) out << "\\u" << hex << setw(4) << setfill('0') << static_cast<int>(c) << dec << setfill(' ');
+        else out << c;
+    }
+    out << '"';
+}
+
+int LatencyHistogram::bucket_of(uint32_t usec) {
+    //the four smallest values get a bucket each, then the highest bit set picks the power of two and the two
+    //bits below it the quarter
+    if (usec < 4) return static_cast<int>(usec);
+    int exponent = 31 - __builtin_clz(usec);
+    return (exponent - 1) * 4 + static_cast<int>((usec >> (exponent - 2)) & 3);
+}
+
+uint32_t LatencyHistogram::upper_bound(int bucket) {
+    if (bucket < 4) return static_cast<uint32_t>(bucket);
+    int exponent = bucket / 4 + 1;
+    return static_cast<uint32_t>(((uint64_t(5) + bucket % 4) << (exponent - 2)) - 1);
+}
+
+void LatencyHistogram::add(uint32_t usec) {
+    counts[bucket_of(usec)]++;
+    count++;
+    total_usec += usec;
+    if (usec < min_usec) min_usec = usec;
+    if (usec > max_usec) max_usec = usec;
+}
+
+uint32_t LatencyHistogram::percentile(double fraction) const {
+    if (!count) return 0;
+    auto rank = static_cast<uint64_t>(fraction * count + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < latencyBuckets; i++) {
+        seen += counts[i];
+        if (seen >= rank) return upper_bound(i) < max_usec ? upper_bound(i) : max_usec;
+    }
+    return max_usec;
+}
+
+void FlashStats::set_link(const std::string &path, unsigned int baud) {
+    this->path = path;
+    this->baud = baud;
+}
+
+void FlashStats::record_packet(std::size_t size, std::chrono::steady_clock::duration rtt, bool acked,
+                               std::size_t payload) {
+    auto usec = chrono::duration_cast<chrono::microseconds>(rtt).count();
+    latency.add(static_cast<uint32_t>(usec < 0 ? 0 : usec > UINT32_MAX ? UINT32_MAX : usec));
+    wire_bytes += size;
+    if (!acked) return;
+    packets++;
+    payload_bytes += payload;
+}
+
+void FlashStats::add_phase(phase p, std::chrono::steady_clock::duration elapsed) {
+    phase_seconds[p] += chrono::duration<double>(elapsed).count();
+}
+
+void FlashStats::add_handshake_step(handshake_step step, std::chrono::steady_clock::duration elapsed) {
+    handshake_seconds[step] += chrono::duration<double>(elapsed).count();
+}
+
+double FlashStats::get_payload_rate() const {
+    return phase_seconds[TRANSFER] > 0 ? payload_bytes / phase_seconds[TRANSFER] : 0;
+}
+
+void FlashStats::print(std::ostream &out) const {
+    double wire_rate = phase_seconds[TRANSFER] > 0 ? wire_bytes / phase_seconds[TRANSFER] : 0;
+    out << " :: Statistics of " << path;
+    if (baud) out << " at " << baud << " baud";
+    out << " ::" << endl << fixed << setprecision(3)
+        << "    phases: handshake " << phase_seconds[HANDSHAKE] << " s, transfer " << phase_seconds[TRANSFER]
+        << " s, end of transmission " << phase_seconds[EOT] << " s" << endl
+        << "    handshake: sync " << handshake_seconds[SYNC] << " s, upload mode " << handshake_seconds[UPLOAD_MODE]
+        << " s, transfer start " << handshake_seconds[TRANSFER_START] << " s" << endl
+        << "    packets: " << packets << " acknowledged, retries " << retries[NAK] << " NAK, " << retries[TIMEOUT]
+        << " timeout, " << retries[CANCEL] << " cancel, " << retries[OTHER] << " other" << endl
+        << "    reply latency (ms): min " << latency.get_min() / 1000.0 << ", mean " << latency.get_mean() / 1000.0
+        << ", p50 <= " << latency.percentile(0.5) / 1000.0 << ", p90 <= " << latency.percentile(0.9) / 1000.0
+        << ", p99 <= " << latency.percentile(0.99) / 1000.0 << ", max " << latency.get_max() / 1000.0 << endl
+        << setprecision(0) << "    throughput: " << get_payload_rate() << " B/s of image, " << wire_rate
+        << " B/s on the wire";
+    if (baud)
+        out << ", " << setprecision(1) << wire_rate * 100 / get_link_limit() << "% of the " << setprecision(0)
+            << get_link_limit() << " B/s link limit";
+    out << defaultfloat << endl;
+}
+
+void FlashStats::print_json(std::ostream &out) const {
+    auto precision = out.precision();
+    out << setprecision(6) << "{\"path\":";
+    write_json_string(out, path);
+    out << ",\"baud\":" << baud << ",\"packets\":" << packets << ",\"payload_bytes\":" << payload_bytes
+        << ",\"wire_bytes\":" << wire_bytes << ",\"retries\":{";
+    for (int i = 0; i < 4; i++)
+        out << (i ? "," : "") << '"' << retryNames[i] << "\":" << retries[i];
+    out << "},\"phases\":{";
+    for (int i = 0; i < 3; i++)
+        out << (i ? "," : "") << '"' << phaseNames[i] << "\":" << phase_seconds[i];
+    out << "},\"handshake\":{";
+    for (int i = 0; i < 3; i++)
+        out << (i ? "," : "") << '"' << handshakeStepNames[i] << "\":" << handshake_seconds[i];
+    out << "},\"latency_usec\":{\"count\":" << latency.get_count() << ",\"min\":" << latency.get_min()
+        << ",\"mean\":" << latency.get_mean() << ",\"p50\":" << latency.percentile(0.5) << ",\"p90\":"
+        << latency.percentile(0.9) << ",\"p99\":" << latency.percentile(0.99) << ",\"max\":" << latency.get_max()
+        << ",\"buckets\":[";
+    //only the buckets holding something, as [upper bound, count] pairs
+    bool first = true;
+    for (int i = 0; i < latencyBuckets; i++) {
+        if (!latency.get_buckets()[i]) continue;
+        out << (first ? "" : ",") << '[' << LatencyHistogram::upper_bound(i) << ',' << latency.get_buckets()[i] << ']';
+        first = false;
+    }
+    out << "]},\"payload_rate\":" << get_payload_rate() << ",\"link_limit\":" << get_link_limit() << '}'
+        << setprecision(static_cast<int>(precision));
+}
@@ -0,0 +1,186 @@
+#ifndef WANDSTEM_FLASH_UTILITY_FLASHSTATS_H
+#define WANDSTEM_FLASH_UTILITY_FLASHSTATS_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+static const int latencyBuckets=124;
+
+/**
+ * Writes a string as a JSON literal, quoted and escaped.
+ * \return
+ */
+void write_json_string(std::ostream &out, const std::string &s);
+
+/**
+ * This class counts latencies in log-linear buckets of microseconds: every power of two is split in four, so
+ * recording one costs a few instructions and no allocation, and percentiles are reported as the upper bound of
+ * their bucket, at most 25% above the exact value.
+ */
+class LatencyHistogram {
+private:
+    ///The number of latencies in every bucket, see bucket_of.
+    std::array<uint32_t, latencyBuckets> counts{};
+
+    uint32_t count = 0;
+
+    uint64_t total_usec = 0;
+
+    uint32_t min_usec = UINT32_MAX;
+
+    uint32_t max_usec = 0;
+
+public:
+    /**
+     * Finds the bucket of a latency.
+     * \param usec the latency in microseconds
+     * \return the bucket index.
+     */
+    static int bucket_of(uint32_t usec);
+
+    /**
+     * Gets the highest latency falling in a bucket.
+     * \param bucket the bucket index
+     * \return the upper bound in microseconds.
+     */
+    static uint32_t upper_bound(int bucket);
+
+    /**
+     * Records a latency.
+     * \param usec the latency in microseconds
+     * \return
+     */
+    void add(uint32_t usec);
+
+    /**
+     * Estimates a percentile.
+     * \param fraction the percentile, between 0 and 1
+     * \return the upper bound in microseconds of the bucket holding the percentile, 0 if empty.
+     */
+    uint32_t percentile(double fraction) const;
+
+    uint32_t get_count() const { return count; }
+
+    uint32_t get_min() const { return count ? min_usec : 0; }
+
+    uint32_t get_max() const { return max_usec; }
+
+    double get_mean() const { return count ? static_cast<double>(total_usec) / count : 0; }
+
+    const std::array<uint32_t, latencyBuckets> &get_buckets() const { return counts; }
+};
+
+/**
+ * This class collects the telemetry of a flash operation: the send to reply latency of every packet, the
+ * retransmissions by their cause, the time spent in every phase and the throughput against the link limit.
+ */
+class FlashStats {
+public:
+    ///The causes of a retransmission.
+    enum retry_cause {
+        NAK, TIMEOUT, CANCEL, OTHER
+    };
+
+    ///The phases of a flash operation.
+    enum phase {
+        HANDSHAKE, TRANSFER, EOT
+    };
+
+    ///The steps of the handshake: reaching the bootloader and reading its banner, starting the upload mode, waiting
+    ///for the 'C' asking for the transfer.
+    enum handshake_step {
+        SYNC, UPLOAD_MODE, TRANSFER_START
+    };
+
+private:
+    std::string path;
+
+    ///The baud rate limiting the link, 0 if it is not the bottleneck (e.g. USB).
+    unsigned int baud = 0;
+
+    ///The latency of the replies to the packets, acknowledged or not.
+    LatencyHistogram latency;
+
+    std::array<uint32_t, 4> retries{};
+
+    std::array<double, 3> phase_seconds{};
+
+    std::array<double, 3> handshake_seconds{};
+
+    ///The image bytes acknowledged.
+    uint64_t payload_bytes = 0;
+
+    ///Every byte sent during the transfer, retransmissions included.
+    uint64_t wire_bytes = 0;
+
+    uint32_t packets = 0;
+
+public:
+    /**
+     * Sets the link the statistics refer to.
+     * \param path the path of the device
+     * \param baud the baud rate of the link, 0 if it does not limit the transfer
+     * \return
+     */
+    void set_link(const std::string &path, unsigned int baud);
+
+    /**
+     * Records a transmission of a packet.
+     * \param size the bytes of the frame
+     * \param rtt the time from the send to the reply
+     * \param acked if the reply was an ACK
+     * \param payload the image bytes in the packet
+     * \return
+     */
+    void record_packet(std::size_t size, std::chrono::steady_clock::duration rtt, bool acked, std::size_t payload);
+
+    /**
+     * Records a transmission that was not acknowledged.
+     * \param cause why
+     * \return
+     */
+    void record_retry(retry_cause cause) { retries[cause]++; }
+
+    /**
+     * Adds time to a phase.
+     * \return
+     */
+    void add_phase(phase p, std::chrono::steady_clock::duration elapsed);
+
+    /**
+     * Adds time to a step of the handshake, which is part of the HANDSHAKE phase.
+     * \return
+     */
+    void add_handshake_step(handshake_step step, std::chrono::steady_clock::duration elapsed);
+
+    /**
+     * Gets the image bytes per second acknowledged during the transfer.
+     * \return the throughput, 0 if nothing was transferred.
+     */
+    double get_payload_rate() const;
+
+    /**
+     * Gets the bytes per second the link can carry in one direction, 10 bits per byte.
+     * \return the limit, 0 if unknown.
+     */
+    double get_link_limit() const { return baud / 10.0; }
+
+    const LatencyHistogram &get_latency() const { return latency; }
+
+    /**
+     * Prints a human readable summary.
+     * \return
+     */
+    void print(std::ostream &out) const;
+
+    /**
+     * Prints the statistics as a single line JSON object.
+     * \return
+     */
+    void print_json(std::ostream &out) const;
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_FLASHSTATS_H
@@ -0,0 +1,195 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "Fleet.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <glob.h>
+
+using namespace std;
+
+Fleet::Fleet(const std::vector<std::string> &paths, device_factory_t factory, unsigned int jobs,
+             unsigned int max_attempts) : factory(std::move(factory)), jobs(jobs), max_attempts(max_attempts),
+                                          next_board(0), cancelled(false) {
+    for (auto &path : paths)
+        boards.emplace_back(new board_t(path));
+    if (this->jobs == 0 || this->jobs > boards.size())
+        this->jobs = static_cast<unsigned int>(boards.size());
+    if (this->max_attempts == 0)
+        this->max_attempts = 1;
+}
+
+std::vector<std::string> Fleet::expand(const std::vector<std::string> &specs) {
+    set<string> paths;
+    for (auto &spec : specs) {
+        vector<string> patterns;
+        if (spec == "auto")
+            patterns = {"/dev/ttyUSB*", "/dev/ttyACM*"};
+        else if (spec.find_first_of("*?[") == string::npos)
+            paths.insert(spec);
+        else
+            patterns = {spec};
+        for (auto &pattern : patterns) {
+            glob_t result{};
+            if (glob(pattern.c_str(), 0, nullptr, &result) == 0)
+                for (size_t i = 0; i < result.gl_pathc; i++)
+                    paths.insert(result.gl_pathv[i]);
+            globfree(&result);
+        }
+    }
+    return vector<string>(paths.begin(), paths.end());
+}
+
+void Fleet::flash_board(board_t &board, ImageSource &image, const flash_options_t &options) {
+    auto start = chrono::steady_clock::now();
+    //the boards share the terminal, their own chatter is discarded
+    ostream discard(nullptr);
+    flash_options_t board_options = options;
+    board_options.abort = &cancelled;
+    board_options.progress = [&board](size_t bytes) { board.bytes_sent = bytes; };
+    {
+        lock_guard<mutex> lock(mtx);
+        board.status = FLASHING;
+    }
+    bool passed = false, skipped = false;
+    string error;
+    unsigned int retransmissions = 0;
+    unsigned int attempts = 0;
+    FlashStats stats;
+    stats.set_link(board.path, 0);
+    while (!passed && attempts < max_attempts && !cancelled) {
+        attempts++;
+        board.bytes_sent = 0;
+        unique_ptr<Device> device;
+        try {
+            device.reset(factory(board.path));
+            device->set_console(discard);
+            skipped = device->flash(image, board_options).skipped;
+            passed = true;
+        } catch (exception &ex) {
+            error = ex.what();
+        }
+        //failed attempts count as well
+        if (device) {
+            retransmissions += device->get_report().retransmissions;
+            stats = device->get_report().stats;
+        }
+    }
+    lock_guard<mutex> lock(mtx);
+    board.status = passed ? PASSED : FAILED;
+    board.attempts = attempts;
+    board.skipped = skipped;
+    board.retransmissions = retransmissions;
+    board.stats = stats;
+    board.error = passed ? "" : cancelled && error.empty() ? "Interrupted" : error;
+    board.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void Fleet::work(ImageSource &image, const flash_options_t &options) {
+    for (size_t i = next_board++; i < boards.size(); i = next_board++) {
+        if (cancelled) {
+            lock_guard<mutex> lock(mtx);
+            boards[i]->status = FAILED;
+            boards[i]->error = "Interrupted";
+            continue;
+        }
+        flash_board(*boards[i], image, options);
+    }
+}
+
+void Fleet::print_progress(std::ostream &out, std::size_t image_size) {
+    lock_guard<mutex> lock(mtx);
+    size_t done = 0;
+    ostringstream line;
+    for (auto &board : boards) {
+        auto name = board->path.substr(board->path.find_last_of('/') + 1);
+        switch (board->status) {
+            case PENDING:
+                line << ' ' << name << " -";
+                break;
+            case FLASHING:
+                //while a streamed image is being read its size is unknown, the bytes sent are shown instead
+                if (image_size) line << ' ' << name << ' ' << board->bytes_sent * 100 / image_size << '%';
+                else line << ' ' << name << ' ' << board->bytes_sent / 1024 << 'K';
+                break;
+            case PASSED:
+                done++;
+                line << ' ' << name << " ok";
+                break;
+            case FAILED:
+                done++;
+                line << ' ' << name << " FAIL";
+                break;
+        }
+    }
+    out << " :: " << done << '/' << boards.size() << " done ::" << line.str() << endl;
+}
+
+bool Fleet::flash(ImageSource &image, const flash_options_t &options, std::ostream &out) {
+    out << " :: Flashing " << boards.size() << " boards, " << jobs << " at a time ::" << endl;
+    atomic<unsigned int> running_workers(jobs);
+    vector<thread> workers;
+    for (unsigned int i = 0; i < jobs; i++)
+        workers.emplace_back([&] {
+            work(image, options);
+            running_workers--;
+        });
+    auto next_print = chrono::steady_clock::now();
+    while (running_workers) {
+        if (chrono::steady_clock::now() >= next_print) {
+            print_progress(out, image.size_known() ? image.size() : 0);
+            next_print += chrono::milliseconds(fleetProgressPeriodMsec);
+        }
+        this_thread::sleep_for(chrono::milliseconds(50));
+    }
+    for (auto &worker : workers)
+        worker.join();
+    print_progress(out, image.size_known() ? image.size() : 0);
+    print_summary(out);
+    return all_of(boards.begin(), boards.end(), [](const unique_ptr<board_t> &board) {
+        return board->status == PASSED;
+    });
+}
+
+void Fleet::print_summary(std::ostream &out) {
+    lock_guard<mutex> lock(mtx);
+    out << " :: Summary ::" << endl;
+    for (auto &board : boards) {
+        out << "    " << left << setw(20) << board->path << right << (board->status == PASSED ? " PASS" : " FAIL")
+            << "  attempts " << board->attempts << "  retransmissions " << board->retransmissions << "  "
+            << fixed << setprecision(1) << board->seconds << defaultfloat << " s";
+        if (board->skipped)
+            out << "  unchanged";
+        if (board->status != PASSED)
+            out << "  " << board->error;
+        out << endl;
+    }
+}
+
+void Fleet::print_stats(std::ostream &out, bool json) {
+    lock_guard<mutex> lock(mtx);
+    for (auto &board : boards) {
+        if (json) {
+            board->stats.print_json(out);
+            out << endl;
+        } else {
+            board->stats.print(out);
+        }
+    }
+}
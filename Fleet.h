@@ -0,0 +1,139 @@
+#ifndef WANDSTEM_FLASH_UTILITY_FLEET_H
+#define WANDSTEM_FLASH_UTILITY_FLEET_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <memory>
+#include "Device.h"
+#include "ImageSource.h"
+
+static const int fleetProgressPeriodMsec=1000;
+
+/**
+ * This class models a set of boards flashed concurrently with the same image.
+ */
+class Fleet {
+public:
+    ///Instantiates the Device connected at a path.
+    typedef std::function<Device *(const std::string &path)> device_factory_t;
+
+    ///The possible states of a board.
+    enum board_status {
+        PENDING, FLASHING, PASSED, FAILED
+    };
+
+    ///The progress and outcome of a board.
+    struct board_t {
+        std::string path;
+        board_status status = PENDING;
+        ///The number of times the flash was attempted.
+        unsigned int attempts = 0;
+        ///The packets sent again, summed over every attempt.
+        unsigned int retransmissions = 0;
+        ///The image bytes acknowledged during the current attempt.
+        std::atomic<std::size_t> bytes_sent;
+        ///The duration of the whole operation, retries included.
+        double seconds = 0;
+        ///The error of the last failed attempt.
+        std::string error;
+        ///If the transfer was skipped because the board already had the image.
+        bool skipped = false;
+        ///The telemetry of the last attempt.
+        FlashStats stats;
+
+        explicit board_t(std::string path) : path(std::move(path)), bytes_sent(0) {}
+    };
+
+private:
+    ///The boards, in the order they were specified.
+    std::vector<std::unique_ptr<board_t>> boards;
+
+    device_factory_t factory;
+
+    ///The maximum number of boards flashed at the same time.
+    unsigned int jobs;
+
+    ///The maximum number of attempts for every board.
+    unsigned int max_attempts;
+
+    ///The index of the next board to be picked by a worker.
+    std::atomic<std::size_t> next_board;
+
+    ///If the operation was interrupted.
+    std::atomic<bool> cancelled;
+
+    ///Protects the status, error and counters of the boards.
+    std::mutex mtx;
+
+    /**
+     * The body of a worker thread: it flashes boards until none is left.
+     * \return
+     */
+    void work(ImageSource &image, const flash_options_t &options);
+
+    /**
+     * Flashes a board, retrying on failure.
+     * \return
+     */
+    void flash_board(board_t &board, ImageSource &image, const flash_options_t &options);
+
+    /**
+     * Prints a line with the progress of every board.
+     * \return
+     */
+    void print_progress(std::ostream &out, std::size_t image_size);
+
+public:
+    /**
+     * Constructor.
+     * \param paths the device paths of the boards
+     * \param factory the function instantiating the Device of a path
+     * \param jobs the maximum number of boards flashed at the same time, 0 for all of them
+     * \param max_attempts the maximum number of attempts for every board
+     * \return
+     */
+    Fleet(const std::vector<std::string> &paths, device_factory_t factory, unsigned int jobs,
+          unsigned int max_attempts);
+
+    /**
+     * Expands the device specifications into paths. Each one can be a path, a glob pattern, or "auto" for every
+     * USB serial adapter and USB connected board.
+     * \param specs the device specifications
+     * \return the sorted paths, without duplicates.
+     */
+    static std::vector<std::string> expand(const std::vector<std::string> &specs);
+
+    /**
+     * Flashes every board with the same image, printing their progress.
+     * \param image the image, which must allow concurrent views
+     * \param options the options of the transfers
+     * \param out the stream where progress and summary are printed
+     * \return if every board was flashed.
+     */
+    bool flash(ImageSource &image, const flash_options_t &options, std::ostream &out);
+
+    /**
+     * Interrupts the operation. It can be called from a signal handler.
+     * \return
+     */
+    void cancel() { cancelled = true; }
+
+    /**
+     * Prints the outcome of every board.
+     * \param out the stream where the summary is printed
+     * \return
+     */
+    void print_summary(std::ostream &out);
+
+    /**
+     * Prints the telemetry of the last attempt on every board.
+     * \param json if every board is printed as a JSON object on its own line, rather than as a human summary
+     * \return
+     */
+    void print_stats(std::ostream &out, bool json);
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_FLEET_H
@@ -0,0 +1,356 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "ImageLoader.h"
+#include "Exceptions.h"
+#include <cctype>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+/// Reads an unsigned integer of an ELF file, honouring its endianness.
+uint64_t read_uint(const uint8_t *data, size_t len, size_t offset, size_t size, bool big_endian) {
+    if (offset > len || size > len - offset)
+        throw FileIOException("Truncated ELF file");
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++)
+        value |= static_cast<uint64_t>(data[offset + i]) << 8 * (big_endian ? size - 1 - i : i);
+    return value;
+}
+
+int hex_digit(uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+/// Decodes the hexadecimal bytes of a text record.
+vector<uint8_t> decode_hex(const uint8_t *begin, const uint8_t *end, const char *error) {
+    if ((end - begin) % 2)
+        throw FileIOException(error);
+    vector<uint8_t> bytes;
+    bytes.reserve(static_cast<size_t>(end - begin) / 2);
+    for (; begin < end; begin += 2) {
+        int hi = hex_digit(begin[0]), lo = hex_digit(begin[1]);
+        if (hi < 0 || lo < 0)
+            throw FileIOException(error);
+        bytes.push_back(static_cast<uint8_t>(hi << 4 | lo));
+    }
+    return bytes;
+}
+
+/// Splits a text file in its records, without line terminators and blank lines.
+vector<pair<const uint8_t *, const uint8_t *>> split_lines(const uint8_t *data, size_t len) {
+    vector<pair<const uint8_t *, const uint8_t *>> lines;
+    const uint8_t *end = data + len;
+    for (const uint8_t *begin = data; begin < end;) {
+        auto newline = static_cast<const uint8_t *>(memchr(begin, '\n', static_cast<size_t>(end - begin)));
+        const uint8_t *line_end = newline != nullptr ? newline : end;
+        const uint8_t *trimmed = line_end;
+        while (trimmed > begin && isspace(trimmed[-1])) trimmed--;
+        if (trimmed > begin) lines.emplace_back(begin, trimmed);
+        begin = line_end + 1;
+    }
+    return lines;
+}
+
+/// Stores a record, merging it with the segment it continues.
+void add_segment(map<uint64_t, vector<uint8_t>> &segments, uint64_t address, const uint8_t *data, size_t len) {
+    if (!len) return;
+    if (!segments.empty()) {
+        auto &last = *segments.rbegin();
+        if (last.first + last.second.size() == address) {
+            last.second.insert(last.second.end(), data, data + len);
+            return;
+        }
+    }
+    auto &segment = segments[address];
+    if (!segment.empty())
+        throw FileIOException("Overlapping records in the image file");
+    segment.assign(data, data + len);
+}
+
+}
+
+ImageLoader::image_format ImageLoader::detect(const uint8_t *data, std::size_t len) {
+    if (len >= 4 && data[0] == 0x7f && data[1] == 'E' && data[2] == 'L' && data[3] == 'F')
+        return ELF;
+    if (len >= 11 && data[0] == ':' && hex_digit(data[1]) >= 0 && hex_digit(data[2]) >= 0)
+        return IHEX;
+    if (len >= 10 && data[0] == 'S' && isdigit(data[1]) && hex_digit(data[2]) >= 0 && hex_digit(data[3]) >= 0)
+        return SREC;
+    return RAW;
+}
+
+ImageLoader::image_format ImageLoader::guess(const std::string &filename) {
+    string name = filename;
+    for (const char *suffix : {".gz", ".xz"}) {
+        size_t len = strlen(suffix);
+        if (name.size() > len && name.compare(name.size() - len, len, suffix) == 0) {
+            name.resize(name.size() - len);
+            break;
+        }
+    }
+    auto dot = name.find_last_of("./");
+    if (dot == string::npos || name[dot] != '.') return AUTO;
+    string extension = name.substr(dot + 1);
+    for (auto &c : extension) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    if (extension == "bin") return RAW;
+    if (extension == "elf" || extension == "axf" || extension == "out") return ELF;
+    if (extension == "hex" || extension == "ihex" || extension == "ihx") return IHEX;
+    if (extension == "srec" || extension == "s19" || extension == "s28" || extension == "s37" || extension == "mot")
+        return SREC;
+    return AUTO;
+}
+
+bool ImageLoader::parse_format(const std::string &name, image_format &format) {
+    static const pair<const char *, image_format> names[] = {
+            {"raw", RAW}, {"elf", ELF}, {"ihex", IHEX}, {"srec", SREC}, {"auto", AUTO}};
+    for (auto &entry : names) {
+        if (name != entry.first) continue;
+        format = entry.second;
+        return true;
+    }
+    return false;
+}
+
+const char *ImageLoader::format_name(image_format format) {
+    switch (format) {
+        case ELF:
+            return "ELF";
+        case IHEX:
+            return "Intel HEX";
+        case SREC:
+            return "SREC";
+        case AUTO:
+            return "unknown format";
+        case RAW:
+        default:
+            return "raw binary";
+    }
+}
+
+ImageLoader::segments_t ImageLoader::parse_elf(const uint8_t *data, std::size_t len) {
+    //the format may come from the extension or the user rather than from the contents
+    if (len < 16 || memcmp(data, "\x7f" "ELF", 4) != 0)
+        throw FileIOException("Not an ELF file");
+    bool is64 = data[4] == 2;
+    bool big_endian = data[5] == 2;
+    size_t word = is64 ? 8 : 4;
+    uint64_t phoff = read_uint(data, len, is64 ? 0x20 : 0x1c, word, big_endian);
+    uint64_t phentsize = read_uint(data, len, is64 ? 0x36 : 0x2a, 2, big_endian);
+    uint64_t phnum = read_uint(data, len, is64 ? 0x38 : 0x2c, 2, big_endian);
+    if (!phnum)
+        throw FileIOException("The ELF file has no program headers");
+    //the header values are checked against the file size without adding them up, so they cannot overflow
+    if (phentsize < (is64 ? 0x38u : 0x20u) || phoff > len || phnum * phentsize > len - phoff)
+        throw FileIOException("Truncated ELF program headers");
+
+    segments_t segments;
+    for (uint64_t i = 0; i < phnum; i++) {
+        size_t header = static_cast<size_t>(phoff + i * phentsize);
+        const uint32_t ptLoad = 1;
+        if (read_uint(data, len, header, 4, big_endian) != ptLoad) continue;
+        uint64_t offset, paddr, filesz;
+        if (is64) {
+            offset = read_uint(data, len, header + 0x08, 8, big_endian);
+            paddr = read_uint(data, len, header + 0x18, 8, big_endian);
+            filesz = read_uint(data, len, header + 0x20, 8, big_endian);
+        } else {
+            offset = read_uint(data, len, header + 0x04, 4, big_endian);
+            paddr = read_uint(data, len, header + 0x0c, 4, big_endian);
+            filesz = read_uint(data, len, header + 0x10, 4, big_endian);
+        }
+        //segments with no file contents (.bss) are not part of the flash image
+        if (!filesz) continue;
+        if (offset > len || filesz > len - offset)
+            throw FileIOException("Truncated ELF segment");
+        //initialized data is loaded at its physical address, to be copied to RAM at boot
+        add_segment(segments, paddr, data + offset, static_cast<size_t>(filesz));
+    }
+    return segments;
+}
+
+ImageLoader::segments_t ImageLoader::parse_ihex(const uint8_t *data, std::size_t len) {
+    const char *error = "Malformed Intel HEX record";
+    segments_t segments;
+    uint64_t base = 0;
+    for (auto &line : split_lines(data, len)) {
+        if (*line.first != ':')
+            throw FileIOException(error);
+        auto record = decode_hex(line.first + 1, line.second, error);
+        if (record.size() < 5 || record.size() != record[0] + 5u)
+            throw FileIOException(error);
+        uint8_t sum = 0;
+        for (auto byte : record) sum += byte;
+        if (sum)
+            throw FileIOException("Intel HEX checksum mismatch");
+        uint64_t address = static_cast<uint64_t>(record[1]) << 8 | record[2];
+        const uint8_t *payload = record.data() + 4;
+        switch (record[3]) {
+            case 0x00: //data
+                add_segment(segments, base + address, payload, record[0]);
+                break;
+            case 0x01: //end of file
+                return segments;
+            case 0x02: //extended segment address
+                if (record[0] != 2) throw FileIOException(error);
+                base = (static_cast<uint64_t>(payload[0]) << 8 | payload[1]) << 4;
+                break;
+            case 0x04: //extended linear address
+                if (record[0] != 2) throw FileIOException(error);
+                base = (static_cast<uint64_t>(payload[0]) << 8 | payload[1]) << 16;
+                break;
+            case 0x03: //start segment address
+            case 0x05: //start linear address
+                break;
+            default:
+                throw FileIOException(error);
+        }
+    }
+    return segments;
+}
+
+ImageLoader::segments_t ImageLoader::parse_srec(const uint8_t *data, std::size_t len) {
+    const char *error = "Malformed SREC record";
+    segments_t segments;
+    for (auto &line : split_lines(data, len)) {
+        if (line.second - line.first < 4 || line.first[0] != 'S')
+            throw FileIOException(error);
+        char type = line.first[1];
+        auto record = decode_hex(line.first + 2, line.second, error);
+        if (record.empty() || record.size() != record[0] + 1u)
+            throw FileIOException(error);
+        uint8_t sum = 0;
+        for (auto byte : record) sum += byte;
+        if (sum != 0xff)
+            throw FileIOException("SREC checksum mismatch");
+        size_t address_size;
+        switch (type) {
+            case '1':
+                address_size = 2;
+                break;
+            case '2':
+                address_size = 3;
+                break;
+            case '3':
+                address_size = 4;
+                break;
+            case '0': //header
+            case '5': //record count
+            case '6':
+                continue;
+            case '7': //termination
+            case '8':
+            case '9':
+                return segments;
+            default:
+                throw FileIOException(error);
+        }
+        if (record.size() < address_size + 2)
+            throw FileIOException(error);
+        uint64_t address = 0;
+        for (size_t i = 0; i < address_size; i++)
+            address = address << 8 | record[1 + i];
+        add_segment(segments, address, record.data() + 1 + address_size, record.size() - address_size - 2);
+    }
+    return segments;
+}
+
+std::vector<uint8_t> ImageLoader::flatten(const segments_t &segments) {
+    if (segments.empty())
+        throw FileIOException("The image file has no loadable contents");
+    uint64_t base = segments.begin()->first;
+    uint64_t end = base;
+    for (auto &segment : segments) {
+        if (segment.first < end)
+            throw FileIOException("Overlapping segments in the image file");
+        end = segment.first + segment.second.size();
+    }
+    if (end - base > maxImageSize)
+        throw FileIOException("The loadable contents of the image file span too much memory");
+    vector<uint8_t> image(static_cast<size_t>(end - base), 0xff);
+    for (auto &segment : segments)
+        copy(segment.second.begin(), segment.second.end(), image.begin() + (segment.first - base));
+    return image;
+}
+
+std::unique_ptr<ImageSource> ImageLoader::convert(image_format format, const uint8_t *data, std::size_t len,
+                                                  bool trim_erased) {
+    switch (format) {
+        case ELF:
+            return unique_ptr<ImageSource>(new MemoryImage(flatten(parse_elf(data, len)), trim_erased));
+        case IHEX:
+            return unique_ptr<ImageSource>(new MemoryImage(flatten(parse_ihex(data, len)), trim_erased));
+        case SREC:
+            return unique_ptr<ImageSource>(new MemoryImage(flatten(parse_srec(data, len)), trim_erased));
+        case RAW:
+        default:
+            return unique_ptr<ImageSource>(new MemoryImage(vector<uint8_t>(data, data + len), trim_erased));
+    }
+}
+
+std::unique_ptr<ImageSource> ImageLoader::load(const std::string &filename, bool trim_erased,
+                                               image_format *format, image_format requested) {
+    //a raw binary can start like a text format: the extension, if any, is trusted before the contents
+    if (requested == AUTO) requested = guess(filename);
+    int fd = filename == "-" ? STDIN_FILENO : open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw BinaryNotFoundException("Binary not found in the specified path");
+    struct stat stat_buffer{};
+    uint8_t magic[6];
+    if (fd != STDIN_FILENO && !fstat(fd, &stat_buffer) && S_ISREG(stat_buffer.st_mode)) {
+        ssize_t got = pread(fd, magic, sizeof(magic), 0);
+        if (StreamImage::detect_compression(magic, got > 0 ? static_cast<size_t>(got) : 0) == StreamImage::NONE) {
+            close(fd);
+            unique_ptr<MappedImage> file(new MappedImage(filename, trim_erased));
+            image_format detected = requested != AUTO ? requested : detect(file->data(), file->file_size());
+            if (format != nullptr) *format = detected;
+            //raw binaries are sent straight from the mapping
+            if (detected == RAW) return unique_ptr<ImageSource>(file.release());
+            return convert(detected, file->data(), file->file_size(), trim_erased);
+        }
+    }
+
+    unique_ptr<StreamImage> stream(new StreamImage(fd, fd != STDIN_FILENO));
+    const uint8_t *head = nullptr;
+    size_t len = stream->view(0, 16, head);
+    if (!len)
+        throw FileIOException("The image is empty");
+    image_format detected = requested != AUTO ? requested : detect(head, len);
+    if (format != nullptr) *format = detected;
+    if (detected == RAW) {
+        //raw binaries are sent while they are still being read
+        if (trim_erased) stream->trim_erased();
+        return unique_ptr<ImageSource>(stream.release());
+    }
+    auto bytes = stream->contents();
+    return convert(detected, bytes.data(), bytes.size(), trim_erased);
+}
+
+std::string ImageLoader::describe(const ImageSource &image, image_format format) {
+    string text = format_name(format);
+    auto stream = dynamic_cast<const StreamImage *>(&image);
+    if (stream != nullptr && stream->get_compression() != StreamImage::NONE)
+        text = string(StreamImage::compression_name(stream->get_compression())) + " compressed " + text;
+    if (image.size_known()) return text + ", " + to_string(image.size()) + " bytes";
+    return text + ", streaming";
+}
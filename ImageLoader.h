@@ -0,0 +1,118 @@
+#ifndef WANDSTEM_FLASH_UTILITY_IMAGELOADER_H
+#define WANDSTEM_FLASH_UTILITY_IMAGELOADER_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ImageSource.h"
+
+static const std::size_t maxImageSize=64*1024*1024;
+
+/**
+ * This class loads an image to be flashed from a raw binary, ELF, Intel HEX or SREC file.
+ * Non raw files are turned into the contiguous image spanning their loadable contents, with gaps filled with 0xFF.
+ */
+class ImageLoader {
+public:
+    ///The supported file formats.
+    enum image_format {
+        RAW, ELF, IHEX, SREC,
+        ///Not chosen yet: guessed from the extension of the file, else detected from its contents.
+        AUTO
+    };
+
+private:
+    ///The contents of a non raw file, by load address.
+    typedef std::map<uint64_t, std::vector<uint8_t>> segments_t;
+
+    /**
+     * Collects the loadable segments of an ELF file, placed at their physical (load) address.
+     * \throws FileIOException If the file is malformed.
+     * \return the segments.
+     */
+    static segments_t parse_elf(const uint8_t *data, std::size_t len);
+
+    /**
+     * Collects the data records of an Intel HEX file.
+     * \throws FileIOException If the file is malformed.
+     * \return the segments.
+     */
+    static segments_t parse_ihex(const uint8_t *data, std::size_t len);
+
+    /**
+     * Collects the data records of a Motorola SREC file.
+     * \throws FileIOException If the file is malformed.
+     * \return the segments.
+     */
+    static segments_t parse_srec(const uint8_t *data, std::size_t len);
+
+    /**
+     * Lays out the segments contiguously, starting from the lowest address.
+     * \throws FileIOException If the segments overlap or span too much memory.
+     * \return the image bytes.
+     */
+    static std::vector<uint8_t> flatten(const segments_t &segments);
+
+    /**
+     * Converts a file in a non raw format to the image it describes.
+     * \throws FileIOException If the file is malformed.
+     * \return the image.
+     */
+    static std::unique_ptr<ImageSource> convert(image_format format, const uint8_t *data, std::size_t len,
+                                                bool trim_erased);
+
+public:
+    ImageLoader() = delete;
+
+    /**
+     * Detects the format of a file from its contents.
+     * \param data the file bytes
+     * \param len the size of the file
+     * \return the format, RAW if none other matches.
+     */
+    static image_format detect(const uint8_t *data, std::size_t len);
+
+    /**
+     * Guesses the format of a file from its extension, ignoring a .gz or .xz suffix.
+     * \param filename the file path
+     * \return the format, AUTO if the extension does not tell.
+     */
+    static image_format guess(const std::string &filename);
+
+    /**
+     * Reads the name of a format given by the user: raw, elf, ihex, srec or auto.
+     * \param name the name
+     * \param format where the format is stored
+     * \return false if the name is unknown.
+     */
+    static bool parse_format(const std::string &name, image_format &format);
+
+    /**
+     * Returns the name of a format.
+     * \return the name.
+     */
+    static const char *format_name(image_format format);
+
+    /**
+     * Describes a loaded image, for the user.
+     * \return the format, the compression and the size if already known.
+     */
+    static std::string describe(const ImageSource &image, image_format format);
+
+    /**
+     * Loads an image file. Uncompressed regular files are mapped in memory; the standard input ("-"), pipes and gzip
+     * or xz compressed files are streamed, raw images being sent while they are still being read.
+     * \throws BinaryNotFoundException If the file does not exist.
+     * \throws FileIOException If the file could not be read or is malformed.
+     * \param filename the image file path, "-" for the standard input
+     * \param trim_erased if the trailing erased blocks are dropped
+     * \param format set to the format used, if not null
+     * \param requested the format of the file, AUTO for guessing it from the extension or else the contents
+     * \return the image.
+     */
+    static std::unique_ptr<ImageSource> load(const std::string &filename, bool trim_erased = true,
+                                             image_format *format = nullptr, image_format requested = AUTO);
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_IMAGELOADER_H
@@ -0,0 +1,304 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "ImageSource.h"
+#include "Exceptions.h"
+#include "XmodemPacket.h"
+#include "ImageLoader.h"
+#include "SerialPort.h"
+#include <iomanip>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <boost/uuid/detail/sha1.hpp>
+#include <boost/iostreams/filtering_streambuf.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filter/lzma.hpp>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+/// A Boost.Iostreams source forwarding to a function, so that the decompressors can read the raw stream.
+class forwarding_source {
+private:
+    function<streamsize(char *, streamsize)> forward;
+
+public:
+    typedef char char_type;
+    typedef boost::iostreams::source_tag category;
+
+    explicit forwarding_source(function<streamsize(char *, streamsize)> forward) : forward(move(forward)) {}
+
+    streamsize read(char *data, streamsize len) { return forward(data, len); }
+};
+
+}
+
+MappedImage::MappedImage(const std::string &filename, bool trim_erased) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw BinaryNotFoundException("Binary not found in the specified path");
+    struct stat stat_buffer{};
+    if (fstat(fd, &stat_buffer) || !S_ISREG(stat_buffer.st_mode)) {
+        close(fd);
+        throw FileIOException("The binary image is not a regular file");
+    }
+    length = static_cast<size_t>(stat_buffer.st_size);
+    if (!length) {
+        close(fd);
+        throw FileIOException("The image is empty");
+    }
+    void *addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        throw FileIOException("Cannot map the binary image in memory");
+    }
+    //the image is sent front to back, let the kernel read ahead
+    madvise(addr, length, MADV_SEQUENTIAL);
+    madvise(addr, length, MADV_WILLNEED);
+    mapping = static_cast<const uint8_t *>(addr);
+    mapped_length = length;
+    if (trim_erased) length = trimmed_size(mapping, length);
+    //the mapping stays valid after closing the descriptor
+    close(fd);
+}
+
+MappedImage::~MappedImage() {
+    if (mapping != nullptr) munmap(const_cast<uint8_t *>(mapping), mapped_length);
+}
+
+std::size_t MappedImage::view(std::size_t offset, std::size_t len, const uint8_t *&data) {
+    if (offset >= length) return 0;
+    data = mapping + offset;
+    return min(len, length - offset);
+}
+
+MemoryImage::MemoryImage(std::vector<uint8_t> bytes, bool trim_erased) : bytes(std::move(bytes)) {
+    if (this->bytes.empty())
+        throw FileIOException("The image is empty");
+    if (trim_erased) this->bytes.resize(trimmed_size(this->bytes.data(), this->bytes.size()));
+}
+
+std::size_t MemoryImage::view(std::size_t offset, std::size_t len, const uint8_t *&data) {
+    if (offset >= bytes.size()) return 0;
+    data = bytes.data() + offset;
+    return min(len, bytes.size() - offset);
+}
+
+std::size_t ImageSource::trimmed_size(const uint8_t *data, std::size_t len) {
+    size_t last = len;
+    while (last > 0 && data[last - 1] == 0xff) last--;
+    //whole blocks only: the block holding the last meaningful byte is sent padded as usual. An all erased image
+    //keeps its first block, so that at least one packet precedes the end of transmission
+    size_t blocks = max<size_t>(1, (last + xmodemDataSize - 1) / xmodemDataSize);
+    return min(len, blocks * xmodemDataSize);
+}
+
+const std::string &ImageSource::digest() {
+    call_once(digest_once, [this] {
+        boost::uuids::detail::sha1 sha1;
+        const uint8_t *data;
+        for (size_t offset = 0, len; (len = view(offset, 1 << 16, data)); offset += len)
+            sha1.process_bytes(data, len);
+        boost::uuids::detail::sha1::digest_type result;
+        sha1.get_digest(result);
+        ostringstream hex;
+        hex << std::hex << setfill('0');
+        for (auto word : result)
+            hex << setw(2 * sizeof(word)) << static_cast<unsigned long>(word);
+        digest_value = hex.str();
+    });
+    return digest_value;
+}
+
+StreamImage::StreamImage(int fd, bool owns_fd) : fd(fd), interrupt_fd(SerialPort::interrupt_descriptor()),
+                                                  owns_fd(owns_fd), stopping(false) {
+    //the magic number is read upfront, so that the compression is known before the image is handed out
+    uint8_t buffer[6];
+    size_t got = 0;
+    try {
+        for (size_t len = 1; got < sizeof(buffer) && len; got += len)
+            len = read_fd(buffer + got, sizeof(buffer) - got);
+    } catch (FileIOException &ex) {
+        if (owns_fd) close(fd);
+        if (interrupt_fd >= 0) close(interrupt_fd);
+        throw;
+    }
+    magic.assign(buffer, buffer + got);
+    compression = detect_compression(buffer, got);
+    reader = thread(&StreamImage::read_stream, this);
+}
+
+StreamImage::~StreamImage() {
+    stopping = true;
+    reader.join();
+    if (owns_fd) close(fd);
+    if (interrupt_fd >= 0) close(interrupt_fd);
+}
+
+void StreamImage::read_stream() {
+    try {
+        boost::iostreams::filtering_istreambuf in;
+        if (compression == GZIP) in.push(boost::iostreams::gzip_decompressor());
+        else if (compression == XZ) in.push(boost::iostreams::lzma_decompressor());
+        in.push(forwarding_source([this](char *data, streamsize len) { return read_raw(data, len); }));
+        vector<char> buffer(streamReadSize);
+        for (streamsize got; (got = in.sgetn(buffer.data(), static_cast<streamsize>(buffer.size()))) > 0;)
+            store(reinterpret_cast<const uint8_t *>(buffer.data()), static_cast<size_t>(got));
+    } catch (exception &ex) {
+        lock_guard<mutex> lock(mtx);
+        error = ex.what();
+    }
+    {
+        lock_guard<mutex> lock(mtx);
+        finished = true;
+    }
+    cv.notify_all();
+}
+
+std::streamsize StreamImage::read_raw(char *data, std::streamsize len) {
+    if (!magic.empty()) {
+        auto got = min(static_cast<size_t>(len), magic.size());
+        memcpy(data, magic.data(), got);
+        magic.erase(magic.begin(), magic.begin() + static_cast<ptrdiff_t>(got));
+        return static_cast<streamsize>(got);
+    }
+    size_t got = read_fd(data, static_cast<size_t>(len));
+    return got ? static_cast<streamsize>(got) : -1;
+}
+
+std::size_t StreamImage::read_fd(void *data, std::size_t len) {
+    for (;;) {
+        if (stopping || SerialPort::interrupted()) throw FileIOException("Interrupted while reading the binary image");
+        pollfd entries[2] = {{fd, POLLIN, 0}, {interrupt_fd, POLLIN, 0}};
+        int ready = poll(entries, interrupt_fd >= 0 ? 2 : 1, streamPollMsec);
+        if (ready < 0 && errno != EINTR) throw FileIOException("Cannot read the binary image");
+        //the interrupt is checked at the top of the loop
+        if (ready <= 0 || !entries[0].revents) continue;
+        ssize_t got = ::read(fd, data, len);
+        if (got < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (got < 0) throw FileIOException("Cannot read the binary image");
+        return static_cast<size_t>(got);
+    }
+}
+
+void StreamImage::store(const uint8_t *data, std::size_t len) {
+    if (received + len > maxImageSize)
+        throw FileIOException("The binary image is too large");
+    while (len) {
+        size_t index = received / streamChunkSize;
+        size_t pos = received % streamChunkSize;
+        if (index == chunks.size()) {
+            lock_guard<mutex> lock(mtx);
+            chunks.emplace_back(new uint8_t[streamChunkSize + xmodem1kDataSize]);
+        }
+        size_t count = min(len, streamChunkSize - pos);
+        memcpy(chunks[index].get() + pos, data, count);
+        //the head of a chunk is repeated at the end of the previous one
+        if (index > 0 && pos < xmodem1kDataSize)
+            memcpy(chunks[index - 1].get() + streamChunkSize + pos, data, min(count, xmodem1kDataSize - pos));
+        size_t last = count;
+        while (last > 0 && data[last - 1] == 0xff) last--;
+        {
+            lock_guard<mutex> lock(mtx);
+            if (last) content_end = received + last;
+            received += count;
+        }
+        cv.notify_all();
+        data += count;
+        len -= count;
+    }
+}
+
+std::size_t StreamImage::ready_bytes() const {
+    if (!trim) return received;
+    //a block is part of the image as soon as something not erased follows it, the same rounding as trimmed_size
+    size_t blocks = max<size_t>(1, (content_end + xmodemDataSize - 1) / xmodemDataSize);
+    return min(received, blocks * xmodemDataSize);
+}
+
+void StreamImage::wait_end(std::unique_lock<std::mutex> &lock) const {
+    cv.wait(lock, [this] { return finished; });
+    if (!error.empty()) throw FileIOException(error);
+}
+
+void StreamImage::trim_erased() {
+    lock_guard<mutex> lock(mtx);
+    trim = true;
+}
+
+std::size_t StreamImage::view(std::size_t offset, std::size_t len, const uint8_t *&data) {
+    size_t index = offset / streamChunkSize;
+    size_t pos = offset % streamChunkSize;
+    //a block can extend into the repeated head of the following chunk, not further
+    len = min(len, streamChunkSize + xmodem1kDataSize - pos);
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [&] { return finished || ready_bytes() >= offset + len; });
+    if (!error.empty()) throw FileIOException(error);
+    size_t ready = ready_bytes();
+    if (offset >= ready) return 0;
+    data = chunks[index].get() + pos;
+    return min(len, ready - offset);
+}
+
+std::size_t StreamImage::size() const {
+    unique_lock<mutex> lock(mtx);
+    wait_end(lock);
+    return ready_bytes();
+}
+
+bool StreamImage::size_known() const {
+    lock_guard<mutex> lock(mtx);
+    return finished;
+}
+
+std::vector<uint8_t> StreamImage::contents() {
+    unique_lock<mutex> lock(mtx);
+    wait_end(lock);
+    vector<uint8_t> bytes;
+    bytes.reserve(ready_bytes());
+    for (size_t index = 0; bytes.size() < ready_bytes(); index++) {
+        auto count = min(streamChunkSize, ready_bytes() - bytes.size());
+        bytes.insert(bytes.end(), chunks[index].get(), chunks[index].get() + count);
+    }
+    return bytes;
+}
+
+StreamImage::compression_t StreamImage::detect_compression(const uint8_t *data, std::size_t len) {
+    if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+        return GZIP;
+    if (len >= 6 && memcmp(data, "\xfd" "7zXZ\0", 6) == 0)
+        return XZ;
+    return NONE;
+}
+
+const char *StreamImage::compression_name(compression_t compression) {
+    switch (compression) {
+        case GZIP:
+            return "gzip";
+        case XZ:
+            return "xz";
+        case NONE:
+        default:
+            return "uncompressed";
+    }
+}
@@ -0,0 +1,293 @@
+#ifndef WANDSTEM_FLASH_UTILITY_IMAGESOURCE_H
+#define WANDSTEM_FLASH_UTILITY_IMAGESOURCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ios>
+#include <string>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+
+static const std::size_t streamChunkSize=256*1024;
+static const std::size_t streamReadSize=16*1024;
+static const int streamPollMsec=100;
+
+/**
+ * This class models the binary image to be flashed, giving access to its bytes without copying them.
+ */
+class ImageSource {
+private:
+    /// Guards the computation of the digest.
+    std::once_flag digest_once;
+
+    /// The digest, computed on first use.
+    std::string digest_value;
+
+public:
+    virtual ~ImageSource() = default;
+
+    /**
+     * Gives access to a block of the image.
+     * \param offset the position of the block in the image
+     * \param len the maximum number of bytes wanted
+     * \param data set to point to the bytes, which stay valid as long as the source lives
+     * \return the number of bytes available at offset: less than len only at the end of the image, or for blocks
+     * longer than a 1K packet where a StreamImage is split in memory, 0 past it.
+     */
+    virtual std::size_t view(std::size_t offset, std::size_t len, const uint8_t *&data) = 0;
+
+    /**
+     * Returns the size of the image.
+     * \return the number of bytes of the image.
+     */
+    virtual std::size_t size() const = 0;
+
+    /**
+     * Checks if the size of the image is known without waiting, which is not the case while a stream is being read.
+     * \return if size returns immediately.
+     */
+    virtual bool size_known() const { return true; }
+
+    /**
+     * Returns the SHA-1 digest of the image, identifying its content. It is computed once, on first use.
+     * \return the digest as an hexadecimal string.
+     */
+    const std::string &digest();
+
+    /**
+     * Computes the size of an image without its trailing 128 bytes blocks left erased (all 0xFF), which need not
+     * be sent since the bootloader pads with 0xFF anyway.
+     * \param data the image bytes
+     * \param len the size of the image
+     * \return the size of the meaningful part of the image, at least one block.
+     */
+    static std::size_t trimmed_size(const uint8_t *data, std::size_t len);
+};
+
+/**
+ * This class models a binary image file mapped in memory, so that its bytes are read straight from the page cache.
+ */
+class MappedImage : public ImageSource {
+private:
+    /// The mapped bytes.
+    const uint8_t *mapping = nullptr;
+
+    /// The size of the mapping.
+    std::size_t mapped_length = 0;
+
+    /// The size of the image, which can be shorter than the mapping if trimmed.
+    std::size_t length = 0;
+
+public:
+    /**
+     * Constructor. Maps the file in memory.
+     * \throws BinaryNotFoundException If the file does not exist.
+     * \throws FileIOException If the file could not be mapped or is empty.
+     * \param filename The binary image file path.
+     * \param trim_erased If the trailing erased blocks are dropped.
+     * \return
+     */
+    explicit MappedImage(const std::string &filename, bool trim_erased = false);
+
+    MappedImage(MappedImage const &) = delete;
+
+    void operator=(MappedImage const &) = delete;
+
+    ~MappedImage() override;
+
+    std::size_t view(std::size_t offset, std::size_t len, const uint8_t *&data) override;
+
+    std::size_t size() const override { return length; }
+
+    /**
+     * Gives access to the whole mapped file, regardless of trimming.
+     * \return the mapped bytes.
+     */
+    const uint8_t *data() const { return mapping; }
+
+    /**
+     * Returns the size of the whole mapped file.
+     * \return the number of bytes of the file.
+     */
+    std::size_t file_size() const { return mapped_length; }
+};
+
+/**
+ * This class models an image built in memory, for instance from the loadable segments of an ELF file.
+ */
+class MemoryImage : public ImageSource {
+private:
+    /// The image bytes.
+    std::vector<uint8_t> bytes;
+
+public:
+    /**
+     * Constructor.
+     * \throws FileIOException If the image is empty.
+     * \param bytes The image bytes.
+     * \param trim_erased If the trailing erased blocks are dropped.
+     * \return
+     */
+    explicit MemoryImage(std::vector<uint8_t> bytes, bool trim_erased = false);
+
+    std::size_t view(std::size_t offset, std::size_t len, const uint8_t *&data) override;
+
+    std::size_t size() const override { return bytes.size(); }
+};
+
+/**
+ * This class models an image read from a stream, such as a pipe or a compressed file, by a background thread.
+ * gzip and xz streams are recognized by their magic number and decompressed on the fly. The bytes are kept in memory,
+ * so the image can be sent any number of times, and view waits only when the reader gets ahead of the stream: the
+ * transfer starts with the first bytes instead of after the whole stream has been stored somewhere.
+ */
+class StreamImage : public ImageSource {
+public:
+    ///The compressions recognized in a stream.
+    enum compression_t {
+        NONE, GZIP, XZ
+    };
+
+private:
+    /// The descriptor the stream is read from.
+    int fd;
+
+    /// Becomes readable when the program is interrupted, -1 if not available.
+    int interrupt_fd;
+
+    /// If the descriptor is closed with the image.
+    bool owns_fd;
+
+    compression_t compression = NONE;
+
+    /// The first bytes of the stream, read for recognizing the compression.
+    std::vector<uint8_t> magic;
+
+    /// The stream in streamChunkSize blocks. Every chunk repeats the first xmodem1kDataSize bytes of the following one
+    /// at its end, so that a packet is always contiguous.
+    std::vector<std::unique_ptr<uint8_t[]>> chunks;
+
+    /// The number of bytes read so far.
+    std::size_t received = 0;
+
+    /// The position past the last byte that is not erased (0xFF), for trimming the image while it is being read.
+    std::size_t content_end = 0;
+
+    /// If the trailing erased blocks are not part of the image.
+    bool trim = false;
+
+    /// If the whole stream has been read.
+    bool finished = false;
+
+    /// The reason the stream could not be read, empty if none.
+    std::string error;
+
+    mutable std::mutex mtx;
+
+    mutable std::condition_variable cv;
+
+    /// Tells the reader to give up, when the image is destroyed before the end of the stream.
+    std::atomic<bool> stopping;
+
+    std::thread reader;
+
+    /**
+     * Reads and decompresses the stream, until its end or a failure.
+     * \return
+     */
+    void read_stream();
+
+    /**
+     * Reads some bytes of the raw stream, polling so that stopping is noticed.
+     * \return the number of bytes read, -1 at the end of the stream.
+     * \throws FileIOException If the stream could not be read.
+     */
+    std::streamsize read_raw(char *data, std::streamsize len);
+
+    /**
+     * Reads some bytes from the descriptor, waiting for them as long as the image is not destroyed and the program is
+     * not interrupted by SerialPort::interrupt_all: a stalled pipe must not keep the threads waiting for the image.
+     * \return the number of bytes read, 0 at the end of the stream.
+     * \throws FileIOException If the stream could not be read, or the wait was given up.
+     */
+    std::size_t read_fd(void *data, std::size_t len);
+
+    /**
+     * Stores a block of the stream.
+     * \return
+     */
+    void store(const uint8_t *data, std::size_t len);
+
+    /**
+     * Computes how many bytes can be handed out, must be called with the lock held.
+     * \return the bytes that are surely part of the image.
+     */
+    std::size_t ready_bytes() const;
+
+    /**
+     * Waits for the stream to end, with the lock held.
+     * \throws FileIOException If the stream could not be read.
+     * \return
+     */
+    void wait_end(std::unique_lock<std::mutex> &lock) const;
+
+public:
+    /**
+     * Constructor. Starts reading the stream, recognizing its compression.
+     * \throws FileIOException If the stream could not be read.
+     * \param fd the descriptor of the stream
+     * \param owns_fd if the descriptor is closed with the image
+     * \return
+     */
+    StreamImage(int fd, bool owns_fd);
+
+    StreamImage(StreamImage const &) = delete;
+
+    void operator=(StreamImage const &) = delete;
+
+    ~StreamImage() override;
+
+    /**
+     * Drops the trailing erased (0xFF) blocks from the image, as MappedImage does. It must be called before the image
+     * is handed to its readers.
+     * \return
+     */
+    void trim_erased();
+
+    /**
+     * Gives access to a block of the image, waiting for the stream to reach it.
+     * \throws FileIOException If the stream could not be read.
+     */
+    std::size_t view(std::size_t offset, std::size_t len, const uint8_t *&data) override;
+
+    /**
+     * Returns the size of the image, waiting for the end of the stream.
+     * \throws FileIOException If the stream could not be read.
+     */
+    std::size_t size() const override;
+
+    bool size_known() const override;
+
+    /**
+     * Waits for the end of the stream and copies it, for the formats that can only be parsed as a whole.
+     * \throws FileIOException If the stream could not be read.
+     * \return the bytes of the stream.
+     */
+    std::vector<uint8_t> contents();
+
+    compression_t get_compression() const { return compression; }
+
+    /**
+     * Recognizes a compressed stream from its first bytes.
+     * \return the compression, NONE if not recognized.
+     */
+    static compression_t detect_compression(const uint8_t *data, std::size_t len);
+
+    static const char *compression_name(compression_t compression);
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_IMAGESOURCE_H
@@ -0,0 +1,244 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "Monitor.h"
+#include "Exceptions.h"
+#include "FlashStats.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <exception>
+#include <fcntl.h>
+
+using namespace std;
+namespace asio = boost::asio;
+
+namespace {
+
+void write_all(int fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t written = ::write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw FileIOException(string("Cannot write the device output: ") + strerror(errno));
+        }
+        data += written;
+        len -= static_cast<size_t>(written);
+    }
+}
+
+string port_name(const string &path) {
+    auto slash = path.find_last_of('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+}
+
+Monitor::Monitor(const std::vector<std::string> &paths, const std::vector<unsigned int> &bauds, int out_fd)
+        : out_fd(out_fd), flush_timer(io), interrupt_watch(io) {
+    size_t width = 0;
+    for (auto &path : paths)
+        width = max(width, port_name(path).size());
+    //the failure of the first port not opened, raised only if none was
+    exception_ptr failure;
+    for (size_t i = 0; i < paths.size(); i++) {
+        unique_ptr<board_t> board(new board_t);
+        board->counters.path = paths[i];
+        string name = port_name(paths[i]);
+        board->prefix = "[" + name + "] " + string(width - name.size(), ' ');
+        board->port.reset(new SerialPort(io));
+        try {
+            board->port->open(paths[i], bauds[i]);
+            board->chunk.resize(serialReadChunk);
+            board->counters.open = true;
+            open_boards++;
+        } catch (ios_base::failure &ex) {
+            //a board unplugged or busy must not stop the monitoring of the others
+            if (!failure) failure = current_exception();
+            board->counters.error = ex.what();
+            string notice = "*** cannot open the port: " + board->counters.error;
+            add_line(*board, notice.data(), notice.size());
+            board->counters.lines--;
+        }
+        boards.push_back(move(board));
+    }
+    if (!open_boards && failure) rethrow_exception(failure);
+    int fd = SerialPort::interrupt_descriptor();
+    if (fd >= 0) interrupt_watch.assign(fd);
+}
+
+Monitor::~Monitor() {
+    for (auto &board : boards)
+        if (board->fd >= 0) ::close(board->fd);
+}
+
+void Monitor::split(const std::string &directory) {
+    for (auto &board : boards) {
+        string path = directory + "/" + port_name(board->counters.path) + ".log";
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw FileIOException("Cannot open " + path + ": " + strerror(errno));
+        if (board->fd >= 0) ::close(board->fd);
+        board->fd = fd;
+    }
+}
+
+void Monitor::start_read(board_t &board) {
+    board_t *target = &board;
+    board.port->async_read_some(board.chunk.data(), board.chunk.size(),
+                                [this, target](const boost::system::error_code &ec, size_t len) {
+                                    on_read(*target, ec, len);
+                                });
+}
+
+void Monitor::add_line(board_t &board, const char *data, std::size_t len) {
+    if (len && data[len - 1] == '\r') len--;
+    string &sink = board.fd >= 0 ? board.pending : out;
+    size_t before = sink.size();
+    if (board.fd < 0) sink += board.prefix;
+    sink.append(data, len);
+    sink += '\n';
+    buffered += sink.size() - before;
+    board.counters.lines++;
+}
+
+void Monitor::on_read(board_t &board, const boost::system::error_code &ec, std::size_t len) {
+    if (ec) {
+        //cancelled when stopping, otherwise the port failed, e.g. the adapter was unplugged
+        close_board(board, ec == asio::error::operation_aborted ? "" : ec.message());
+        return;
+    }
+    board.counters.bytes += len;
+    const char *data = board.chunk.data();
+    while (len) {
+        auto end = static_cast<const char *>(memchr(data, '\n', len));
+        size_t take = end != nullptr ? static_cast<size_t>(end - data) : len;
+        if (end != nullptr && board.line.empty() && take <= monitorMaxLine) {
+            //the common case: a whole line in the chunk, no copy
+            add_line(board, data, take);
+            data += take + 1;
+            len -= take + 1;
+            continue;
+        }
+        //an endless line is written in pieces
+        take = min(take, monitorMaxLine - board.line.size());
+        board.line.append(data, take);
+        data += take;
+        len -= take;
+        bool complete = len && *data == '\n';
+        if (complete) {
+            data++;
+            len--;
+        }
+        if (complete || board.line.size() == monitorMaxLine) {
+            add_line(board, board.line.data(), board.line.size());
+            board.line.clear();
+        }
+    }
+    start_read(board);
+
+    if (buffered >= monitorFlushBytes) {
+        flush();
+    } else if (buffered && !flush_armed) {
+        flush_armed = true;
+        flush_timer.expires_after(chrono::milliseconds(monitorFlushMsec));
+        flush_timer.async_wait([this](const boost::system::error_code &ec) {
+            flush_armed = false;
+            if (!ec) flush();
+        });
+    }
+}
+
+void Monitor::flush() {
+    if (!out.empty()) {
+        write_all(out_fd, out.data(), out.size());
+        out.clear();
+    }
+    for (auto &board : boards) {
+        if (board->pending.empty()) continue;
+        write_all(board->fd, board->pending.data(), board->pending.size());
+        board->pending.clear();
+    }
+    buffered = 0;
+}
+
+void Monitor::close_board(board_t &board, const std::string &error) {
+    if (!board.counters.open) return;
+    board.counters.open = false;
+    board.counters.error = error;
+    board.port->close();
+    if (!board.line.empty()) {
+        add_line(board, board.line.data(), board.line.size());
+        board.line.clear();
+    }
+    if (!error.empty()) {
+        string notice = "*** port closed: " + error;
+        add_line(board, notice.data(), notice.size());
+        board.counters.lines--;
+    }
+    if (--open_boards == 0) {
+        //nothing left to wait for
+        flush_timer.cancel();
+        interrupt_watch.close();
+    }
+}
+
+void Monitor::run() {
+    //the ports that could not be opened are told right away
+    flush();
+    for (auto &board : boards)
+        if (board->counters.open) start_read(*board);
+    if (interrupt_watch.is_open()) {
+        interrupt_watch.async_wait(asio::posix::stream_descriptor::wait_read, [this](const boost::system::error_code &ec) {
+            if (ec) return;
+            for (auto &board : boards)
+                if (board->counters.open) board->port->cancel();
+        });
+    }
+    try {
+        io.run();
+    } catch (FileIOException &ex) {
+        //stop reading, the output is lost anyway
+        for (auto &board : boards)
+            if (board->counters.open) board->port->close();
+        throw;
+    }
+    flush();
+}
+
+std::vector<Monitor::counters_t> Monitor::get_counters() const {
+    vector<counters_t> result;
+    for (auto &board : boards)
+        result.push_back(board->counters);
+    return result;
+}
+
+void Monitor::print_counters(std::ostream &out, bool json) const {
+    for (auto &board : boards) {
+        auto &counters = board->counters;
+        if (json) {
+            out << "{\"path\":";
+            write_json_string(out, counters.path);
+            out << ",\"bytes\":" << counters.bytes << ",\"lines\":" << counters.lines << ",\"error\":";
+            write_json_string(out, counters.error);
+            out << "}" << endl;
+        } else {
+            out << board->prefix << counters.bytes << " bytes, " << counters.lines << " lines";
+            if (!counters.error.empty()) out << ", closed: " << counters.error;
+            out << endl;
+        }
+    }
+}
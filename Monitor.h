@@ -0,0 +1,160 @@
+#ifndef WANDSTEM_FLASH_UTILITY_MONITOR_H
+#define WANDSTEM_FLASH_UTILITY_MONITOR_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <ostream>
+#include <cstdint>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include "SerialPort.h"
+
+static const std::size_t monitorMaxLine=4096;
+static const std::size_t monitorFlushBytes=64*1024;
+static const int monitorFlushMsec=50;
+
+/**
+ * This class copies the output of many boards at once, waiting on all their ports from a single event loop.
+ * Only complete lines are written out, so the lines of different boards never mix: on the terminal every line is
+ * prefixed with the name of its board, or every board gets its own file. The lines received during a loop are
+ * gathered and written with a single write, once monitorFlushBytes piled up or the oldest one waited
+ * monitorFlushMsec, so the cost of a board is the bytes it sends rather than a thread or a process.
+ */
+class Monitor {
+public:
+    ///The activity of a board.
+    struct counters_t {
+        std::string path;
+        uint64_t bytes = 0;
+        uint64_t lines = 0;
+        ///If the port is still being read.
+        bool open = false;
+        ///Why the port was closed, if it failed.
+        std::string error;
+    };
+
+private:
+    ///A board being monitored.
+    struct board_t {
+        counters_t counters;
+
+        ///What precedes every line on the terminal.
+        std::string prefix;
+
+        std::unique_ptr<SerialPort> port;
+
+        ///Where the bytes are received.
+        std::vector<char> chunk;
+
+        ///The line being received.
+        std::string line;
+
+        ///The file of the board, -1 if the lines go to the terminal.
+        int fd = -1;
+
+        ///The lines for the file of the board, not written yet.
+        std::string pending;
+    };
+
+    boost::asio::io_context io;
+
+    std::vector<std::unique_ptr<board_t>> boards;
+
+    int out_fd;
+
+    ///The prefixed lines for the terminal, not written yet.
+    std::string out;
+
+    ///The bytes not written yet, for out and every pending.
+    std::size_t buffered = 0;
+
+    boost::asio::steady_timer flush_timer;
+
+    bool flush_armed = false;
+
+    ///Becomes readable when the program is interrupted.
+    boost::asio::posix::stream_descriptor interrupt_watch;
+
+    std::size_t open_boards = 0;
+
+    /**
+     * Starts reading a board.
+     * \return
+     */
+    void start_read(board_t &board);
+
+    /**
+     * Handles the bytes received from a board.
+     * \return
+     */
+    void on_read(board_t &board, const boost::system::error_code &ec, std::size_t len);
+
+    /**
+     * Queues a complete line of a board.
+     * \return
+     */
+    void add_line(board_t &board, const char *data, std::size_t len);
+
+    /**
+     * Writes the queued lines.
+     * \throws FileIOException If a write failed.
+     * \return
+     */
+    void flush();
+
+    /**
+     * Stops reading a board.
+     * \param error why, empty if the monitor is stopping
+     * \return
+     */
+    void close_board(board_t &board, const std::string &error);
+
+public:
+    /**
+     * Constructor. Opens every port; the ones that cannot be opened are reported in the output and in their counters,
+     * and skipped.
+     * \throws std::ios_base::failure If no port could be opened.
+     * \param paths the paths of the ports
+     * \param bauds the baud rate of every port
+     * \param out_fd the file descriptor the prefixed lines are written to
+     */
+    Monitor(const std::vector<std::string> &paths, const std::vector<unsigned int> &bauds,
+            int out_fd = STDOUT_FILENO);
+
+    Monitor(Monitor const &) = delete;
+
+    void operator=(Monitor const &) = delete;
+
+    ~Monitor();
+
+    /**
+     * Writes the lines of every board to its own file in a directory, named after the port and appended to.
+     * \throws FileIOException If a file could not be opened.
+     * \param directory the directory, which must exist
+     * \return
+     */
+    void split(const std::string &directory);
+
+    /**
+     * Copies the output of the boards until the program is interrupted or every port is closed.
+     * \throws FileIOException If the output could not be written.
+     * \return
+     */
+    void run();
+
+    /**
+     * Gets the activity of every board.
+     * \return the counters, in the order of the paths.
+     */
+    std::vector<counters_t> get_counters() const;
+
+    /**
+     * Prints the activity of every board.
+     * \param json if every board is printed as a JSON object on its own line, rather than as a table
+     * \return
+     */
+    void print_counters(std::ostream &out, bool json) const;
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_MONITOR_H
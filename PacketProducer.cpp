@@ -0,0 +1,83 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "PacketProducer.h"
+#include <chrono>
+
+using namespace std;
+
+PacketProducer::PacketProducer(ImageSource &image, bool allow_1k) : image(image), allow_1k(allow_1k),
+                                                                    ring(producerQueueLength), finished(false),
+                                                                    stopping(false), work_ns(0) {
+    worker = thread(&PacketProducer::produce, this);
+}
+
+PacketProducer::~PacketProducer() {
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+    }
+    space_cv.notify_one();
+    worker.join();
+}
+
+void PacketProducer::produce() {
+    try {
+        XmodemPacket pkt;
+        for (size_t offset = 0; !stopping;) {
+            auto start = chrono::steady_clock::now();
+            if (!pkt.read_from_image(image, offset, allow_1k)) break;
+            pkt.compute_crc();
+            offset += pkt.get_data_size();
+            XmodemPacket next = pkt.next();
+            work_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+            while (!ring.try_push(pkt)) {
+                unique_lock<mutex> lock(mtx);
+                space_cv.wait(lock, [this] { return stopping || !ring.full(); });
+                if (stopping) return;
+            }
+            {
+                lock_guard<mutex> lock(mtx);
+            }
+            ready_cv.notify_one();
+            pkt = std::move(next);
+        }
+    } catch (...) {
+        error = current_exception();
+    }
+    {
+        lock_guard<mutex> lock(mtx);
+        finished = true;
+    }
+    ready_cv.notify_one();
+}
+
+bool PacketProducer::pop(XmodemPacket &pkt) {
+    while (!ring.try_pop(pkt)) {
+        unique_lock<mutex> lock(mtx);
+        ready_cv.wait(lock, [this] { return finished || !ring.empty(); });
+        if (ring.empty()) {
+            //the producer pushes everything before finishing, so nothing can be left behind
+            if (error) rethrow_exception(error);
+            return false;
+        }
+    }
+    {
+        lock_guard<mutex> lock(mtx);
+    }
+    space_cv.notify_one();
+    return true;
+}
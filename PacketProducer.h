@@ -0,0 +1,92 @@
+#ifndef WANDSTEM_FLASH_UTILITY_PACKETPRODUCER_H
+#define WANDSTEM_FLASH_UTILITY_PACKETPRODUCER_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <atomic>
+#include "SpscRing.h"
+#include "XmodemPacket.h"
+
+static const int producerQueueLength=16;
+
+/**
+ * This class prepares the packets of an image (payload, block number and CRC) in a background thread, so that
+ * the sender finds them ready while it waits for the replies of the device.
+ */
+class PacketProducer {
+private:
+    /// The image to be sent.
+    ImageSource &image;
+
+    /// If 1024 bytes packets can be used.
+    bool allow_1k;
+
+    /// The packets ready to be sent.
+    SpscRing<XmodemPacket> ring;
+
+    /// Protects the waits for the ring, which itself is lock-free.
+    std::mutex mtx;
+
+    /// Signalled when a packet is pushed or the image ends.
+    std::condition_variable ready_cv;
+
+    /// Signalled when a packet is popped or the producer must stop.
+    std::condition_variable space_cv;
+
+    /// If the whole image was produced.
+    std::atomic<bool> finished;
+
+    /// If the producer must stop.
+    std::atomic<bool> stopping;
+
+    /// The error occurred while preparing the packets, if any.
+    std::exception_ptr error;
+
+    /// The nanoseconds spent preparing packets.
+    std::atomic<long long> work_ns;
+
+    /// The background thread.
+    std::thread worker;
+
+    /**
+     * The body of the background thread.
+     * \return
+     */
+    void produce();
+
+public:
+    /**
+     * Constructor. Starts producing the packets from the first one.
+     * \param image the image to be sent
+     * \param allow_1k if 1024 bytes packets can be used
+     * \return
+     */
+    PacketProducer(ImageSource &image, bool allow_1k);
+
+    PacketProducer(PacketProducer const &) = delete;
+
+    void operator=(PacketProducer const &) = delete;
+
+    /**
+     * Destructor. Stops the background thread.
+     */
+    ~PacketProducer();
+
+    /**
+     * Gets the next packet, waiting for it if not ready yet.
+     * \throws FileIOException If the image could not be read.
+     * \param pkt where the packet is stored
+     * \return false if the image ended.
+     */
+    bool pop(XmodemPacket &pkt);
+
+    /**
+     * Returns the time spent preparing packets in the background thread.
+     * \return the time in seconds.
+     */
+    double get_work_seconds() const { return work_ns.load() / 1e9; }
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_PACKETPRODUCER_H
@@ -0,0 +1,92 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "PatternMatcher.h"
+#include <deque>
+
+using namespace std;
+
+std::size_t PatternMatcher::add(const std::string &pattern) {
+    patterns.push_back(pattern);
+    return patterns.size() - 1;
+}
+
+void PatternMatcher::build() {
+    //class 0 gathers the bytes no pattern contains
+    classes.fill(0);
+    class_count = 1;
+    for (auto &pattern : patterns)
+        for (unsigned char c : pattern)
+            if (!classes[c]) classes[c] = class_count++;
+
+    //the trie of the patterns, state 0 being the root; a missing child is 0, which the root cannot be
+    vector<vector<uint32_t>> children(1, vector<uint32_t>(class_count, 0));
+    vector<vector<uint32_t>> ends(1);
+    for (size_t id = 0; id < patterns.size(); id++) {
+        uint32_t node = 0;
+        for (unsigned char c : patterns[id]) {
+            uint32_t &child = children[node][classes[c]];
+            if (!child) {
+                child = static_cast<uint32_t>(children.size());
+                children.emplace_back(class_count, 0);
+                ends.emplace_back();
+            }
+            node = children[node][classes[c]];
+        }
+        ends[node].push_back(static_cast<uint32_t>(id));
+    }
+
+    //breadth first, so that the failure of a state is complete before its children need it
+    size_t states = children.size();
+    vector<uint32_t> failure(states, 0);
+    vector<uint32_t> delta(states * class_count, 0);
+    deque<uint32_t> queue;
+    for (uint32_t c = 0; c < class_count; c++) {
+        uint32_t child = children[0][c];
+        delta[c] = child;
+        if (child) queue.push_back(child);
+    }
+    while (!queue.empty()) {
+        uint32_t node = queue.front();
+        queue.pop_front();
+        //a state also ends the patterns its failure ends
+        ends[node].insert(ends[node].end(), ends[failure[node]].begin(), ends[failure[node]].end());
+        for (uint32_t c = 0; c < class_count; c++) {
+            uint32_t child = children[node][c];
+            uint32_t fallback = delta[failure[node] * class_count + c];
+            if (!child) {
+                delta[node * class_count + c] = fallback;
+                continue;
+            }
+            failure[child] = fallback;
+            delta[node * class_count + c] = child;
+            queue.push_back(child);
+        }
+    }
+
+    output_start.assign(1, 0);
+    outputs.clear();
+    for (auto &patterns_ended : ends) {
+        outputs.insert(outputs.end(), patterns_ended.begin(), patterns_ended.end());
+        output_start.push_back(static_cast<uint32_t>(outputs.size()));
+    }
+    transitions.resize(delta.size());
+    for (size_t i = 0; i < delta.size(); i++) {
+        uint32_t target = delta[i];
+        transitions[i] = target * class_count | (ends[target].empty() ? 0 : outputFlag);
+    }
+    state = 0;
+    built = true;
+}
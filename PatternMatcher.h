@@ -0,0 +1,98 @@
+#ifndef WANDSTEM_FLASH_UTILITY_PATTERNMATCHER_H
+#define WANDSTEM_FLASH_UTILITY_PATTERNMATCHER_H
+
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * This class finds any number of literal patterns in a stream of bytes at once, with an Aho-Corasick automaton
+ * compiled into a table: every byte costs a lookup, however many the patterns are, and a match spanning two chunks of
+ * the stream is found as well.
+ * The bytes are first mapped to classes, the bytes no pattern contains sharing a single one, which keeps the table
+ * small enough for the cache even with dozens of patterns.
+ */
+class PatternMatcher {
+private:
+    ///The bit of a transition telling that its target state ends some patterns.
+    static const uint32_t outputFlag = 0x80000000u;
+
+    std::vector<std::string> patterns;
+
+    ///The class of every byte.
+    std::array<uint32_t, 256> classes{};
+
+    uint32_t class_count = 1;
+
+    ///The transitions: the row of a state is at the offset held by the state, the target is the offset of its row,
+    ///with outputFlag set if it ends some patterns.
+    std::vector<uint32_t> transitions;
+
+    ///The patterns ended by every state, as ranges of outputs.
+    std::vector<uint32_t> output_start;
+    std::vector<uint32_t> outputs;
+
+    ///The offset of the row of the current state.
+    uint32_t state = 0;
+
+    bool built = false;
+
+public:
+    /**
+     * Adds a pattern. It cannot be done after build.
+     * \param pattern the bytes to be found, not empty
+     * \return the id of the pattern, its position among the ones added.
+     */
+    std::size_t add(const std::string &pattern);
+
+    /**
+     * Compiles the automaton, after every pattern was added.
+     * \return
+     */
+    void build();
+
+    /**
+     * Gets the patterns added.
+     * \return the patterns, by id.
+     */
+    const std::vector<std::string> &get_patterns() const { return patterns; }
+
+    /**
+     * Forgets the bytes scanned so far, so that a match cannot span them and the following ones.
+     * \return
+     */
+    void reset() { state = 0; }
+
+    /**
+     * Scans the next bytes of the stream.
+     * \param data the bytes
+     * \param len the number of bytes
+     * \param on_match called as on_match(id, end) for every pattern ending at the offset end of data, the offset
+     * of its last byte plus one; returns false to stop scanning
+     * \return the bytes scanned, len unless on_match stopped the scan.
+     */
+    template<typename Callback>
+    std::size_t scan(const char *data, std::size_t len, Callback on_match) {
+        if (!built) return len;
+        uint32_t current = state;
+        for (std::size_t i = 0; i < len; i++) {
+            current = transitions[current + classes[static_cast<uint8_t>(data[i])]];
+            if (!(current & outputFlag)) continue;
+            current &= ~outputFlag;
+            uint32_t id = current / class_count;
+            bool go_on = true;
+            for (uint32_t k = output_start[id]; k < output_start[id + 1]; k++)
+                go_on = on_match(static_cast<std::size_t>(outputs[k]), i + 1) && go_on;
+            if (!go_on) {
+                state = current;
+                return i + 1;
+            }
+        }
+        state = current;
+        return len;
+    }
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_PATTERNMATCHER_H
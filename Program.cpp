@@ -18,10 +18,21 @@
 #include "Program.h"
 #include "Exceptions.h"
 #include "Device.h"
+#include "Crc16.h"
+#include "ImageSource.h"
+#include "ImageLoader.h"
+#include "ConsoleCapture.h"
+#include "RingLog.h"
+#include "Monitor.h"
+#include "DeviceDiscovery.h"
+#include "Daemon.h"
+#include "FlashSession.h"
+#include "DaemonProtocol.h"
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
 #include <csignal>
-#include <sys/stat.h>
+#include <sstream>
+#include <memory>
 
 namespace po = boost::program_options;
 using namespace std;
@@ -55,28 +66,139 @@ void Program::init(int argc, const char *argv[]) {
     required_options.add_options()
             ("help,h", "Produces this message")
             ("print,p", "Enables the output printing mode")
-            ("flash,f", po::value<string>(), "Flashes the specified binary file");
+            ("tee", po::value<string>(), "In printing mode, also appends the device output to the specified file")
+            ("ring", po::value<string>(), "In printing mode, also records every line with the host time it was "
+                                          "received in the specified ring log, read it with wandstem-ringlog")
+            ("ring-size", po::value<unsigned int>(), "Size in MiB of the ring log, when it is created\nDefault: 256")
+            ("until", po::value<vector<string>>(), "In printing mode, stops when the device prints the specified text, "
+                                                   "which can be repeated")
+            ("exit-on", po::value<vector<string>>(), "In printing mode, stops when the device prints the text after "
+                                                     "CODE: exiting with CODE (0-255), e.g. 2:\"assertion failed\"")
+            ("count", po::value<vector<string>>(), "In printing mode, counts the times the device prints the specified "
+                                                   "text, reported when the printing stops")
+            ("idle-timeout", po::value<double>(), "In printing mode, stops when the device is silent for the specified "
+                                                  "seconds, exiting with 124")
+            ("flash,f", po::value<string>(), "Flashes the specified binary file, also gzip or xz compressed, - for the "
+                                              "standard input")
+            ("monitor", po::value<vector<string>>()->multitoken(),
+             "Prints the output of every specified device, each line prefixed with its port: paths, glob patterns "
+             "(e.g. \"/dev/ttyUSB*\") or auto")
+            ("monitor-dir", po::value<string>(), "In monitor mode, appends the output of every device to its own file "
+                                                 "in the specified directory instead")
+            ("discover", "Lists the serial ports on USB, probing them concurrently for a bootloader, and records the Chip "
+                         "ID of the boards found")
+            ("daemon", "Serves flash, monitor and reboot jobs from wandstem-flashctl, keeping the ports open between "
+                       "them")
+            ("self-test", "Checks the CRC engine against its reference implementation");
 
     po::options_description connection_options("Connection");
     connection_options.add_options()
             ("mode,m", po::value<flash_mode>(),
              "Indicates how the board is connected:\n - a for auto (default);\n - u for USB;\n - s for serial adapter")
             ("device,d", po::value<string>(), "Specifies the tty device path\nDefault:\n    USB mode: \t/dev/ttyACM0\n    serial mode: \t/dev/ttyUSB0")
-            ("baud,b", po::value<int>(), "Specifies the baud rate to be used\nDefault:\n    USB mode: \t9600\n    serial mode: \t115200");
-    total.add(required_options).add(connection_options);
+            ("baud,b", po::value<string>(), "Specifies the baud rate to be used, or auto for the fastest one the "
+                                            "serial adapter handles\nDefault:\n    USB mode: \t9600\n    serial mode: \t115200")
+            ("chip-id", po::value<string>(), "Selects the board with the specified Chip ID, at the port recorded by "
+                                             "--discover or else probing the ports")
+            ("ports", po::value<vector<string>>()->multitoken(),
+             "The ports considered by --discover, --chip-id and auto mode: paths, glob patterns or auto\n"
+             "Default: every serial port on USB")
+            ("socket", po::value<string>(), "The Unix domain socket of the daemon\nDefault: "
+                                            "$XDG_RUNTIME_DIR/wandstem-flash.sock")
+            ("fleet", po::value<vector<string>>()->multitoken(),
+             "Flashes concurrently every specified device: paths, glob patterns (e.g. \"/dev/ttyUSB*\") or auto")
+            ("jobs,j", po::value<unsigned int>(), "Maximum number of boards flashed at the same time in fleet mode\n"
+                                                   "Default: all of them")
+            ("attempts", po::value<unsigned int>(), "Maximum number of flash attempts for every board in fleet mode\n"
+                                                    "Default: 1");
+    po::options_description transfer_options("Transfer");
+    transfer_options.add_options()
+            ("xmodem-1k,k", "Sends the image in 1024 bytes packets (XMODEM-1K), falling back to 128 bytes packets "
+                            "if the device refuses them")
+            ("skip-unchanged", "Only reboots the device if the last image successfully flashed on it, by Chip ID, is "
+                               "the same as the specified one")
+            ("no-trim", "Sends the trailing erased (0xFF) blocks of the image too")
+            ("format", po::value<string>(), "The format of the image file: raw, elf, ihex or srec\nDefault: from "
+                                            "the extension of the file, else from its contents")
+            ("window", po::value<unsigned int>(),
+             "Frames sent ahead of their acknowledgement when the bootloader supports the windowed mode, 1 for "
+             "classic XMODEM\nDefault: 16")
+            ("record", po::value<string>(), "Records every byte exchanged with the device, with the time it crossed "
+                                            "the link, in the specified transcript")
+            ("replay", po::value<string>(), "Plays back the specified transcript in place of the device, reporting "
+                                            "where the utility behaves differently from the recording")
+            ("replay-realtime", "Replays with the timing of the recording, instead of as fast as possible")
+            ("stats", po::value<string>()->implicit_value("text"),
+             "Prints the flash telemetry: reply latencies, retries, phase times and throughput. With --stats=json "
+             "every board is printed as a JSON object on its own line. In monitor mode, the bytes and lines received "
+             "from every board");
+    total.add(required_options).add(connection_options).add(transfer_options);
+    ostringstream description;
+    description << total;
+    usage = description.str();
 
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, total), vm);
     po::notify(vm);
 
-    if (vm.count("help") || !(vm.count("flash") + vm.count("print"))) {
-        cout << total << "\n";
+    if (vm.count("help") || !(vm.count("flash") + vm.count("print") + vm.count("monitor") + vm.count("discover") +
+                                vm.count("daemon") + vm.count("self-test"))) {
+        cout << usage << "\n";
         throw WontExecuteException("Asked for help");
     }
 
     //decode params
 
     args.print = static_cast<bool>(vm.count("print"));
+    if (vm.count("tee")) {
+        if (!args.print)
+            throw runtime_error("The device output can be copied to a file only in printing mode.");
+        args.tee_path = vm["tee"].as<string>();
+    }
+    if (vm.count("ring")) {
+        if (!args.print)
+            throw runtime_error("The device output can be recorded only in printing mode.");
+        args.ring_path = vm["ring"].as<string>();
+    }
+    if (vm.count("ring-size"))
+        args.ring_capacity = static_cast<uint64_t>(vm["ring-size"].as<unsigned int>()) * 1024 * 1024;
+    if (vm.count("until") || vm.count("exit-on") || vm.count("count") || vm.count("idle-timeout")) {
+        if (!args.print)
+            throw runtime_error("The device output can be watched for patterns only in printing mode.");
+        if (vm.count("until")) args.until = vm["until"].as<vector<string>>();
+        if (vm.count("count")) args.count = vm["count"].as<vector<string>>();
+        if (vm.count("exit-on")) {
+            for (auto &spec : vm["exit-on"].as<vector<string>>()) {
+                auto colon = spec.find(':');
+                int code = -1;
+                if (colon != string::npos && colon > 0 && colon <= 3 &&
+                    spec.find_first_not_of("0123456789") == colon)
+                    code = stoi(spec.substr(0, colon));
+                if (code < 0 || code > 255)
+                    throw runtime_error("Invalid --exit-on " + spec + ", expected CODE:PATTERN with CODE 0-255.");
+                args.exit_on.emplace_back(code, spec.substr(colon + 1));
+            }
+        }
+        for (auto &pattern : args.until)
+            if (pattern.empty()) throw runtime_error("The patterns watched for cannot be empty.");
+        for (auto &pattern : args.count)
+            if (pattern.empty()) throw runtime_error("The patterns watched for cannot be empty.");
+        for (auto &entry : args.exit_on)
+            if (entry.second.empty()) throw runtime_error("The patterns watched for cannot be empty.");
+        if (vm.count("idle-timeout")) {
+            auto seconds = vm["idle-timeout"].as<double>();
+            if (!(seconds > 0) || seconds > 86400)
+                throw runtime_error("The idle timeout must be between 0 and 86400 seconds.");
+            args.idle_msec = max(1, static_cast<int>(seconds * 1000));
+        }
+    }
+    args.self_test = static_cast<bool>(vm.count("self-test"));
+    args.discover = static_cast<bool>(vm.count("discover"));
+    args.daemon = static_cast<bool>(vm.count("daemon"));
+    if (args.daemon && (vm.count("flash") || args.print || vm.count("monitor")))
+        throw runtime_error("Daemon mode receives its jobs from wandstem-flashctl, it cannot be used with flash, "
+                            "print or monitor mode.");
+    args.socket_path = vm.count("socket") ? vm["socket"].as<string>() : daemon_socket_path();
 
     if (vm.count("flash"))
         args.bin_path = vm["flash"].as<string>();
@@ -84,18 +206,90 @@ void Program::init(int argc, const char *argv[]) {
     if (vm.count("mode"))
         args.flash_mode = vm["mode"].as<flash_mode>();
 
+    args.flash_options.xmodem_1k = static_cast<bool>(vm.count("xmodem-1k"));
+    args.flash_options.skip_unchanged = static_cast<bool>(vm.count("skip-unchanged"));
+    args.flash_options.trim_erased = !vm.count("no-trim");
+    if (vm.count("format") && !ImageLoader::parse_format(vm["format"].as<string>(), args.flash_options.format))
+        throw runtime_error("Unknown image format " + vm["format"].as<string>() + ", expected raw, elf, ihex or srec.");
+    if (vm.count("window"))
+        args.flash_options.window = vm["window"].as<unsigned int>();
+
+    if (vm.count("stats")) {
+        args.stats = vm["stats"].as<string>();
+        if (args.stats != "text" && args.stats != "json")
+            throw runtime_error("Statistics format must be text or json.");
+    }
+    args.flash_options.record = &flashed_images;
+    args.flash_options.windowed_record = &windowed_refusals;
+
     //if device is selected, mode is ignored
 
     if (vm.count("device"))
         args.device_path = vm["device"].as<string>();
 
+    if (vm.count("ports"))
+        args.ports = vm["ports"].as<vector<string>>();
+
+    if (vm.count("chip-id")) {
+        args.chip_id = str_toupper(vm["chip-id"].as<string>());
+        args.flash_options.chip_id = args.chip_id;
+    }
+
+    if (vm.count("fleet")) {
+        if (!vm.count("flash"))
+            throw runtime_error("Fleet mode requires a binary file to flash.");
+        if (args.print)
+            throw runtime_error("Print mode reads a single device, it cannot be used in fleet mode.");
+        args.fleet = vm["fleet"].as<vector<string>>();
+    }
+
+    if (vm.count("monitor")) {
+        if (vm.count("flash") || args.print)
+            throw runtime_error("Monitor mode only reads the devices, it cannot be used with flash or print mode.");
+        args.monitor = vm["monitor"].as<vector<string>>();
+    }
+    if (vm.count("monitor-dir")) {
+        if (args.monitor.empty())
+            throw runtime_error("The output can be split in files per device only in monitor mode.");
+        args.monitor_dir = vm["monitor-dir"].as<string>();
+    }
+
+    if (vm.count("jobs"))
+        args.jobs = vm["jobs"].as<unsigned int>();
+
+    if (vm.count("attempts"))
+        args.attempts = vm["attempts"].as<unsigned int>();
+
     //if baud is specified, default is ignored
 
     if (vm.count("baud")) {
-        auto baud = vm["baud"].as<int>();
-        if (baud < 0)
-            throw runtime_error("Baud rate cannot be negative.");
-        args.baud = static_cast<unsigned int>(baud);
+        auto baud = vm["baud"].as<string>();
+        if (baud == "auto") {
+            if (!args.monitor.empty())
+                throw runtime_error("Monitor mode needs the baud rate of the firmware, it cannot be auto.");
+            args.auto_baud = true;
+        } else {
+            if (baud.empty() || baud.find_first_not_of("0123456789") != string::npos)
+                throw runtime_error("Baud rate must be a positive number or auto.");
+            args.baud = static_cast<unsigned int>(stoul(baud));
+        }
+    }
+
+    if (vm.count("record") && vm.count("replay"))
+        throw runtime_error("A transcript cannot be recorded while replaying another.");
+    if ((vm.count("record") || vm.count("replay")) && (!args.fleet.empty() || !args.monitor.empty() ||
+                                                        args.discover || args.daemon))
+        throw runtime_error("Transcripts cover the flash and print modes of a single device.");
+    if (vm.count("record"))
+        args.record_path = vm["record"].as<string>();
+    if (vm.count("replay")) {
+        args.replay_path = vm["replay"].as<string>();
+        args.replay_realtime = static_cast<bool>(vm.count("replay-realtime"));
+        //the records of the host describe the real boards, not the recorded one
+        args.flash_options.record = &replay_images;
+        args.flash_options.windowed_record = &replay_refusals;
+    } else if (vm.count("replay-realtime")) {
+        throw runtime_error("The replay timing can be chosen only when replaying a transcript.");
     }
 
     signal(SIGINT, stop);
@@ -103,7 +297,51 @@ void Program::init(int argc, const char *argv[]) {
     //init the device
 }
 
+std::string Program::discover_device() {
+    DeviceDiscovery discovery([this](const string &path) { return create_device(path); }, &devices);
+    auto ports = discovery.list(args.ports);
+    if (!args.chip_id.empty()) {
+        string path = discovery.resolve(args.chip_id, ports);
+        if (!path.empty()) return path;
+        cout << " :: Looking for the device " << args.chip_id << " on " << ports.size() << " ports... ::" << endl;
+        for (auto &board : discovery.probe(ports))
+            if (board.chip_id == args.chip_id) return board.tty.path;
+        throw DeviceNotFoundException("No device with Chip ID " + args.chip_id + " found.");
+    }
+    if (ports.empty())
+        throw DeviceNotFoundException("Device not found using auto discovery. Please specify the device path.");
+    if (ports.size() == 1) return ports.front().path;
+    //the firmware must not be disturbed, only a bootloader can be asked who it is
+    if (args.print)
+        throw DeviceNotFoundException("Several devices found using auto discovery. Please specify the device path "
+                                      "or the Chip ID.");
+    auto boards = discovery.probe(ports);
+    if (boards.size() == 1) return boards.front().tty.path;
+    DeviceDiscovery::print(cout, ports, boards);
+    throw DeviceNotFoundException(boards.empty() ? "No device in bootloader mode found using auto discovery."
+                                                 : "Several devices in bootloader mode found. Please specify the "
+                                                   "device path or the Chip ID.");
+}
+
 void Program::init_device(bool infinite_timeout) {
+    if (!args.replay_path.empty() && replay == nullptr) {
+        unique_ptr<ReplayTransport> transcript(new ReplayTransport(args.replay_path, args.replay_realtime));
+        //the board of the recording, at the rate it was found at
+        if (args.device_path.empty())
+            args.device_path = transcript->get_recorded_path();
+        if (transcript->get_recorded_baud()) {
+            replay_bauds.put(args.device_path, to_string(transcript->get_recorded_baud()));
+            if (args.baud == unsetBaud && !args.auto_baud) args.baud = transcript->get_recorded_baud();
+        }
+        device = create_device(args.device_path, infinite_timeout);
+        replay = transcript.get();
+        device->set_transport(move(transcript));
+        return;
+    }
+    if (!args.chip_id.empty() && args.device_path.empty()) {
+        device = create_device(discover_device(), infinite_timeout);
+        return;
+    }
     if (args.device_path.empty()) {
         //check for the mode
         switch (args.flash_mode) {
@@ -115,74 +353,268 @@ void Program::init_device(bool infinite_timeout) {
                 break;
             case AUTO:
             default:
-                struct stat buffer;
-                if (stat("/dev/ttyACM0", &buffer) == 0)
-                    device = new USBDevice(infinite_timeout);
-                else if (stat("/dev/ttyUSB0", &buffer) == 0)
-                    device = new UARTDevice(infinite_timeout);
-                else
-                    throw DeviceNotFoundException(
-                            "Device not found using auto discovery. Please specify the device path.");
+                device = create_device(discover_device(), infinite_timeout);
                 break;
         }
     } else {
-        if (str_toupper(args.device_path).find("ACM") != std::string::npos) {
-            if (args.baud == -1)
-                device = new USBDevice(args.device_path, infinite_timeout);
-            else
-                device = new USBDevice(args.device_path, args.baud, infinite_timeout);
-        } else {
-            if (args.baud == -1)
-                device = new UARTDevice(args.device_path, infinite_timeout);
-            else
-                device = new UARTDevice(args.device_path, args.baud, infinite_timeout);
-        }
+        device = create_device(args.device_path, infinite_timeout);
+    }
+    attach_transcript();
+}
+
+void Program::attach_transcript() {
+    if (args.record_path.empty() || recorder != nullptr) return;
+    unique_ptr<Transport> port(new SerialPort);
+    recorder = new RecordingTransport(move(port), args.record_path);
+    device->set_transport(unique_ptr<Transport>(recorder));
+}
+
+Device *Program::create_device(const std::string &path, bool infinite_timeout) const {
+    connection_options_t connection;
+    connection.baud = args.baud == unsetBaud ? 0 : args.baud;
+    connection.auto_baud = args.auto_baud;
+    connection.baud_record = args.replay_path.empty() ? &baud_rates : &replay_bauds;
+    connection.infinite_timeout = infinite_timeout;
+    return Device::create(path, connection);
+}
+
+void Program::discover_if_needed() {
+    if (!args.discover) return;
+    DeviceDiscovery discovery([this](const string &path) { return create_device(path); }, &devices);
+    auto ports = discovery.list(args.ports);
+    if (ports.empty()) {
+        cout << "No serial port found." << endl;
+        return;
+    }
+    cout << " :: Probing " << ports.size() << " ports... ::" << endl;
+    try {
+        auto boards = discovery.probe(ports);
+        DeviceDiscovery::print(cout, ports, boards);
+    } catch (InterruptedException &ex) {
+        exit_code = 1;
+    }
+}
+
+bool Program::self_test_if_needed() {
+    if (!args.self_test) return true;
+    cout << " :: Checking the CRC engine (" << (Crc16::has_clmul() ? "carry-less multiplication" : "slice-by-8")
+         << " kernel)...";
+    bool passed = Crc16::self_test();
+    cout << (passed ? "passed! ::" : "FAILED! ::") << endl;
+    return passed;
+}
+
+void Program::flash_fleet() {
+    auto paths = Fleet::expand(args.fleet);
+    if (paths.empty()) {
+        cout << "Error while establishing communication with device:" << endl
+             << "No device matches the fleet specification. Flash operation aborted." << endl;
+        exit_code = 1;
+        return;
+    }
+    try {
+        cout << " :: Loading binary image file...";
+        ImageLoader::image_format format;
+        auto image = ImageLoader::load(args.bin_path, args.flash_options.trim_erased, &format,
+                                        args.flash_options.format);
+        cout << "loaded " << ImageLoader::describe(*image, format) << "! ::" << endl;
+        fleet = new Fleet(paths, [this](const string &path) { return create_device(path); }, args.jobs,
+                          args.attempts);
+        if (!fleet->flash(*image, args.flash_options, cout))
+            exit_code = 1;
+        if (!args.stats.empty())
+            fleet->print_stats(cout, args.stats == "json");
+    } catch (BinaryNotFoundException &ex) {
+        cout << "Error opening the binary image file:" << endl << ex.what() << ". Flash operation aborted." << endl;
+        exit_code = 1;
+    } catch (FileIOException &ex) {
+        cout << "Binary file reading error:" << endl << ex.what() << ". Flash operation aborted." << endl;
+        exit_code = 1;
     }
 }
 
 void Program::flash_if_needed() {
     if (args.bin_path.empty()) return;
+    if (!args.fleet.empty()) {
+        flash_fleet();
+        return;
+    }
+    exit_code = 1;
     try {
         init_device();
-        device->flash(args.bin_path);
-    } catch (XmodemTransmissionException &ex) {
-        cout << "Xmodem transmission error:" << endl << ex.what() << ". Flash operation aborted." << endl;
     } catch (DeviceNotFoundException &ex) {
         cout << "Error while establishing communication with device:" << endl << ex.what()
              << ". Flash operation aborted." << endl;
-    } catch (BinaryNotFoundException &ex) {
-        cout << "Error opening the binary image file:" << endl << ex.what() << ". Flash operation aborted." << endl;
+        return;
     } catch (FileIOException &ex) {
-        cout << "Binary file reading error:" << endl << ex.what() << ". Flash operation aborted." << endl;
-    } catch (ios::failure &ex) {
-        cout << "Physical communication with the device error:" << endl << ex.what() << ". Flash operation aborted."
+        cout << "Transcript error:" << endl << ex.what() << ". Flash operation aborted." << endl;
+        return;
+    } catch (InterruptedException &ex) {
+        cout << endl << "Flash operation interrupted." << endl;
+        return;
+    }
+    session.reset(new FlashSession(unique_ptr<Device>(device)));
+    session->set_console(cout);
+    auto result = session->flash(args.bin_path, args.flash_options);
+    if (result.code == FlashSession::OK)
+        exit_code = 0;
+    else if (result.code == FlashSession::INTERRUPTED)
+        cout << endl << "Flash operation interrupted." << endl;
+    else
+        cout << FlashSession::describe(result.code) << ":" << endl << result.message << ". Flash operation aborted."
              << endl;
+    //the telemetry of a failed operation tells where it went wrong
+    if (!args.stats.empty()) {
+        if (args.stats == "json") {
+            result.report.stats.print_json(cout);
+            cout << endl;
+        } else {
+            result.report.stats.print(cout);
+        }
     }
 }
 
 void Program::read_to_end() {
     if (!args.print) return;
-    bool device_inited = false;
-    try {
-        init_device(true);
-        device_inited = true;
-    } catch (DeviceNotFoundException &ex) {
-        cout << "Error while establishing communication with device:" << endl << ex.what()
-             << ". Flash operation aborted." << endl;
+    if (session) {
+        //the port is still open after the flash: the first lines of the boot are already waiting in its buffers
+        device = &session->get_device();
+        device->set_infinite_timeout(true);
+    } else {
+        try {
+            init_device(true);
+        } catch (DeviceNotFoundException &ex) {
+            cout << "Error while establishing communication with device:" << endl << ex.what()
+                 << ". Flash operation aborted." << endl;
+            return;
+        } catch (FileIOException &ex) {
+            cout << "Transcript error:" << endl << ex.what() << endl;
+            exit_code = 1;
+            return;
+        }
     }
-    if (!device_inited) return;
     if (dynamic_cast<USBDevice*>(device) != nullptr) {
         cout << "Cannot read standard output from a device connected in USB mode." << endl;
         return;
     }
     if(!device->open_comm())
         cout << "Generic error while enstablishing communication with the device" << endl;
-    for (; running;)
-        device->read_and_print<char>();
+    ConsoleCapture capture;
+    unique_ptr<RingLog> ring;
+    try {
+        if (!args.tee_path.empty())
+            capture.tee(args.tee_path);
+        if (!args.ring_path.empty()) {
+            ring.reset(new RingLog(args.ring_path, args.ring_capacity));
+            capture.record(*ring);
+        }
+        for (auto &pattern : args.until)
+            capture.add_trigger(pattern, true);
+        for (auto &entry : args.exit_on)
+            capture.add_trigger(entry.second, true, entry.first);
+        for (auto &pattern : args.count)
+            capture.add_trigger(pattern, false);
+        capture.set_idle_timeout(args.idle_msec);
+        //what was printed so far must come before the device output
+        cout << flush;
+        if (capture.run(*device) == ConsoleCapture::MATCHED) {
+            auto fired = capture.get_fired();
+            cout << endl << " :: Stopped by \"" << fired->pattern << "\" ::" << endl;
+            if (exit_code == 0) exit_code = fired->exit_code;
+        } else {
+            cout << endl << " :: Stopped after " << args.idle_msec / 1000.0 << " s of silence ::" << endl;
+            if (exit_code == 0) exit_code = captureIdleExitCode;
+        }
+    } catch (InterruptedException &ex) {
+        //stopped by the user
+    } catch (FileIOException &ex) {
+        cout << endl << "Error writing the device output:" << endl << ex.what() << endl;
+        exit_code = 1;
+    } catch (ios::failure &ex) {
+        cout << endl << "Physical communication with the device error:" << endl << ex.what() << endl;
+        exit_code = 1;
+    }
+    for (auto &trigger : capture.get_triggers()) {
+        if (args.stats == "json") {
+            cout << "{\"pattern\":";
+            write_json_string(cout, trigger.pattern);
+            cout << ",\"count\":" << trigger.count << "}" << endl;
+        } else {
+            cout << " :: \"" << trigger.pattern << "\": " << trigger.count << " ::" << endl;
+        }
+    }
+}
+
+void Program::verify_replay_if_needed() {
+    if (recorder != nullptr) recorder->flush();
+    if (recorder != nullptr && !recorder->get_error().empty()) {
+        cout << "The transcript is incomplete:" << endl << recorder->get_error() << endl;
+        exit_code = 1;
+    }
+    if (replay == nullptr) return;
+    auto verdict = replay->verdict();
+    if (verdict.empty()) {
+        cout << " :: The replay matched the transcript, " << replay->get_replayed() << " events ::" << endl;
+        return;
+    }
+    cout << "The replay diverged from the transcript:" << endl << verdict << endl;
+    exit_code = 1;
+}
+
+void Program::monitor_if_needed() {
+    if (args.monitor.empty()) return;
+    auto paths = Fleet::expand(args.monitor);
+    if (paths.empty()) {
+        cout << "No device found to monitor." << endl;
+        exit_code = 1;
+        return;
+    }
+    vector<unsigned int> bauds;
+    for (auto &path : paths) {
+        //the same defaults as USBDevice and UARTDevice
+        bool usb = str_toupper(path).find("ACM") != std::string::npos;
+        bauds.push_back(args.baud != unsetBaud ? args.baud : usb ? 9600 : 115200);
+    }
+    try {
+        Monitor monitor(paths, bauds);
+        if (!args.monitor_dir.empty())
+            monitor.split(args.monitor_dir);
+        size_t opened = 0;
+        for (auto &counters : monitor.get_counters())
+            if (counters.open) opened++;
+        cout << ":: Monitoring " << opened << " device" << (opened > 1 ? "s" : "") << " ::" << endl;
+        try {
+            monitor.run();
+        } catch (FileIOException &ex) {
+            cout << endl << "Error writing the device output:" << endl << ex.what() << endl;
+            exit_code = 1;
+        }
+        for (auto &counters : monitor.get_counters())
+            if (!counters.error.empty()) exit_code = 1;
+        if (!args.stats.empty())
+            monitor.print_counters(cout, args.stats == "json");
+    } catch (ios::failure &ex) {
+        cout << "Error while establishing communication with the devices:" << endl << ex.what() << endl;
+        exit_code = 1;
+    }
+}
+
+void Program::serve_if_needed() {
+    if (!args.daemon) return;
+    Daemon daemon(args.socket_path, [this](const string &path) { return create_device(path); }, args.flash_options);
+    try {
+        cout << " :: Serving jobs on " << args.socket_path << " ::" << endl;
+        daemon.run();
+    } catch (runtime_error &ex) {
+        cout << ex.what() << endl;
+        exit_code = 1;
+    }
 }
 
-void Program::stop(int sig) {
+void Program::stop(int) {
     auto& p = Program::get_instance();
-    if(p.device != nullptr) p.device->close_comm();
+    if(p.fleet != nullptr) p.fleet->cancel();
+    //wakes up any read in progress, on every port
+    SerialPort::interrupt_all();
     p.running = false;
 }
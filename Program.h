@@ -7,8 +7,16 @@
 
 #include <string>
 #include <ios>
+#include <memory>
 #include "Device.h"
+#include "FlashSession.h"
+#include "Fleet.h"
+#include "CacheFile.h"
+#include "RingLog.h"
+#include "Transcript.h"
 
+///The baud rate of the arguments when none was specified.
+static const unsigned int unsetBaud=static_cast<unsigned int>(-1);
 
 /**
  * This class models the Program during its phases.
@@ -30,18 +38,118 @@ private:
     ///The possible arguments with which the program was invoked.
     struct arguments_t {
         bool print = false;
+        bool self_test = false;
+        bool discover = false;
+        bool daemon = false;
+        ///The socket the daemon serves on.
+        std::string socket_path;
         std::string bin_path = "";
         Program::flash_mode flash_mode = AUTO;
         std::string device_path;
-        unsigned int baud = static_cast<unsigned int>(-1);
+        ///The Chip ID of the board to be used, if selected that way.
+        std::string chip_id;
+        ///The ports considered by the discovery, every one on USB if empty.
+        std::vector<std::string> ports;
+        unsigned int baud = unsetBaud;
+        bool auto_baud = false;
+        ///The format of the flash telemetry: empty for none, text or json.
+        std::string stats;
+        ///The file where the device output is copied in printing mode.
+        std::string tee_path;
+        ///The ring log where the device output is recorded in printing mode.
+        std::string ring_path;
+        uint64_t ring_capacity = ringLogDefaultCapacity;
+        ///The patterns watched for in the device output in printing mode, with the exit status of the ones stopping
+        ///it: --until, --exit-on and --count in this order.
+        std::vector<std::string> until;
+        std::vector<std::pair<int, std::string>> exit_on;
+        std::vector<std::string> count;
+        ///How long the device may be silent in printing mode, 0 for ever.
+        int idle_msec = 0;
+        ///The devices read in monitor mode.
+        std::vector<std::string> monitor;
+        ///The directory where the output of every device goes to its own file in monitor mode.
+        std::string monitor_dir;
+        flash_options_t flash_options;
+        std::vector<std::string> fleet;
+        unsigned int jobs = 0;
+        unsigned int attempts = 1;
+        ///The file where the traffic with the device is recorded.
+        std::string record_path;
+        ///The transcript played back in place of the device.
+        std::string replay_path;
+        bool replay_realtime = false;
     } args;
 
     ///The instance of the Device to which we will interface.
     Device *device = nullptr;
 
+    ///The session of the flash operation, owning its device and keeping the port open for printing mode.
+    std::unique_ptr<FlashSession> session;
+
+    ///The boards flashed concurrently in fleet mode.
+    Fleet *fleet = nullptr;
+
+    ///The record of the images flashed on every board, by Chip ID.
+    CacheFile flashed_images{CacheFile::default_path("flashed")};
+
+    ///The ports of the boards found by the discovery, by Chip ID.
+    CacheFile devices{CacheFile::default_path("devices")};
+
+    ///The baud rates that worked, by device path.
+    mutable CacheFile baud_rates{CacheFile::default_path("baud")};
+
+    ///The bootloaders that refused the windowed mode, by Chip ID or device path.
+    CacheFile windowed_refusals{CacheFile::default_path("windowed")};
+
+    ///The transcript played back in place of the device, owned by the device, null if not replaying.
+    ReplayTransport *replay = nullptr;
+
+    ///The recorder of the traffic with the device, owned by the device, null if not recording.
+    RecordingTransport *recorder = nullptr;
+
+    ///The records used while replaying, which must not be touched by a replay.
+    CacheFile replay_images{""};
+    mutable CacheFile replay_bauds{""};
+    CacheFile replay_refusals{""};
+
     ///The controller variable for program interruption
     bool running = true;
 
+    ///The exit status of the process.
+    int exit_code = 0;
+
+    ///The description of the arguments, printed along with the errors in them.
+    std::string usage;
+
+    /**
+     * Instantiates the device at the specified path, using the specified baud rate if any.
+     * \param path the path to the device
+     * \param infinite_timeout if the device should have an infinite timeout or not.
+     * \return the device.
+     */
+    Device *create_device(const std::string &path, bool infinite_timeout = false) const;
+
+    /**
+     * Attaches the recorder or the transcript being replayed to the device, if requested.
+     * \throws FileIOException If the transcript could not be created.
+     * \return
+     */
+    void attach_transcript();
+
+    /**
+     * Finds the port of the device to be used, by Chip ID if specified.
+     * \throws DeviceNotFoundException If no device, or more than one, matches.
+     * \return the path of the port.
+     */
+    std::string discover_device();
+
+    /**
+     * Flashes every board of the fleet concurrently.
+     * \return
+     */
+    void flash_fleet();
+
 public:
     Program(Program const &) = delete;
 
@@ -57,6 +165,7 @@ public:
      * Initializes the Program by parsing the arguments, determining and instantiating the correct device with the specified parameters.
      * \throws DeviceNotFoundException if auto mode is selected and no device is found.
      * \throws WontExecuteException if any mode was selected.
+     * \throws std::exception if the arguments are malformed.
      * \param argc the number of arguments
      * \param argv the argument strings
      * \return
@@ -70,6 +179,24 @@ public:
      */
     void init_device(bool infinite_timeout = false);
 
+    /**
+     * Reports if the replay of a transcript matched it, if the replay argument was specified.
+     * \return
+     */
+    void verify_replay_if_needed();
+
+    /**
+     * Lists the ports and the boards found on them, if the discover argument was specified.
+     * \return
+     */
+    void discover_if_needed();
+
+    /**
+     * Checks the CRC engine against its reference implementation, if the self-test argument was specified.
+     * \return false if the self-test was run and failed.
+     */
+    bool self_test_if_needed();
+
     /**
      * Flashes the device is specified in the arguments.
      * \return
@@ -82,6 +209,31 @@ public:
      */
     void read_to_end();
 
+    /**
+     * Prints the output of many devices at once until the process is not stopped, if the monitor argument was
+     * specified.
+     * \return
+     */
+    void monitor_if_needed();
+
+    /**
+     * Serves the jobs of the clients until the process is not stopped, if the daemon argument was specified.
+     * \return
+     */
+    void serve_if_needed();
+
+    /**
+     * Returns the exit status of the process.
+     * \return 0 if every operation succeeded.
+     */
+    int get_exit_code() const { return exit_code; }
+
+    /**
+     * Returns the description of the arguments.
+     * \return the usage message.
+     */
+    const std::string &get_usage() const { return usage; }
+
     /**
      * Stops the process.
      * \return
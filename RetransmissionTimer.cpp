@@ -0,0 +1,47 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "RetransmissionTimer.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+void RetransmissionTimer::add_sample(std::chrono::steady_clock::duration rtt) {
+    double sample = chrono::duration<double, micro>(rtt).count();
+    if (!has_sample) {
+        srtt_usec = sample;
+        rttvar_usec = sample / 2;
+        has_sample = true;
+    } else {
+        //alpha = 1/8, beta = 1/4
+        rttvar_usec += (fabs(srtt_usec - sample) - rttvar_usec) / 4;
+        srtt_usec += (sample - srtt_usec) / 8;
+    }
+    backoffs = 0;
+}
+
+void RetransmissionTimer::reset() {
+    has_sample = false;
+    srtt_usec = 0;
+    rttvar_usec = 0;
+    backoffs = 0;
+}
+
+int RetransmissionTimer::get_timeout_msec() const {
+    double timeout = has_sample ? (srtt_usec + 4 * rttvar_usec) / 1000 : initial_msec;
+    timeout = max<double>(timeout, floor_msec) * (1 << min(backoffs, 16));
+    return static_cast<int>(ceil(min<double>(timeout, ceiling_msec)));
+}
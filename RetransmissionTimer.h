@@ -0,0 +1,85 @@
+#ifndef WANDSTEM_FLASH_UTILITY_RETRANSMISSIONTIMER_H
+#define WANDSTEM_FLASH_UTILITY_RETRANSMISSIONTIMER_H
+
+#include <chrono>
+
+/**
+ * This class estimates how long to wait for the reply to a packet before sending it again, from the smoothed round
+ * trip time and its variance as TCP does (RFC 6298). Only replies to packets sent once must be sampled, since the
+ * reply to a retransmitted packet may belong to any of its copies (Karn's algorithm).
+ */
+class RetransmissionTimer {
+private:
+    ///The timeout used until the first sample.
+    int initial_msec;
+
+    ///The shortest timeout, at least the time the packet and its reply take on the wire.
+    int floor_msec;
+
+    int ceiling_msec;
+
+    bool has_sample = false;
+
+    double srtt_usec = 0;
+
+    double rttvar_usec = 0;
+
+    ///How many times the timeout was doubled since the last sample.
+    int backoffs = 0;
+
+public:
+    /**
+     * Constructor.
+     * \param initial_msec the timeout until the first sample
+     * \param floor_msec the shortest timeout
+     * \param ceiling_msec the longest timeout
+     */
+    RetransmissionTimer(int initial_msec, int floor_msec, int ceiling_msec) : initial_msec(initial_msec),
+            floor_msec(floor_msec), ceiling_msec(ceiling_msec) {}
+
+    /**
+     * Updates the estimate with the round trip time of a packet sent once.
+     * \param rtt the time from the send to the reply
+     * \return
+     */
+    void add_sample(std::chrono::steady_clock::duration rtt);
+
+    /**
+     * Doubles the timeout after it expired, up to the ceiling.
+     * \return
+     */
+    void back_off() { backoffs++; }
+
+    /**
+     * Restores the timeout once the device is answering again, without sampling the ambiguous round trip.
+     * \return
+     */
+    void clear_backoff() { backoffs = 0; }
+
+    /**
+     * Forgets the estimate, when the packets change size or the link changes speed.
+     * \return
+     */
+    void reset();
+
+    /**
+     * Changes the shortest timeout, when the packets change size or the link changes speed.
+     * \param msec the shortest timeout
+     * \return
+     */
+    void set_floor_msec(int msec) { floor_msec = msec; }
+
+    /**
+     * Gets the current timeout.
+     * \return the timeout in milliseconds.
+     */
+    int get_timeout_msec() const;
+
+    /**
+     * Gets the smoothed round trip time.
+     * \return the estimate in microseconds, 0 if there are no samples yet.
+     */
+    double get_srtt_usec() const { return srtt_usec; }
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_RETRANSMISSIONTIMER_H
@@ -0,0 +1,390 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "RingLog.h"
+#include "Crc16.h"
+#include "Exceptions.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+///The first page of the file.
+struct ring_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t index_slots;
+    ///The bytes reserved to the records.
+    uint64_t capacity;
+    ///The bytes of the ring covered by every index slot.
+    uint64_t index_stride;
+    ///The logical offset of the oldest record. Logical offsets grow forever, the position in the ring is modulo capacity.
+    uint64_t tail;
+    ///The logical offset past the newest record, updated only once it is complete.
+    uint64_t head;
+    ///The logical offset of the newest record.
+    uint64_t last;
+    uint64_t next_seq;
+};
+
+///A line in the ring, followed by its bytes and padded to 8 bytes.
+struct ring_record_t {
+    uint32_t length;
+    uint16_t flags;
+    ///The CRC of the rest of the record and of the line.
+    uint16_t crc;
+    uint64_t seq;
+    int64_t mono_ns;
+    int64_t real_ns;
+};
+
+///The first record starting in a slice of the ring.
+struct ring_index_t {
+    uint64_t offset;
+    int64_t mono_ns;
+    int64_t real_ns;
+};
+
+namespace {
+
+static const size_t ringHeaderSize = 4096;
+///The record fills the end of the ring, the next one starts at the beginning.
+static const uint16_t ringPadding = 1;
+
+static_assert(sizeof(ring_header_t) <= ringHeaderSize, "The ring log header does not fit its page");
+static_assert(sizeof(ring_record_t) == 32, "Unexpected ring log record layout");
+
+inline uint64_t record_size(size_t length) {
+    return (sizeof(ring_record_t) + length + 7) & ~static_cast<uint64_t>(7);
+}
+
+inline size_t index_size(uint32_t slots) {
+    return (slots * sizeof(ring_index_t) + ringHeaderSize - 1) & ~(ringHeaderSize - 1);
+}
+
+inline uint64_t index_stride(uint64_t capacity, uint32_t slots) {
+    return ((capacity + slots - 1) / slots + 7) & ~static_cast<uint64_t>(7);
+}
+
+uint16_t record_crc(const ring_record_t &record, const char *data) {
+    auto bytes = reinterpret_cast<const uint8_t *>(&record);
+    uint16_t crc = Crc16::compute(bytes, offsetof(ring_record_t, crc));
+    crc = Crc16::compute(bytes + offsetof(ring_record_t, seq), sizeof(ring_record_t) - offsetof(ring_record_t, seq),
+                         crc);
+    return Crc16::compute(reinterpret_cast<const uint8_t *>(data), record.length, crc);
+}
+
+inline int64_t stamp_of(RingLog::clock_id clock, int64_t mono_ns, int64_t real_ns) {
+    return clock == RingLog::REALTIME ? real_ns : mono_ns;
+}
+
+///The offset of an index slot being rewritten, which matches no slice.
+static const uint64_t ringIndexBusy = ~static_cast<uint64_t>(0);
+
+/**
+ * Rewrites an index slot, as a seqlock: a reader seeing any of the new stamps also sees the slot busy or complete.
+ */
+void store_entry(ring_index_t &slot, uint64_t offset, const ring_stamp_t &stamp) {
+    __atomic_store_n(&slot.offset, ringIndexBusy, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot.mono_ns, stamp.mono_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot.real_ns, stamp.real_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot.offset, offset, __ATOMIC_RELEASE);
+}
+
+/**
+ * Reads an index slot the writer may be rewriting.
+ * \return the slot, with offset ringIndexBusy if it was being rewritten.
+ */
+ring_index_t load_entry(const ring_index_t &slot) {
+    ring_index_t entry{};
+    entry.offset = __atomic_load_n(&slot.offset, __ATOMIC_ACQUIRE);
+    entry.mono_ns = __atomic_load_n(&slot.mono_ns, __ATOMIC_RELAXED);
+    entry.real_ns = __atomic_load_n(&slot.real_ns, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot.offset, __ATOMIC_RELAXED) != entry.offset) entry.offset = ringIndexBusy;
+    return entry;
+}
+
+}
+
+RingLog::RingLog(const std::string &path, uint64_t capacity) : path(path), writable(true) {
+    map(capacity);
+}
+
+RingLog::RingLog(const std::string &path) : path(path), writable(false) {
+    map(0);
+}
+
+RingLog::~RingLog() {
+    if (mapping != nullptr) {
+        //start the write back now rather than when the kernel gets to it
+        if (writable) msync(mapping, mapped_length, MS_ASYNC);
+        munmap(mapping, mapped_length);
+    }
+    if (fd >= 0) ::close(fd);
+}
+
+void RingLog::map(uint64_t capacity) {
+    fd = ::open(path.c_str(), writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw FileIOException("Cannot open " + path + ": " + strerror(errno));
+    if (writable && flock(fd, LOCK_EX | LOCK_NB))
+        throw FileIOException("The ring log " + path + " is being written by another process");
+
+    struct stat stat_buffer{};
+    if (fstat(fd, &stat_buffer))
+        throw FileIOException("Cannot read " + path + ": " + strerror(errno));
+    auto size = static_cast<uint64_t>(stat_buffer.st_size);
+    ring_header_t existing{};
+    bool valid = size >= ringHeaderSize && pread(fd, &existing, sizeof(existing), 0) == sizeof(existing) &&
+                 existing.magic == ringLogMagic && existing.version == ringLogVersion && existing.index_slots &&
+                 existing.capacity >= ringLogMinCapacity && existing.capacity % 8 == 0 &&
+                 existing.index_stride == index_stride(existing.capacity, existing.index_slots) &&
+                 size == ringHeaderSize + index_size(existing.index_slots) + existing.capacity;
+    if (!valid) {
+        if (!writable)
+            throw FileIOException(path + " is not a ring log");
+        //a new log, or one damaged beyond repair: start over
+        capacity = (max(capacity, ringLogMinCapacity) + ringHeaderSize - 1) & ~static_cast<uint64_t>(ringHeaderSize - 1);
+        size = ringHeaderSize + index_size(ringLogIndexSlots) + capacity;
+        if (ftruncate(fd, 0) || ftruncate(fd, static_cast<off_t>(size)))
+            throw FileIOException("Cannot allocate " + path + ": " + strerror(errno));
+    }
+
+    mapped_length = static_cast<size_t>(size);
+    void *addr = mmap(nullptr, mapped_length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        throw FileIOException("Cannot map " + path + " in memory: " + strerror(errno));
+    mapping = static_cast<uint8_t *>(addr);
+    header = reinterpret_cast<ring_header_t *>(mapping);
+    if (!valid) {
+        //the file is all zeros, the magic number goes last
+        header->version = ringLogVersion;
+        header->index_slots = ringLogIndexSlots;
+        header->capacity = capacity;
+        header->index_stride = index_stride(capacity, ringLogIndexSlots);
+        __atomic_store_n(&header->magic, ringLogMagic, __ATOMIC_RELEASE);
+    }
+    index = reinterpret_cast<ring_index_t *>(mapping + ringHeaderSize);
+    ring = mapping + ringHeaderSize + index_size(header->index_slots);
+    if (valid && writable) recover();
+}
+
+void RingLog::recover() {
+    uint64_t tail = header->tail;
+    uint64_t head = header->head;
+    if (head < tail || head - tail > header->capacity) {
+        //the header itself is damaged, the records cannot be trusted
+        header->tail = header->head = header->last = 0;
+        memset(index, 0, index_size(header->index_slots));
+        return;
+    }
+    //a crash can only have damaged the newest records, which are after the last index entry
+    uint64_t position = seek(REALTIME, INT64_MAX, tail, head);
+    uint64_t last = header->last;
+    bool found = false;
+    line_t line{};
+    string storage;
+    while (position < head) {
+        uint64_t next = skip_padding(position);
+        if (next == position) {
+            if (!read_record(position, line, storage, next)) break;
+            found = true;
+            last = position;
+        }
+        position = next;
+    }
+    if (position != head) {
+        __atomic_store_n(&header->last, last, __ATOMIC_RELEASE);
+        __atomic_store_n(&header->head, min(position, head), __ATOMIC_RELEASE);
+    }
+    if (found && header->next_seq <= line.seq) header->next_seq = line.seq + 1;
+}
+
+uint64_t RingLog::skip_padding(uint64_t offset) const {
+    uint64_t left = header->capacity - offset % header->capacity;
+    if (left < sizeof(ring_record_t)) return offset + left;
+    uint16_t flags;
+    memcpy(&flags, ring + offset % header->capacity + offsetof(ring_record_t, flags), sizeof(flags));
+    return flags & ringPadding ? offset + left : offset;
+}
+
+uint64_t RingLog::skip_record(uint64_t offset) const {
+    uint64_t next = skip_padding(offset);
+    if (next != offset) return next;
+    uint32_t length;
+    memcpy(&length, ring + offset % header->capacity, sizeof(length));
+    return offset + record_size(min<size_t>(length, ringLogMaxLine));
+}
+
+bool RingLog::read_record(uint64_t offset, line_t &line, std::string &storage, uint64_t &next) const {
+    uint64_t phys = offset % header->capacity;
+    if (header->capacity - phys < sizeof(ring_record_t)) return false;
+    ring_record_t record;
+    memcpy(&record, ring + phys, sizeof(record));
+    if (record.flags || record.length > ringLogMaxLine || phys + record_size(record.length) > header->capacity)
+        return false;
+    storage.assign(reinterpret_cast<const char *>(ring + phys + sizeof(record)), record.length);
+    if (record_crc(record, storage.data()) != record.crc) return false;
+    //the writer may have overwritten the record while it was being copied
+    if (__atomic_load_n(&header->tail, __ATOMIC_ACQUIRE) > offset) return false;
+    line.seq = record.seq;
+    line.stamp.mono_ns = record.mono_ns;
+    line.stamp.real_ns = record.real_ns;
+    line.data = storage.data();
+    line.length = storage.size();
+    next = offset + record_size(record.length);
+    return true;
+}
+
+uint64_t RingLog::seek(clock_id clock, int64_t time, uint64_t tail, uint64_t head) const {
+    uint64_t result = tail;
+    if (head == tail) return result;
+    uint64_t stride = header->index_stride;
+    for (uint64_t block = tail / stride; block <= (head - 1) / stride; block++) {
+        ring_index_t entry = load_entry(index[block % header->index_slots]);
+        if (entry.offset / stride != block || entry.offset < tail || entry.offset >= head) continue;
+        //records are appended in time order, so the window starts after the last slice starting before it
+        if (stamp_of(clock, entry.mono_ns, entry.real_ns) >= time) break;
+        result = entry.offset;
+    }
+    return result;
+}
+
+uint64_t RingLog::next_indexed(uint64_t offset, uint64_t tail, uint64_t head) const {
+    uint64_t stride = header->index_stride;
+    for (uint64_t block = offset / stride + 1; head && block <= (head - 1) / stride; block++) {
+        ring_index_t entry = load_entry(index[block % header->index_slots]);
+        if (entry.offset / stride == block && entry.offset > offset && entry.offset >= tail && entry.offset < head)
+            return entry.offset;
+    }
+    return head;
+}
+
+ring_stamp_t RingLog::now() {
+    timespec mono{}, real{};
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    ring_stamp_t stamp;
+    stamp.mono_ns = mono.tv_sec * 1000000000ll + mono.tv_nsec;
+    stamp.real_ns = real.tv_sec * 1000000000ll + real.tv_nsec;
+    return stamp;
+}
+
+void RingLog::append(const ring_stamp_t &stamp, const char *data, std::size_t len) {
+    if (!writable) return;
+    len = min(len, ringLogMaxLine);
+    uint64_t capacity = header->capacity;
+    uint64_t size = record_size(len);
+    uint64_t position = header->head;
+    //records are never split, one not fitting the end of the ring starts at the beginning
+    uint64_t left = capacity - position % capacity;
+    uint64_t padding = left < size ? left : 0;
+
+    //drop the oldest records, before overwriting them
+    uint64_t tail = header->tail;
+    if (position + padding + size - tail > capacity) {
+        while (position + padding + size - tail > capacity)
+            tail = skip_record(tail);
+        __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    if (padding) {
+        if (padding >= sizeof(ring_record_t)) {
+            ring_record_t filler{};
+            filler.flags = ringPadding;
+            memcpy(ring + position % capacity, &filler, sizeof(filler));
+        }
+        position += padding;
+    }
+    ring_record_t record{};
+    record.length = static_cast<uint32_t>(len);
+    record.seq = header->next_seq;
+    record.mono_ns = stamp.mono_ns;
+    record.real_ns = stamp.real_ns;
+    record.crc = record_crc(record, data);
+    uint8_t *target = ring + position % capacity;
+    memcpy(target, &record, sizeof(record));
+    memcpy(target + sizeof(record), data, len);
+
+    uint64_t block = position / header->index_stride;
+    ring_index_t &entry = index[block % header->index_slots];
+    //the slot may hold a slice of a previous lap, or one discarded by the recovery
+    if (entry.offset / header->index_stride != block || entry.offset > position || (!entry.mono_ns && !entry.real_ns))
+        store_entry(entry, position, stamp);
+
+    //publish the record only once it is complete
+    __atomic_store_n(&header->last, position, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->next_seq, record.seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->head, position + size, __ATOMIC_RELEASE);
+}
+
+void RingLog::read(clock_id clock, int64_t from, int64_t to,
+                   const std::function<bool(const line_t &)> &callback) const {
+    uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint64_t position = seek(clock, from, tail, head);
+    line_t line{};
+    string storage;
+    while (position < head) {
+        //a live writer may have overtaken the reader
+        tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+        if (position < tail) position = tail;
+        uint64_t next = skip_padding(position);
+        if (next != position) {
+            position = next;
+            continue;
+        }
+        if (!read_record(position, line, storage, next)) {
+            //resync at the next slice, since the length of a damaged record cannot be trusted
+            position = next_indexed(position, tail, head);
+            continue;
+        }
+        position = next;
+        int64_t time = stamp_of(clock, line.stamp.mono_ns, line.stamp.real_ns);
+        if (time < from) continue;
+        if (time > to || !callback(line)) break;
+    }
+}
+
+RingLog::info_t RingLog::get_info() const {
+    info_t info;
+    uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    info.capacity = header->capacity;
+    info.used = head - tail;
+    info.appended = __atomic_load_n(&header->next_seq, __ATOMIC_ACQUIRE);
+    line_t line{};
+    string storage;
+    uint64_t next;
+    uint64_t first = tail < head ? skip_padding(tail) : head;
+    if (first < head && read_record(first, line, storage, next)) {
+        info.first = line.stamp;
+        uint64_t first_seq = line.seq;
+        if (read_record(__atomic_load_n(&header->last, __ATOMIC_ACQUIRE), line, storage, next)) {
+            info.last = line.stamp;
+            info.lines = line.seq - first_seq + 1;
+        }
+    }
+    return info;
+}
@@ -0,0 +1,189 @@
+#ifndef WANDSTEM_FLASH_UTILITY_RINGLOG_H
+#define WANDSTEM_FLASH_UTILITY_RINGLOG_H
+
+#include <string>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+static const uint64_t ringLogMagic=0x31474f4c474e4952ull; //"RINGLOG1"
+static const uint32_t ringLogVersion=1;
+static const std::size_t ringLogIndexSlots=4096;
+static const std::size_t ringLogMaxLine=4096;
+static const uint64_t ringLogMinCapacity=1024*1024;
+static const uint64_t ringLogDefaultCapacity=256*1024*1024;
+
+struct ring_header_t;
+struct ring_record_t;
+struct ring_index_t;
+
+///A pair of host timestamps, in nanoseconds.
+struct ring_stamp_t {
+    ///CLOCK_MONOTONIC: steady within a boot of the host, for measuring intervals.
+    int64_t mono_ns = 0;
+    ///CLOCK_REALTIME: wall clock time since the epoch, for matching other logs.
+    int64_t real_ns = 0;
+};
+
+/**
+ * This class models a fixed-size log of timestamped lines, stored in a memory-mapped file used as a ring: when it is
+ * full the oldest lines are overwritten.
+ * Appending a line is a copy into the mapping and a CRC, with no system call: the kernel writes the pages back.
+ * The file survives a crash of the writer at any point: the header is updated only after a record is complete, every
+ * record carries a CRC, and a small index records the first line of every 1/ringLogIndexSlots of the ring, which
+ * locates a point in time reading only the index and a single slice of the ring.
+ * One process at a time can write a file, any number can read it, even while it is being written.
+ */
+class RingLog {
+public:
+    ///The clocks a time window can be selected by.
+    enum clock_id {
+        REALTIME, MONOTONIC
+    };
+
+    ///A line read back from the log. The data is valid only during the callback.
+    struct line_t {
+        uint64_t seq;
+        ring_stamp_t stamp;
+        const char *data;
+        std::size_t length;
+    };
+
+    ///A summary of the content of the log.
+    struct info_t {
+        uint64_t capacity = 0;
+        uint64_t used = 0;
+        uint64_t lines = 0;
+        ///The total number of lines ever appended, including the overwritten ones.
+        uint64_t appended = 0;
+        ring_stamp_t first;
+        ring_stamp_t last;
+    };
+
+private:
+    std::string path;
+
+    int fd = -1;
+
+    bool writable;
+
+    ///The mapping of the whole file.
+    uint8_t *mapping = nullptr;
+
+    std::size_t mapped_length = 0;
+
+    ring_header_t *header = nullptr;
+
+    ring_index_t *index = nullptr;
+
+    ///The ring itself, header->capacity bytes.
+    uint8_t *ring = nullptr;
+
+    /**
+     * Maps the file, creating or resetting it if it does not hold a valid log.
+     * \throws FileIOException If the file could not be opened or mapped.
+     * \return
+     */
+    void map(uint64_t capacity);
+
+    /**
+     * Brings the header back in line with the records after a crash, checking the last slice of the ring.
+     * \return
+     */
+    void recover();
+
+    /**
+     * Copies the record at a logical offset and checks it.
+     * \param offset the logical offset, tail <= offset < head
+     * \param line where the record is described
+     * \param storage where the payload is copied
+     * \param next where the offset of the following record is stored
+     * \return false if the record is damaged or overwritten.
+     */
+    bool read_record(uint64_t offset, line_t &line, std::string &storage, uint64_t &next) const;
+
+    /**
+     * Skips the unused end of the ring, if an offset is there.
+     * \return the offset, or the one of the beginning of the ring.
+     */
+    uint64_t skip_padding(uint64_t offset) const;
+
+    /**
+     * Finds the offset of the record following another, without checking it.
+     * \return the offset.
+     */
+    uint64_t skip_record(uint64_t offset) const;
+
+    /**
+     * Finds the indexed record closest to a point in time, from below.
+     * \param clock the clock the time refers to
+     * \param time the time in nanoseconds
+     * \param tail the oldest valid offset
+     * \param head the offset past the newest record
+     * \return the offset of the record, tail if none is older than the time.
+     */
+    uint64_t seek(clock_id clock, int64_t time, uint64_t tail, uint64_t head) const;
+
+    /**
+     * Finds the first indexed record after an offset, to resync after a damaged record.
+     * \return the offset of the record, head if none.
+     */
+    uint64_t next_indexed(uint64_t offset, uint64_t tail, uint64_t head) const;
+
+public:
+    /**
+     * Constructor. Opens a log for writing, creating it if needed; an existing log keeps its capacity.
+     * \throws FileIOException If the file could not be created, mapped or is in use by another writer.
+     * \param path the path of the file
+     * \param capacity the bytes reserved to the lines, used only when the file is created
+     * \return
+     */
+    RingLog(const std::string &path, uint64_t capacity);
+
+    /**
+     * Constructor. Opens an existing log for reading.
+     * \throws FileIOException If the file could not be opened or it is not a log.
+     * \param path the path of the file
+     * \return
+     */
+    explicit RingLog(const std::string &path);
+
+    RingLog(RingLog const &) = delete;
+
+    void operator=(RingLog const &) = delete;
+
+    ~RingLog();
+
+    /**
+     * Reads both host clocks.
+     * \return the current time.
+     */
+    static ring_stamp_t now();
+
+    /**
+     * Appends a line, overwriting the oldest ones if needed.
+     * \param stamp when the line started
+     * \param data the line, without terminator
+     * \param len the length of the line, longer lines are truncated to ringLogMaxLine
+     * \return
+     */
+    void append(const ring_stamp_t &stamp, const char *data, std::size_t len);
+
+    /**
+     * Reads the lines in a time window, in the order they were appended. Damaged records are skipped.
+     * \param clock the clock the window refers to
+     * \param from the start of the window in nanoseconds, inclusive
+     * \param to the end of the window in nanoseconds, inclusive
+     * \param callback called for every line, returns false to stop
+     * \return
+     */
+    void read(clock_id clock, int64_t from, int64_t to, const std::function<bool(const line_t &)> &callback) const;
+
+    /**
+     * Summarizes the content of the log.
+     * \return the summary.
+     */
+    info_t get_info() const;
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_RINGLOG_H
@@ -0,0 +1,249 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "SerialPort.h"
+#include <chrono>
+#include <mutex>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <unistd.h>
+
+using namespace std;
+namespace asio = boost::asio;
+
+namespace {
+
+///The pipe made readable by interrupt_all, never drained so that it keeps every later operation aborted.
+int interrupt_pipe[2] = {-1, -1};
+atomic<int> interrupt_fd(-1);
+atomic<bool> interrupt_requested(false);
+once_flag interrupt_pipe_once;
+
+int watch_interrupts() {
+    call_once(interrupt_pipe_once, [] {
+        if (pipe(interrupt_pipe)) return;
+        fcntl(interrupt_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(interrupt_pipe[1], F_SETFD, FD_CLOEXEC);
+        interrupt_fd = interrupt_pipe[1];
+    });
+    return interrupt_pipe[0] < 0 ? -1 : dup(interrupt_pipe[0]);
+}
+
+/// The time left before a deadline, rounded up, 0 for an infinite timeout.
+int time_left(const chrono::steady_clock::time_point &end, int timeout_msec) {
+    if (timeout_msec <= 0) return 0;
+    auto left = chrono::duration_cast<chrono::milliseconds>(end - chrono::steady_clock::now() +
+                                                            chrono::microseconds(999)).count();
+    if (left <= 0) throw TimeoutException("Timeout expired");
+    return static_cast<int>(left);
+}
+
+}
+
+SerialPort::SerialPort() : own_io(new asio::io_context), io(*own_io), port(io), timer(io), interrupt_watch(io) {
+    int fd = watch_interrupts();
+    if (fd >= 0) interrupt_watch.assign(fd);
+}
+
+SerialPort::SerialPort(boost::asio::io_context &io) : io(io), port(io), timer(io), interrupt_watch(io) {}
+
+bool SerialPort::is_present(const std::string &path) const {
+    struct stat buffer{};
+    return stat(path.c_str(), &buffer) == 0;
+}
+
+void SerialPort::open(const std::string &path, unsigned int baud) {
+    boost::system::error_code ec;
+    port.open(path, ec);
+    if (!ec) port.set_option(asio::serial_port::baud_rate(baud), ec);
+    if (!ec) port.set_option(asio::serial_port::character_size(8), ec);
+    if (!ec) port.set_option(asio::serial_port::parity(asio::serial_port::parity::none), ec);
+    if (!ec) port.set_option(asio::serial_port::stop_bits(asio::serial_port::stop_bits::one), ec);
+    if (!ec) port.set_option(asio::serial_port::flow_control(asio::serial_port::flow_control::none), ec);
+    if (ec) {
+        close();
+        throw ios_base::failure("Cannot open " + path + ": " + ec.message());
+    }
+    discard_input();
+}
+
+void SerialPort::close() {
+    boost::system::error_code ec;
+    port.close(ec);
+    rx.clear();
+    rx_pos = 0;
+}
+
+void SerialPort::set_baud(unsigned int baud) {
+    boost::system::error_code ec;
+    port.set_option(asio::serial_port::baud_rate(baud), ec);
+    if (ec)
+        throw ios_base::failure("Cannot set " + to_string(baud) + " baud: " + ec.message());
+    discard_input();
+}
+
+void SerialPort::discard_input() {
+    rx.clear();
+    rx_pos = 0;
+    if (port.is_open()) tcflush(port.native_handle(), TCIFLUSH);
+}
+
+void SerialPort::cancel() {
+    boost::system::error_code ec;
+    port.cancel(ec);
+}
+
+template<typename Start>
+std::size_t SerialPort::run(Start start, int timeout_msec, bool interruptible) {
+    boost::system::error_code result = asio::error::would_block;
+    size_t transferred = 0;
+    bool timed_out = false;
+    bool was_interrupted = false;
+    //the handlers refer to this frame, all of them must have run before returning
+    int pending = 1;
+    start([&](const boost::system::error_code &ec, size_t n) {
+        result = ec;
+        transferred = n;
+        pending--;
+    });
+    if (timeout_msec > 0) {
+        pending++;
+        timer.expires_after(chrono::milliseconds(timeout_msec));
+        timer.async_wait([&](const boost::system::error_code &ec) {
+            pending--;
+            if (ec || result != asio::error::would_block) return;
+            timed_out = true;
+            cancel();
+        });
+    }
+    if (interruptible && interrupt_watch.is_open()) {
+        pending++;
+        interrupt_watch.async_wait(asio::posix::stream_descriptor::wait_read, [&](const boost::system::error_code &ec) {
+            pending--;
+            if (ec || result != asio::error::would_block) return;
+            was_interrupted = true;
+            cancel();
+        });
+    }
+    io.restart();
+    while (result == asio::error::would_block) io.run_one();
+    timer.cancel();
+    if (interrupt_watch.is_open()) interrupt_watch.cancel();
+    while (pending) io.run_one();
+    if (!result) return transferred;
+    if (was_interrupted) throw InterruptedException("Interrupted");
+    if (timed_out) throw TimeoutException("Timeout expired");
+    throw ios_base::failure(result.message());
+}
+
+void SerialPort::fill(int timeout_msec) {
+    //the bytes already consumed make room for the new ones
+    rx.erase(rx.begin(), rx.begin() + rx_pos);
+    rx_pos = 0;
+    size_t old_size = rx.size();
+    rx.resize(old_size + serialReadChunk);
+    size_t got;
+    try {
+        got = run([this, old_size](std::function<void(const boost::system::error_code &, size_t)> handler) {
+            port.async_read_some(asio::buffer(rx.data() + old_size, serialReadChunk), handler);
+        }, timeout_msec, true);
+    } catch (ios_base::failure &ex) {
+        rx.resize(old_size);
+        throw;
+    }
+    rx.resize(old_size + got);
+}
+
+void SerialPort::read(void *data, std::size_t len, int timeout_msec) {
+    auto end = chrono::steady_clock::now() + chrono::milliseconds(timeout_msec);
+    auto out = static_cast<char *>(data);
+    while (len) {
+        if (rx_pos == rx.size()) fill(time_left(end, timeout_msec));
+        size_t n = min(len, rx.size() - rx_pos);
+        memcpy(out, rx.data() + rx_pos, n);
+        rx_pos += n;
+        out += n;
+        len -= n;
+    }
+}
+
+std::size_t SerialPort::read_some(void *data, std::size_t len, int timeout_msec) {
+    if (!len) return 0;
+    if (rx_pos < rx.size()) {
+        size_t n = min(len, rx.size() - rx_pos);
+        memcpy(data, rx.data() + rx_pos, n);
+        rx_pos += n;
+        return n;
+    }
+    //nothing buffered, the bytes go straight to the caller
+    return run([this, data, len](std::function<void(const boost::system::error_code &, size_t)> handler) {
+        port.async_read_some(asio::buffer(data, len), handler);
+    }, timeout_msec, true);
+}
+
+std::string SerialPort::read_line(int timeout_msec) {
+    auto end = chrono::steady_clock::now() + chrono::milliseconds(timeout_msec);
+    //how many pending bytes were already searched for the terminator
+    size_t scanned = 0;
+    for (;;) {
+        const char *begin = rx.data() + rx_pos;
+        size_t pending = rx.size() - rx_pos;
+        auto newline = pending > scanned ? static_cast<const char *>(memchr(begin + scanned, '\n', pending - scanned))
+                                         : nullptr;
+        if (newline != nullptr) {
+            string line(begin, newline);
+            rx_pos += static_cast<size_t>(newline - begin) + 1;
+            return line;
+        }
+        scanned = pending;
+        fill(time_left(end, timeout_msec));
+    }
+}
+
+void SerialPort::write(const void *data, std::size_t len, int timeout_msec) {
+    run([this, data, len](std::function<void(const boost::system::error_code &, size_t)> handler) {
+        asio::async_write(port, asio::buffer(data, len), handler);
+    }, timeout_msec, false);
+}
+
+void SerialPort::write(const struct iovec *buffers, int count, int timeout_msec) {
+    vector<asio::const_buffer> sequence;
+    sequence.reserve(static_cast<size_t>(count));
+    for (int i = 0; i < count; i++)
+        sequence.emplace_back(buffers[i].iov_base, buffers[i].iov_len);
+    run([this, &sequence](std::function<void(const boost::system::error_code &, size_t)> handler) {
+        asio::async_write(port, sequence, handler);
+    }, timeout_msec, false);
+}
+
+void SerialPort::interrupt_all() {
+    interrupt_requested = true;
+    int fd = interrupt_fd;
+    if (fd >= 0) {
+        ssize_t ignored = ::write(fd, "!", 1);
+        (void) ignored;
+    }
+}
+
+int SerialPort::interrupt_descriptor() {
+    return watch_interrupts();
+}
+
+bool SerialPort::interrupted() {
+    return interrupt_requested;
+}
@@ -0,0 +1,213 @@
+#ifndef WANDSTEM_FLASH_UTILITY_SERIALPORT_H
+#define WANDSTEM_FLASH_UTILITY_SERIALPORT_H
+
+#include <ios>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <boost/asio.hpp>
+#include "Transport.h"
+
+static const std::size_t serialReadChunk=4096;
+
+/**
+ * This class drives a serial port through boost::asio, giving every operation its own deadline.
+ * The blocking operations run the io_context of the port until they complete, time out or get interrupted, so a
+ * port sharing its io_context with others must only be used through the asynchronous operations, by the thread
+ * running that io_context: this way one thread can drive many ports.
+ */
+class SerialPort : public Transport {
+
+private:
+    ///The io_context owned by the port, if not shared.
+    std::unique_ptr<boost::asio::io_context> own_io;
+
+    boost::asio::io_context &io;
+
+    boost::asio::serial_port port;
+
+    ///The deadline of the operation in progress.
+    boost::asio::steady_timer timer;
+
+    ///Becomes readable when interrupt_all is called.
+    boost::asio::posix::stream_descriptor interrupt_watch;
+
+    ///The bytes received and not consumed yet.
+    std::vector<char> rx;
+
+    ///The position of the next byte to be consumed in rx.
+    std::size_t rx_pos = 0;
+
+    /**
+     * Runs an asynchronous operation until it completes, the timeout expires or interrupt_all is called.
+     * \throws TimeoutException If the timeout expired.
+     * \throws InterruptedException If interrupt_all was called and interruptible is set.
+     * \throws std::ios_base::failure If the operation failed.
+     * \param start starts the operation, given its completion handler
+     * \param timeout_msec the deadline, 0 for infinite
+     * \param interruptible if interrupt_all aborts the operation
+     * \return the number of bytes transferred.
+     */
+    template<typename Start>
+    std::size_t run(Start start, int timeout_msec, bool interruptible);
+
+    /**
+     * Receives more bytes, appending them to rx.
+     * \param timeout_msec the deadline, 0 for infinite
+     * \return
+     */
+    void fill(int timeout_msec);
+
+public:
+    /**
+     * Constructor. The port gets its own io_context, for the blocking operations.
+     */
+    SerialPort();
+
+    /**
+     * Constructor. The port shares the io_context, for the asynchronous operations.
+     * \param io the io_context, which must outlive the port
+     */
+    explicit SerialPort(boost::asio::io_context &io);
+
+    SerialPort(SerialPort const &) = delete;
+
+    void operator=(SerialPort const &) = delete;
+
+    /**
+     * Checks if the tty exists.
+     * \param path the path of the tty
+     * \return if the path exists.
+     */
+    bool is_present(const std::string &path) const override;
+
+    /**
+     * Opens the port, raw 8N1 without flow control.
+     * \throws std::ios_base::failure If the port could not be opened.
+     * \param path the path of the tty
+     * \param baud the baud rate
+     * \return
+     */
+    void open(const std::string &path, unsigned int baud) override;
+
+    /**
+     * Checks if the port is open.
+     * \return if the port is open.
+     */
+    bool is_open() const override { return port.is_open(); }
+
+    /**
+     * Closes the port, if open.
+     * \return
+     */
+    void close() override;
+
+    /**
+     * Changes the baud rate of the open port, discarding what was not read yet.
+     * \throws std::ios_base::failure If the baud rate is not supported.
+     * \return
+     */
+    void set_baud(unsigned int baud) override;
+
+    /**
+     * Discards the bytes received and not read yet.
+     * \return
+     */
+    void discard_input() override;
+
+    /**
+     * Counts the bytes already received and not read yet, which read returns without waiting.
+     * \return the number of bytes.
+     */
+    std::size_t buffered() const override { return rx.size() - rx_pos; }
+
+    /**
+     * Reads exactly len bytes.
+     * \throws TimeoutException If the bytes did not arrive within the timeout.
+     * \throws InterruptedException If interrupt_all was called.
+     * \param timeout_msec the deadline for the whole read, 0 for infinite
+     * \return
+     */
+    void read(void *data, std::size_t len, int timeout_msec) override;
+
+    /**
+     * Reads the bytes available, waiting only if there are none.
+     * \throws TimeoutException If nothing arrived within the timeout.
+     * \throws InterruptedException If interrupt_all was called.
+     * \param data where the bytes are stored
+     * \param len the maximum number of bytes
+     * \param timeout_msec the deadline, 0 for infinite
+     * \return the number of bytes read, at least one.
+     */
+    std::size_t read_some(void *data, std::size_t len, int timeout_msec) override;
+
+    /**
+     * Reads a line, without its '\n' terminator.
+     * \throws TimeoutException If the line was not completed within the timeout.
+     * \throws InterruptedException If interrupt_all was called.
+     * \param timeout_msec the deadline for the whole line, 0 for infinite
+     * \return the line.
+     */
+    std::string read_line(int timeout_msec) override;
+
+    /**
+     * Writes a buffer.
+     * \throws TimeoutException If the bytes could not be written within the timeout.
+     * \param timeout_msec the deadline, 0 for infinite
+     * \return
+     */
+    void write(const void *data, std::size_t len, int timeout_msec = 0) override;
+
+    /**
+     * Writes several buffers with a single gather write.
+     * \throws TimeoutException If the bytes could not be written within the timeout.
+     * \param timeout_msec the deadline, 0 for infinite
+     * \return
+     */
+    void write(const struct iovec *buffers, int count, int timeout_msec = 0) override;
+
+    /**
+     * Starts reading some bytes, for ports sharing their io_context.
+     * \param data where the bytes are stored
+     * \param len the maximum number of bytes
+     * \param handler called as handler(error_code, bytes_read) by the thread running the io_context
+     * \return
+     */
+    template<typename Handler>
+    void async_read_some(char *data, std::size_t len, Handler handler) {
+        port.async_read_some(boost::asio::buffer(data, len), handler);
+    }
+
+    /**
+     * Cancels the asynchronous operations in progress.
+     * \return
+     */
+    void cancel();
+
+    /**
+     * Gets the io_context driving the port.
+     * \return the io_context.
+     */
+    boost::asio::io_context &get_io_context() { return io; }
+
+    /**
+     * Aborts the blocking reads in progress and to come on every port. It is async-signal-safe.
+     * \return
+     */
+    static void interrupt_all();
+
+    /**
+     * Creates a descriptor becoming readable when interrupt_all is called, for waiting on it in an event loop.
+     * \return the descriptor, owned by the caller, or -1 on failure.
+     */
+    static int interrupt_descriptor();
+
+    /**
+     * Checks if interrupt_all was called.
+     * \return if the ports were interrupted.
+     */
+    static bool interrupted();
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_SERIALPORT_H
@@ -0,0 +1,93 @@
+#ifndef WANDSTEM_FLASH_UTILITY_SPSCRING_H
+#define WANDSTEM_FLASH_UTILITY_SPSCRING_H
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+/**
+ * A bounded lock-free queue for exactly one producer thread and one consumer thread.
+ * \tparam T the type of the queued items, which must be default constructible and movable.
+ */
+template<typename T>
+class SpscRing {
+private:
+    /// The storage, whose size is a power of two.
+    std::vector<T> slots;
+
+    /// The mask turning a position into a slot index.
+    std::size_t mask;
+
+    /// The position of the next item to be popped, written only by the consumer.
+    std::atomic<std::size_t> head;
+
+    /// Keeps head and tail on different cache lines.
+    char padding[64];
+
+    /// The position of the next item to be pushed, written only by the producer.
+    std::atomic<std::size_t> tail;
+
+    static std::size_t round_capacity(std::size_t capacity) {
+        std::size_t size = 1;
+        while (size < capacity) size <<= 1;
+        return size;
+    }
+
+public:
+    /**
+     * Constructor.
+     * \param capacity the minimum number of items the ring can hold, rounded up to a power of two
+     * \return
+     */
+    explicit SpscRing(std::size_t capacity) : slots(round_capacity(capacity)), mask(slots.size() - 1), head(0),
+                                              tail(0) {}
+
+    SpscRing(SpscRing const &) = delete;
+
+    void operator=(SpscRing const &) = delete;
+
+    /**
+     * Pushes an item, to be called only by the producer.
+     * \param item the item, moved into the ring on success
+     * \return false if the ring is full.
+     */
+    bool try_push(T &item) {
+        std::size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size()) return false;
+        slots[t & mask] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Pops an item, to be called only by the consumer.
+     * \param item where the item is moved
+     * \return false if the ring is empty.
+     */
+    bool try_pop(T &item) {
+        std::size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        item = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Checks if the ring is empty. It is exact only when called by the consumer.
+     * \return if there are no items.
+     */
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Checks if the ring is full. It is exact only when called by the producer.
+     * \return if no item can be pushed.
+     */
+    bool full() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire) == slots.size();
+    }
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_SPSCRING_H
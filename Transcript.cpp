@@ -0,0 +1,479 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "Transcript.h"
+#include "SerialPort.h"
+#include "Exceptions.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+void put_varint(vector<uint8_t> &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+bool get_varint(const string &in, size_t &pos, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+        auto byte = static_cast<uint8_t>(in[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+template<typename T>
+void put_raw(vector<uint8_t> &out, T value) {
+    auto bytes = reinterpret_cast<const uint8_t *>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(value));
+}
+
+/// If the events of a kind carry a value.
+bool has_value(Transcript::event_kind kind) {
+    return kind != Transcript::CLOSE && kind != Transcript::DISCARD && kind != Transcript::TX &&
+           kind != Transcript::RX;
+}
+
+/// The time left before a deadline, at least a millisecond, 0 for an infinite timeout.
+int time_left(const chrono::steady_clock::time_point &end, int timeout_msec) {
+    if (timeout_msec <= 0) return 0;
+    auto left = chrono::duration_cast<chrono::milliseconds>(end - chrono::steady_clock::now() +
+                                                            chrono::microseconds(999)).count();
+    //an expired deadline still goes through fill, so that the timeout is part of the transcript
+    return static_cast<int>(max<int64_t>(left, 1));
+}
+
+/// Describes some bytes: the first ones in hexadecimal, printable ones also as characters.
+string describe_bytes(const char *data, size_t len) {
+    ostringstream out;
+    for (size_t i = 0; i < len && i < 16; i++) {
+        auto c = static_cast<unsigned char>(data[i]);
+        out << (i ? " " : "") << hex << uppercase;
+        if (c < 0x10) out << '0';
+        out << static_cast<unsigned int>(c) << dec;
+        if (isprint(c)) out << "'" << data[i] << "'";
+    }
+    if (len > 16) out << " ...";
+    out << " (" << len << " bytes)";
+    return out.str();
+}
+
+string describe_event(const Transcript::event_t &event) {
+    switch (event.kind) {
+        case Transcript::OPEN:
+            return "opened " + event.data + " at " + to_string(event.value) + " baud";
+        case Transcript::BAUD:
+            return "switched to " + to_string(event.value) + " baud";
+        case Transcript::TX:
+            return "sent " + describe_bytes(event.data.data(), event.data.size());
+        case Transcript::RX:
+            return "received " + describe_bytes(event.data.data(), event.data.size());
+        case Transcript::ERROR:
+            return "failed: " + event.data;
+        default:
+            return Transcript::kind_name(event.kind);
+    }
+}
+
+}
+
+std::vector<Transcript::event_t> Transcript::load(const std::string &path) {
+    ifstream in(path, ios::binary);
+    if (!in)
+        throw FileIOException("Cannot open " + path);
+    string content((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    uint64_t magic = 0;
+    uint32_t version = 0;
+    const size_t header_size = sizeof(magic) + sizeof(version) + sizeof(int64_t);
+    if (content.size() >= header_size) {
+        memcpy(&magic, content.data(), sizeof(magic));
+        memcpy(&version, content.data() + sizeof(magic), sizeof(version));
+    }
+    if (magic != transcriptMagic)
+        throw FileIOException(path + " is not a transcript");
+    if (version != transcriptVersion)
+        throw FileIOException(path + " has an unsupported transcript version");
+
+    vector<event_t> events;
+    size_t pos = header_size;
+    int64_t time_ns = 0;
+    while (pos < content.size()) {
+        event_t event;
+        auto kind = static_cast<uint8_t>(content[pos++]);
+        if (kind > ERROR)
+            throw FileIOException(path + " is damaged at offset " + to_string(pos - 1));
+        event.kind = static_cast<event_kind>(kind);
+        uint64_t delta, len = 0;
+        event.value = 0;
+        if (!get_varint(content, pos, delta)) break;
+        event.time_ns = time_ns += static_cast<int64_t>(delta);
+        if (has_value(event.kind) && !get_varint(content, pos, event.value)) break;
+        if (event.kind == OPEN || event.kind == TX || event.kind == RX || event.kind == ERROR) {
+            if (!get_varint(content, pos, len) || len > content.size() - pos) break;
+            event.data.assign(content, pos, len);
+            pos += len;
+        }
+        events.push_back(move(event));
+    }
+    return events;
+}
+
+const char *Transcript::kind_name(event_kind kind) {
+    static const char *const names[] = {"open", "close", "baud", "discard", "tx", "rx", "timeout", "interrupt",
+                                        "error"};
+    return names[kind];
+}
+
+void TranscriptTransport::append(const char *data, std::size_t len) {
+    rx.erase(rx.begin(), rx.begin() + rx_pos);
+    rx_pos = 0;
+    rx.insert(rx.end(), data, data + len);
+}
+
+void TranscriptTransport::read(void *data, std::size_t len, int timeout_msec) {
+    auto end = chrono::steady_clock::now() + chrono::milliseconds(timeout_msec);
+    auto out = static_cast<char *>(data);
+    while (len) {
+        if (rx_pos == rx.size()) fill(time_left(end, timeout_msec));
+        size_t n = min(len, rx.size() - rx_pos);
+        memcpy(out, rx.data() + rx_pos, n);
+        rx_pos += n;
+        out += n;
+        len -= n;
+    }
+}
+
+std::size_t TranscriptTransport::read_some(void *data, std::size_t len, int timeout_msec) {
+    if (!len) return 0;
+    if (rx_pos == rx.size()) fill(timeout_msec);
+    size_t n = min(len, rx.size() - rx_pos);
+    memcpy(data, rx.data() + rx_pos, n);
+    rx_pos += n;
+    return n;
+}
+
+std::string TranscriptTransport::read_line(int timeout_msec) {
+    auto end = chrono::steady_clock::now() + chrono::milliseconds(timeout_msec);
+    size_t scanned = 0;
+    for (;;) {
+        const char *begin = rx.data() + rx_pos;
+        size_t pending = rx.size() - rx_pos;
+        auto newline = pending > scanned ? static_cast<const char *>(memchr(begin + scanned, '\n', pending - scanned))
+                                         : nullptr;
+        if (newline != nullptr) {
+            string line(begin, newline);
+            rx_pos += static_cast<size_t>(newline - begin) + 1;
+            return line;
+        }
+        scanned = pending;
+        fill(time_left(end, timeout_msec));
+    }
+}
+
+RecordingTransport::RecordingTransport(std::unique_ptr<Transport> inner, const std::string &path)
+        : inner(std::move(inner)), start(chrono::steady_clock::now()) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw FileIOException("Cannot create " + path + ": " + strerror(errno));
+    buffer.reserve(transcriptBufferSize + transcriptReadChunk);
+    put_raw(buffer, transcriptMagic);
+    put_raw(buffer, transcriptVersion);
+    put_raw(buffer, static_cast<int64_t>(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::system_clock::now().time_since_epoch()).count()));
+}
+
+RecordingTransport::~RecordingTransport() {
+    flush();
+    ::close(fd);
+}
+
+void RecordingTransport::log(Transcript::event_kind kind, uint64_t value, const void *data, std::size_t len) {
+    auto now_ns = static_cast<int64_t>(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - start).count());
+    buffer.push_back(static_cast<uint8_t>(kind));
+    put_varint(buffer, static_cast<uint64_t>(now_ns - last_ns));
+    last_ns = now_ns;
+    if (has_value(kind)) put_varint(buffer, value);
+    if (kind == Transcript::OPEN || kind == Transcript::TX || kind == Transcript::RX || kind == Transcript::ERROR) {
+        put_varint(buffer, len);
+        auto bytes = static_cast<const uint8_t *>(data);
+        buffer.insert(buffer.end(), bytes, bytes + len);
+    }
+    if (buffer.size() >= transcriptBufferSize) flush();
+}
+
+void RecordingTransport::flush() {
+    const uint8_t *data = buffer.data();
+    size_t len = buffer.size();
+    while (len && error.empty()) {
+        ssize_t written = ::write(fd, data, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) {
+            //the traffic must not suffer from a full disk, the recording just stops
+            error = strerror(errno);
+            break;
+        }
+        data += written;
+        len -= static_cast<size_t>(written);
+    }
+    buffer.clear();
+}
+
+template<typename Operation>
+void RecordingTransport::logged(Transcript::event_kind kind, Operation operation) {
+    try {
+        operation();
+    } catch (TimeoutException &ex) {
+        log(Transcript::TIMEOUT, kind);
+        flush();
+        throw;
+    } catch (InterruptedException &ex) {
+        log(Transcript::INTERRUPT, kind);
+        flush();
+        throw;
+    } catch (ios_base::failure &ex) {
+        log(Transcript::ERROR, kind, ex.what(), strlen(ex.what()));
+        flush();
+        throw;
+    }
+}
+
+void RecordingTransport::fill(int timeout_msec) {
+    char chunk[transcriptReadChunk];
+    size_t got = 0;
+    logged(Transcript::RX, [&] { got = inner->read_some(chunk, sizeof(chunk), timeout_msec); });
+    log(Transcript::RX, 0, chunk, got);
+    append(chunk, got);
+}
+
+void RecordingTransport::open(const std::string &path, unsigned int baud) {
+    clear_rx();
+    log(Transcript::OPEN, baud, path.data(), path.size());
+    logged(Transcript::OPEN, [&] { inner->open(path, baud); });
+}
+
+void RecordingTransport::close() {
+    clear_rx();
+    inner->close();
+    log(Transcript::CLOSE);
+    flush();
+}
+
+void RecordingTransport::set_baud(unsigned int baud) {
+    clear_rx();
+    log(Transcript::BAUD, baud);
+    logged(Transcript::BAUD, [&] { inner->set_baud(baud); });
+}
+
+void RecordingTransport::discard_input() {
+    clear_rx();
+    inner->discard_input();
+    log(Transcript::DISCARD);
+}
+
+void RecordingTransport::write(const void *data, std::size_t len, int timeout_msec) {
+    log(Transcript::TX, 0, data, len);
+    logged(Transcript::TX, [&] { inner->write(data, len, timeout_msec); });
+}
+
+void RecordingTransport::write(const struct iovec *buffers, int count, int timeout_msec) {
+    string frame;
+    for (int i = 0; i < count; i++)
+        frame.append(static_cast<const char *>(buffers[i].iov_base), buffers[i].iov_len);
+    log(Transcript::TX, 0, frame.data(), frame.size());
+    logged(Transcript::TX, [&] { inner->write(buffers, count, timeout_msec); });
+}
+
+ReplayTransport::ReplayTransport(const std::string &path, bool realtime)
+        : events(Transcript::load(path)), realtime(realtime), anchor(chrono::steady_clock::now()) {}
+
+std::string ReplayTransport::get_recorded_path() const {
+    for (auto &event : events)
+        if (event.kind == Transcript::OPEN) return event.data;
+    return "";
+}
+
+unsigned int ReplayTransport::get_recorded_baud() const {
+    for (auto &event : events)
+        if (event.kind == Transcript::OPEN) return static_cast<unsigned int>(event.value);
+    return 0;
+}
+
+void ReplayTransport::diverge(const std::string &what) {
+    if (divergence.empty()) {
+        ostringstream out;
+        out << "at event " << next << " of " << events.size();
+        if (next && next <= events.size())
+            out << " (" << fixed << events[next - 1].time_ns / 1e9 << " s)";
+        out << " the utility " << what;
+        divergence = out.str();
+    }
+    throw TranscriptDivergenceException(divergence);
+}
+
+const Transcript::event_t &ReplayTransport::take(const std::string &operation) {
+    if (!divergence.empty()) throw TranscriptDivergenceException(divergence);
+    while (next < events.size() && events[next].kind == Transcript::CLOSE) next++;
+    if (next == events.size()) diverge(operation + ", after the end of the recording");
+    return events[next++];
+}
+
+const Transcript::event_t &ReplayTransport::expect(Transcript::event_kind kind, const std::string &operation) {
+    auto &event = take(operation);
+    if (event.kind != kind) diverge(operation + ", where the recording " + describe_event(event));
+    anchor = chrono::steady_clock::now();
+    anchor_ns = event.time_ns;
+    return event;
+}
+
+void ReplayTransport::replay_failure(Transcript::event_kind operation) {
+    if (next == events.size() || events[next].value != operation) return;
+    auto &event = events[next];
+    switch (event.kind) {
+        case Transcript::TIMEOUT:
+            next++;
+            wait_for(event);
+            throw TimeoutException("Timeout expired");
+        case Transcript::INTERRUPT:
+            next++;
+            throw InterruptedException("Interrupted");
+        case Transcript::ERROR:
+            next++;
+            throw ios_base::failure(event.data);
+        default:
+            return;
+    }
+}
+
+void ReplayTransport::wait_for(const Transcript::event_t &event) {
+    if (realtime) this_thread::sleep_until(anchor + chrono::nanoseconds(event.time_ns - anchor_ns));
+}
+
+void ReplayTransport::fill(int) {
+    if (SerialPort::interrupted()) throw InterruptedException("Interrupted");
+    if (!divergence.empty()) throw TranscriptDivergenceException(divergence);
+    while (next < events.size() && events[next].kind == Transcript::CLOSE) next++;
+    auto kind = next < events.size() ? events[next].kind : Transcript::CLOSE;
+    if (kind == Transcript::RX) {
+        auto &event = events[next++];
+        wait_for(event);
+        append(event.data.data(), event.data.size());
+        return;
+    }
+    if (kind == Transcript::TIMEOUT || kind == Transcript::INTERRUPT || kind == Transcript::ERROR) {
+        replay_failure(Transcript::RX);
+    }
+    //the recording did something else: its deadline expired before reading further
+    throw TimeoutException("Timeout expired");
+}
+
+void ReplayTransport::open(const std::string &path, unsigned int baud) {
+    auto &event = expect(Transcript::OPEN, "opened " + path + " at " + to_string(baud) + " baud");
+    if (event.value != baud)
+        diverge("opened " + path + " at " + to_string(baud) + " baud, the recording at " + to_string(event.value));
+    clear_rx();
+    tx.clear();
+    tx_pos = 0;
+    replay_failure(Transcript::OPEN);
+    opened = true;
+}
+
+void ReplayTransport::close() {
+    clear_rx();
+    if (next < events.size() && events[next].kind == Transcript::CLOSE) next++;
+    opened = false;
+}
+
+void ReplayTransport::set_baud(unsigned int baud) {
+    auto &event = expect(Transcript::BAUD, "switched to " + to_string(baud) + " baud");
+    if (event.value != baud)
+        diverge("switched to " + to_string(baud) + " baud, the recording to " + to_string(event.value));
+    clear_rx();
+    replay_failure(Transcript::BAUD);
+}
+
+void ReplayTransport::discard_input() {
+    expect(Transcript::DISCARD, "discarded the input");
+    clear_rx();
+}
+
+std::size_t ReplayTransport::buffered() const {
+    size_t count = rx.size() - rx_pos;
+    for (size_t i = next; i < events.size() && events[i].kind == Transcript::RX; i++)
+        count += events[i].data.size();
+    return count;
+}
+
+void ReplayTransport::write(const void *data, std::size_t len, int) {
+    auto bytes = static_cast<const char *>(data);
+    size_t done = 0;
+    while (done < len) {
+        if (tx_pos == tx.size()) {
+            tx = expect(Transcript::TX, "sent " + describe_bytes(bytes + done, len - done)).data;
+            tx_pos = 0;
+        }
+        size_t n = min(len - done, tx.size() - tx_pos);
+        auto differs = mismatch(bytes + done, bytes + done + n, tx.data() + tx_pos);
+        if (differs.first != bytes + done + n) {
+            //frames share most of their bytes, the description starts where they differ
+            size_t offset = static_cast<size_t>(differs.first - bytes);
+            size_t recorded = static_cast<size_t>(differs.second - tx.data());
+            diverge("sent " + describe_bytes(bytes + offset, len - offset) + " at byte " + to_string(offset) +
+                    ", where the recording sent " + describe_bytes(tx.data() + recorded, tx.size() - recorded));
+        }
+        tx_pos += n;
+        done += n;
+    }
+    if (tx_pos == tx.size()) replay_failure(Transcript::TX);
+}
+
+void ReplayTransport::write(const struct iovec *buffers, int count, int timeout_msec) {
+    string frame;
+    for (int i = 0; i < count; i++)
+        frame.append(static_cast<const char *>(buffers[i].iov_base), buffers[i].iov_len);
+    write(frame.data(), frame.size(), timeout_msec);
+}
+
+std::string ReplayTransport::verdict() const {
+    if (!divergence.empty()) return divergence;
+    if (tx_pos < tx.size())
+        return "the utility stopped before sending " + describe_bytes(tx.data() + tx_pos, tx.size() - tx_pos);
+    for (size_t i = next; i < events.size(); i++) {
+        auto kind = events[i].kind;
+        if (kind == Transcript::OPEN || kind == Transcript::BAUD || kind == Transcript::DISCARD ||
+            kind == Transcript::TX) {
+            ostringstream out;
+            out << "the utility stopped at event " << next << " of " << events.size() << ", before the recording "
+                << describe_event(events[i]);
+            return out.str();
+        }
+    }
+    return "";
+}
@@ -0,0 +1,361 @@
+#ifndef WANDSTEM_FLASH_UTILITY_TRANSCRIPT_H
+#define WANDSTEM_FLASH_UTILITY_TRANSCRIPT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+#include "Transport.h"
+
+static const uint64_t transcriptMagic=0x31534e4152545357ull; //"WSTRANS1"
+static const uint32_t transcriptVersion=1;
+static const std::size_t transcriptBufferSize=64*1024;
+static const std::size_t transcriptReadChunk=4096;
+
+/**
+ * Thrown when the utility does something else than what the transcript being replayed recorded.
+ */
+class TranscriptDivergenceException : public std::ios_base::failure {
+public:
+    explicit TranscriptDivergenceException(const std::string &arg) : failure(arg) {}
+};
+
+/**
+ * This class models a transcript of the traffic with a board: every byte in both directions and every operation on
+ * the link, each stamped with the nanoseconds elapsed since the recording started.
+ * The file starts with transcriptMagic, transcriptVersion and the CLOCK_REALTIME of the start, then every event is a
+ * kind byte, the nanoseconds since the previous event and the payload of the kind, all integers being LEB128
+ * varints: a flash of 100 KiB takes little more than the image itself.
+ */
+class Transcript {
+public:
+    ///The kinds of events.
+    enum event_kind {
+        ///The link was opened: value is the baud rate, data the path.
+        OPEN,
+        CLOSE,
+        ///The baud rate was changed to value.
+        BAUD,
+        ///The bytes received and not read yet were discarded.
+        DISCARD,
+        ///The bytes in data were sent to the board.
+        TX,
+        ///The bytes in data were received from the board.
+        RX,
+        ///The last operation timed out: value is the kind of its event, RX for a read.
+        TIMEOUT,
+        ///The last operation was interrupted: value is the kind of its event, RX for a read.
+        INTERRUPT,
+        ///The last operation failed with the message in data: value is the kind of its event, RX for a read.
+        ERROR
+    };
+
+    struct event_t {
+        event_kind kind;
+        ///The nanoseconds since the start of the recording.
+        int64_t time_ns;
+        uint64_t value;
+        std::string data;
+    };
+
+    Transcript() = delete;
+
+    /**
+     * Reads a transcript. A truncated last event, left by a crash of the recorder, is ignored.
+     * \throws FileIOException If the file could not be read or is not a transcript.
+     * \param path the path of the file
+     * \return the events, in the order they happened.
+     */
+    static std::vector<event_t> load(const std::string &path);
+
+    /**
+     * Returns the name of a kind of event.
+     * \return the name.
+     */
+    static const char *kind_name(event_kind kind);
+};
+
+/**
+ * This class buffers the bytes received by a transport recording or replaying a transcript, so that both split the
+ * reads of the Device in the same way: the bytes enter the buffer only through fill, which is what a transcript
+ * records.
+ */
+class TranscriptTransport : public Transport {
+protected:
+    ///The bytes received and not consumed yet.
+    std::vector<char> rx;
+
+    ///The position of the next byte to be consumed in rx.
+    std::size_t rx_pos = 0;
+
+    /**
+     * Receives more bytes, appending them to rx.
+     * \throws TimeoutException If nothing arrived within the timeout.
+     * \throws InterruptedException If the program was interrupted.
+     * \param timeout_msec the deadline, 0 for infinite
+     * \return
+     */
+    virtual void fill(int timeout_msec) = 0;
+
+    /**
+     * Appends received bytes to rx, making room for them with the ones already consumed.
+     * \return
+     */
+    void append(const char *data, std::size_t len);
+
+    /**
+     * Drops the bytes received and not consumed yet.
+     * \return
+     */
+    void clear_rx() {
+        rx.clear();
+        rx_pos = 0;
+    }
+
+public:
+    void read(void *data, std::size_t len, int timeout_msec) override;
+
+    std::size_t read_some(void *data, std::size_t len, int timeout_msec) override;
+
+    std::string read_line(int timeout_msec) override;
+};
+
+/**
+ * This class records a transcript of the traffic going through another transport.
+ * The file is written in large blocks, and flushed whenever an operation fails or the link is closed, so that the
+ * events leading to a failure are on disk even if the process does not survive it.
+ */
+class RecordingTransport : public TranscriptTransport {
+private:
+    std::unique_ptr<Transport> inner;
+
+    int fd = -1;
+
+    ///The events not written yet.
+    std::vector<uint8_t> buffer;
+
+    std::chrono::steady_clock::time_point start;
+
+    ///The time of the last event, in nanoseconds since start.
+    int64_t last_ns = 0;
+
+    ///Why the transcript could not be written, empty if it was.
+    std::string error;
+
+    /**
+     * Appends an event.
+     * \param kind the kind of the event
+     * \param value the value of the kinds having one
+     * \param data the payload of the kinds having one
+     * \param len the length of the payload
+     * \return
+     */
+    void log(Transcript::event_kind kind, uint64_t value = 0, const void *data = nullptr, std::size_t len = 0);
+
+    /**
+     * Runs an operation of the inner transport, logging how it failed before letting the exception through.
+     * \param kind the kind of the event of the operation, RX for a read
+     * \param operation the operation
+     * \return
+     */
+    template<typename Operation>
+    void logged(Transcript::event_kind kind, Operation operation);
+
+protected:
+    void fill(int timeout_msec) override;
+
+public:
+    /**
+     * Constructor. Creates the transcript, truncating the file if it exists.
+     * \throws FileIOException If the file could not be created.
+     * \param inner the transport carrying the traffic
+     * \param path the path of the transcript
+     */
+    RecordingTransport(std::unique_ptr<Transport> inner, const std::string &path);
+
+    RecordingTransport(RecordingTransport const &) = delete;
+
+    void operator=(RecordingTransport const &) = delete;
+
+    ~RecordingTransport() override;
+
+    /**
+     * Writes the events still in memory, the recording going on.
+     * \return
+     */
+    void flush();
+
+    /**
+     * Checks if the transcript was written, the traffic going on anyway if it was not.
+     * \return the error that stopped the recording, empty if none.
+     */
+    const std::string &get_error() const { return error; }
+
+    bool is_present(const std::string &path) const override { return inner->is_present(path); }
+
+    void open(const std::string &path, unsigned int baud) override;
+
+    bool is_open() const override { return inner->is_open(); }
+
+    void close() override;
+
+    void set_baud(unsigned int baud) override;
+
+    void discard_input() override;
+
+    std::size_t buffered() const override { return rx.size() - rx_pos + inner->buffered(); }
+
+    void write(const void *data, std::size_t len, int timeout_msec) override;
+
+    void write(const struct iovec *buffers, int count, int timeout_msec) override;
+};
+
+/**
+ * This class plays a transcript back to a Device, in place of the board: the bytes it received come back as they
+ * were recorded, with the same timeouts, and the bytes it sends are checked against the recorded ones.
+ * As fast as possible by default, a replay takes milliseconds; in real time, every reply is delayed after the
+ * operation that triggered it as much as it was during the recording.
+ * The first difference stops the replay, with a TranscriptDivergenceException from that operation on.
+ */
+class ReplayTransport : public TranscriptTransport {
+private:
+    std::vector<Transcript::event_t> events;
+
+    ///The position of the next event to be replayed.
+    std::size_t next = 0;
+
+    bool realtime;
+
+    bool opened = false;
+
+    ///The bytes of the TX event being matched, and how many of them were matched already.
+    std::string tx;
+    std::size_t tx_pos = 0;
+
+    ///The description of the first difference, empty if none.
+    std::string divergence;
+
+    ///The real time matching the time of the last event triggered by the Device, for the real time replay.
+    std::chrono::steady_clock::time_point anchor;
+    int64_t anchor_ns = 0;
+
+    /**
+     * Stops the replay at the first difference.
+     * \throws TranscriptDivergenceException Always.
+     * \param what what the Device did instead
+     * \return
+     */
+    [[noreturn]] void diverge(const std::string &what);
+
+    /**
+     * Takes the next event, skipping the closures the Device did not repeat.
+     * \throws TranscriptDivergenceException If the replay already diverged or the transcript is over.
+     * \param operation what the Device is doing, for the description of a divergence
+     * \return the event.
+     */
+    const Transcript::event_t &take(const std::string &operation);
+
+    /**
+     * Takes an event triggered by the Device, moving the real time anchor to it.
+     * \throws TranscriptDivergenceException If the next event is not of the kind expected.
+     * \return the event.
+     */
+    const Transcript::event_t &expect(Transcript::event_kind kind, const std::string &operation);
+
+    /**
+     * Rethrows the failure the last operation had during the recording, if any.
+     * \param operation the kind of the event of the operation, RX for a read
+     * \return
+     */
+    void replay_failure(Transcript::event_kind operation);
+
+    /**
+     * Waits until the time of an event, in a real time replay.
+     * \return
+     */
+    void wait_for(const Transcript::event_t &event);
+
+protected:
+    /**
+     * Replays the next RX event, or the timeout or failure of the read. If the recording did not read at this point,
+     * the Device gave up waiting before, so the read times out. The replay is driven by the events, not by the clock:
+     * the timeout of the read is not used, a read times out exactly where the recorded one did.
+     */
+    void fill(int timeout_msec) override;
+
+public:
+    /**
+     * Constructor. Loads the transcript.
+     * \throws FileIOException If the transcript could not be read.
+     * \param path the path of the transcript
+     * \param realtime if the recorded timing is reproduced, instead of replaying as fast as possible
+     */
+    ReplayTransport(const std::string &path, bool realtime);
+
+    /**
+     * Gets the path of the board the transcript was recorded from.
+     * \return the path of the first opening of the link, empty if none.
+     */
+    std::string get_recorded_path() const;
+
+    /**
+     * Gets the baud rate the link was first opened at during the recording.
+     * \return the baud rate, 0 if the link was never opened.
+     */
+    unsigned int get_recorded_baud() const;
+
+    /**
+     * Checks how the replay went, once the Device is done.
+     * \return the description of the first difference, or of the traffic the Device stopped before, empty if the
+     * replay matched the transcript.
+     */
+    std::string verdict() const;
+
+    /**
+     * Gets the number of events replayed so far.
+     * \return the number of events.
+     */
+    std::size_t get_replayed() const { return next; }
+
+    /**
+     * Gets the number of events in the transcript.
+     * \return the number of events.
+     */
+    std::size_t get_total() const { return events.size(); }
+
+    /**
+     * Tells that the board is present, whatever the path: the transcript stands for it.
+     * \return true.
+     */
+    bool is_present(const std::string &) const override { return true; }
+
+    void open(const std::string &path, unsigned int baud) override;
+
+    bool is_open() const override { return opened; }
+
+    void close() override;
+
+    void set_baud(unsigned int baud) override;
+
+    void discard_input() override;
+
+    /**
+     * Counts the bytes that a read would return without waiting: those received already, and those of the RX events
+     * that the recording met before anything else happened.
+     * \return the number of bytes.
+     */
+    std::size_t buffered() const override;
+
+    /**
+     * Checks the bytes sent against the recorded ones. The timeout is not used: a write never blocks in a replay, and
+     * one that timed out during the recording is replayed as such.
+     * \throws TranscriptDivergenceException If the bytes differ from the recorded ones.
+     * \return
+     */
+    void write(const void *data, std::size_t len, int timeout_msec) override;
+
+    void write(const struct iovec *buffers, int count, int timeout_msec) override;
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_TRANSCRIPT_H
@@ -0,0 +1,129 @@
+#ifndef WANDSTEM_FLASH_UTILITY_TRANSPORT_H
+#define WANDSTEM_FLASH_UTILITY_TRANSPORT_H
+
+#include <ios>
+#include <string>
+#include <cstddef>
+
+struct iovec;
+
+/**
+ * Thrown when a serial operation does not complete within its deadline.
+ */
+class TimeoutException : public std::ios_base::failure {
+public:
+    explicit TimeoutException(const std::string &arg) : failure(arg) {}
+};
+
+/**
+ * Thrown when a serial operation is aborted by SerialPort::interrupt_all.
+ */
+class InterruptedException : public std::ios_base::failure {
+public:
+    explicit InterruptedException(const std::string &arg) : failure(arg) {}
+};
+
+/**
+ * This class models the byte stream between a Device and its board. SerialPort drives a real tty; other
+ * implementations can be injected with Device::set_transport, to run the flash procedure over a different link or
+ * against a scripted board.
+ * Every operation is blocking and has its own deadline, a timeout of 0 meaning infinite.
+ */
+class Transport {
+public:
+    virtual ~Transport() = default;
+
+    /**
+     * Checks if the board can be reached at a path, without opening it.
+     * \param path the path of the board
+     * \return if the path exists.
+     */
+    virtual bool is_present(const std::string &path) const = 0;
+
+    /**
+     * Opens the link, raw 8N1 without flow control.
+     * \throws std::ios_base::failure If the link could not be opened.
+     * \param path the path of the board
+     * \param baud the baud rate
+     * \return
+     */
+    virtual void open(const std::string &path, unsigned int baud) = 0;
+
+    /**
+     * Checks if the link is open.
+     * \return if the link is open.
+     */
+    virtual bool is_open() const = 0;
+
+    /**
+     * Closes the link, if open.
+     * \return
+     */
+    virtual void close() = 0;
+
+    /**
+     * Changes the baud rate of the open link, discarding what was not read yet.
+     * \throws std::ios_base::failure If the baud rate is not supported.
+     * \return
+     */
+    virtual void set_baud(unsigned int baud) = 0;
+
+    /**
+     * Discards the bytes received and not read yet.
+     * \return
+     */
+    virtual void discard_input() = 0;
+
+    /**
+     * Counts the bytes already received and not read yet, which read returns without waiting.
+     * \return the number of bytes.
+     */
+    virtual std::size_t buffered() const = 0;
+
+    /**
+     * Reads exactly len bytes.
+     * \throws TimeoutException If the bytes did not arrive within the timeout.
+     * \throws InterruptedException If the program was interrupted.
+     * \param timeout_msec the deadline for the whole read, 0 for infinite
+     * \return
+     */
+    virtual void read(void *data, std::size_t len, int timeout_msec) = 0;
+
+    /**
+     * Reads the bytes available, waiting only if there are none.
+     * \throws TimeoutException If nothing arrived within the timeout.
+     * \throws InterruptedException If the program was interrupted.
+     * \param data where the bytes are stored
+     * \param len the maximum number of bytes
+     * \param timeout_msec the deadline, 0 for infinite
+     * \return the number of bytes read, at least one.
+     */
+    virtual std::size_t read_some(void *data, std::size_t len, int timeout_msec) = 0;
+
+    /**
+     * Reads a line, without its '\n' terminator.
+     * \throws TimeoutException If the line was not completed within the timeout.
+     * \throws InterruptedException If the program was interrupted.
+     * \param timeout_msec the deadline for the whole line, 0 for infinite
+     * \return the line.
+     */
+    virtual std::string read_line(int timeout_msec) = 0;
+
+    /**
+     * Writes a buffer.
+     * \throws TimeoutException If the bytes could not be written within the timeout.
+     * \param timeout_msec the deadline, 0 for infinite
+     * \return
+     */
+    virtual void write(const void *data, std::size_t len, int timeout_msec) = 0;
+
+    /**
+     * Writes several buffers with a single gather write.
+     * \throws TimeoutException If the bytes could not be written within the timeout.
+     * \param timeout_msec the deadline, 0 for infinite
+     * \return
+     */
+    virtual void write(const struct iovec *buffers, int count, int timeout_msec) = 0;
+};
+
+#endif //WANDSTEM_FLASH_UTILITY_TRANSPORT_H
@@ -16,49 +16,53 @@
  ***************************************************************************/
 
 #include <cstring>
-#include <boost/asio/detail/array.hpp>
 #include <algorithm>
 #include "XmodemPacket.h"
-#include "Device.h"
-#include "Exceptions.h"
+#include "Crc16.h"
 
 using namespace std;
 
-mutex XmodemPacket::crc_mtx;
-boost::crc_optimal<16, 0x1021, 0, 0, false, false> XmodemPacket::crc;
-
 XmodemPacket::XmodemPacket(uint8_t pktnum) {
-    content.block_num = pktnum;
-    content.block_num_neg = ~pktnum;
-    content.start = xmodemSoh;
-    memset(content.payload, 0, xmodemDataSize);
+    header[0] = xmodemSoh;
+    header[1] = pktnum;
+    header[2] = ~pktnum;
+    crc[0] = crc[1] = 0;
 }
 
-XmodemPacket XmodemPacket::next() {
-    return XmodemPacket(static_cast<uint8_t>(content.block_num + 1));
+XmodemPacket XmodemPacket::next() const {
+    return XmodemPacket(static_cast<uint8_t>(header[1] + 1));
 }
 
-void XmodemPacket::read_from_binfile(std::ifstream &file) {
-    file.read(reinterpret_cast<char *>(content.payload), xmodemDataSize);
-    auto bytes_read = file.gcount();
-    if (bytes_read < xmodemDataSize) { //packet needs padding
-        if (file.eof()) {
-            memset(content.payload + bytes_read, 0xff, static_cast<size_t>(xmodemDataSize - bytes_read));
-        } else {
-            throw FileIOException("File reading interrupted by astral phenomena");
-        }
+std::size_t XmodemPacket::read_from_image(ImageSource &image, std::size_t offset, bool allow_1k) {
+    const uint8_t *data = nullptr;
+    size_t available = image.view(offset, xmodem1kDataSize, data);
+    //1K packets are used as long as they are not mostly padding, the tail goes in 128 bytes packets
+    data_size = allow_1k && available > 7 * xmodemDataSize ? xmodem1kDataSize : xmodemDataSize;
+    header[0] = data_size == xmodem1kDataSize ? xmodemStx : xmodemSoh;
+    available = min(available, static_cast<size_t>(data_size));
+    if (available == static_cast<size_t>(data_size)) {
+        payload = data;
+        padded.clear();
+    } else { //packet needs padding
+        padded.assign(static_cast<size_t>(data_size), 0xff);
+        if (available) memcpy(padded.data(), data, available);
+        payload = nullptr;
     }
+    return available;
 }
 
 void XmodemPacket::compute_crc() {
-    crc_mtx.lock();
-    crc.reset();
-    crc.process_bytes(content.payload, xmodemDataSize);
-    content.crc = static_cast<uint16_t>(crc.checksum());
-    crc_mtx.unlock();
-    content.crc = static_cast<uint16_t>((content.crc >> 8) & 0xFF | (content.crc << 8) & 0xFF00);
+    auto checksum = Crc16::compute(get_payload(), static_cast<size_t>(data_size));
+    //the CRC goes big endian on the wire
+    crc[0] = static_cast<uint8_t>(checksum >> 8);
+    crc[1] = static_cast<uint8_t>(checksum & 0xFF);
 }
 
-char* XmodemPacket::get_content() {
-    return reinterpret_cast<char *>(&content);
+void XmodemPacket::get_buffers(struct iovec buffers[xmodemPacketBuffers]) const {
+    buffers[0].iov_base = const_cast<uint8_t *>(header);
+    buffers[0].iov_len = sizeof(header);
+    buffers[1].iov_base = const_cast<uint8_t *>(get_payload());
+    buffers[1].iov_len = static_cast<size_t>(data_size);
+    buffers[2].iov_base = const_cast<uint8_t *>(crc);
+    buffers[2].iov_len = sizeof(crc);
 }
@@ -6,12 +6,13 @@
 #define WANDSTEM_FLASH_UTILITY_XMODEMPACKET_H
 
 #include <ios>
-#include <fstream>
-#include <boost/crc.hpp>
-#include <mutex>
+#include <vector>
+#include <sys/uio.h>
+#include "ImageSource.h"
 
 enum {
     xmodemSoh=1,
+    xmodemStx=2,
     xmodemEot=4,
     xmodemAck=6,
     xmodemNak=21,
@@ -21,18 +22,33 @@ enum {
 
 static const int xmodemDataSize=128;
 static const int xmodemPacketSize=133;
+static const int xmodem1kDataSize=1024;
+static const int xmodem1kPacketSize=1029;
+static const int xmodemPacketBuffers=3;
 
 
 class XmodemPacket {
 private:
-    /// The packet structure to be populated, serialized and transmitted.
-    struct xmodem_chunk { //total size 133 bytes
-        uint8_t start;
-        uint8_t block_num;
-        uint8_t block_num_neg;
-        uint8_t payload[xmodemDataSize];
-        uint16_t crc;
-    } __attribute__((packed)) content;
+    /// The packet header: start byte, block number and its complement.
+    uint8_t header[3];
+
+    /// The payload, pointing into the image unless the packet needed padding.
+    const uint8_t *payload = nullptr;
+
+    /// The padded copy of the last block of the image, empty for every other packet.
+    std::vector<uint8_t> padded;
+
+    /**
+     * Gets the payload, wherever it is stored.
+     * \return the payload bytes.
+     */
+    const uint8_t *get_payload() const { return padded.empty() ? payload : padded.data(); }
+
+    /// The big endian CRC of the payload.
+    uint8_t crc[2];
+
+    /// The number of payload bytes, either xmodemDataSize or xmodem1kDataSize.
+    int data_size = xmodemDataSize;
 
     /**
      * Constructor.
@@ -41,11 +57,6 @@ private:
      */
     explicit XmodemPacket(uint8_t pktnum);
 
-    /// The CRC calculation utility.
-    static boost::crc_optimal<16, 0x1021, 0, 0, false, false> crc;
-
-    /// A mutex for avoiding race conditions while calculating the CRC
-    static std::mutex crc_mtx;
 public:
     /**
      * Constructor. Instantiates the first packet to send.
@@ -57,27 +68,50 @@ public:
      * Returns the empty structure of the next packet to send.
      * \return the next packet.
      */
-    XmodemPacket next();
+    XmodemPacket next() const;
 
     /**
-     * Populates the packet data using an input stream (usually a file).
-     * \throws FileIOException when the read data does not contain all the requested bytes but the file did not end.
-     * \return
+     * Populates the packet data with a block of the image. The block is not copied unless it needs padding.
+     * A 1024 bytes block (XMODEM-1K) is used only if allowed and if it would not be mostly padding.
+     * \param image the image to be sent
+     * \param offset the position of the block in the image
+     * \param allow_1k if a 1024 bytes block can be used
+     * \return the number of image bytes in the packet, 0 if the image ended.
      */
-    void read_from_binfile(std::ifstream &file);
+    std::size_t read_from_image(ImageSource &image, std::size_t offset, bool allow_1k = false);
 
     /**
      * Computes and populates the CRC of the packet.
-     * It uses a CRC16-CCIT variant with the remainder initialized to zero.
+     * It uses a CRC16-CCIT variant with the remainder initialized to zero. It is safe to call it concurrently on
+     * different packets.
      * \return
      */
     void compute_crc();
 
     /**
-     * Gets the serialized packet ready to be sent over XMODEM.
-     * \return The serialized packet.
+     * Gets the serialized packet ready to be sent over XMODEM with a gather write: header, payload and CRC.
+     * \param buffers the xmodemPacketBuffers buffers to be populated
+     * \return
+     */
+    void get_buffers(struct iovec buffers[xmodemPacketBuffers]) const;
+
+    /**
+     * Gets the size of the serialized packet.
+     * \return xmodemPacketSize or xmodem1kPacketSize.
+     */
+    int get_size() const { return data_size + xmodemPacketSize - xmodemDataSize; }
+
+    /**
+     * Gets the number of payload bytes.
+     * \return xmodemDataSize or xmodem1kDataSize.
+     */
+    int get_data_size() const { return data_size; }
+
+    /**
+     * Gets the progressive packet number.
+     * \return the block number, modulo 256.
      */
-    char *get_content();
+    uint8_t get_block_num() const { return header[1]; }
 };
 
 
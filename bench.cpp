@@ -0,0 +1,358 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <random>
+#include <regex>
+#include <thread>
+#include <cstdio>
+#include <unistd.h>
+#include <boost/program_options.hpp>
+#include "Crc16.h"
+#include "XmodemPacket.h"
+#include "PacketProducer.h"
+#include "ImageLoader.h"
+#include "Device.h"
+#include "BootloaderSimulator.h"
+#include "FlashStats.h"
+#include "BootloaderScanner.h"
+#include "PatternMatcher.h"
+
+namespace po = boost::program_options;
+using namespace std;
+
+namespace {
+
+///The regular expressions the banner used to be matched with, the baseline of BootloaderScanner.
+const string bootloaderRegexStrict = "^BOOTLOADER version (.+) Chip ID ([0-9A-F]+)(\\r)?$";
+const string bootloaderRegexNoStrict = "^(BOOTLOADER version (.+) Chip ID ([0-9A-F]+)|\\?)(\\r)?$";
+
+///The outcome of a benchmark.
+struct result_t {
+    string name;
+    uint64_t iterations;
+    double ns_per_op;
+    ///The bytes processed by every operation, 0 if the throughput is meaningless.
+    size_t bytes_per_op;
+    ///Additional figures specific to the benchmark.
+    vector<pair<string, double>> extra;
+};
+
+///The parameters of a run of the suite.
+struct bench_options_t {
+    double min_seconds = 0.2;
+    string filter;
+    vector<unsigned int> bauds = {0, 115200, 230400, 460800, 921600};
+    size_t pty_bytes = 16 * 1024;
+};
+
+///Keeps the compiler from optimizing away the benchmarked computations.
+volatile uint64_t sink;
+
+/**
+ * Times an operation, repeating it in growing batches until min_seconds elapse.
+ * \return the result, without bytes_per_op.
+ */
+result_t measure(const string &name, double min_seconds, const function<void()> &op) {
+    op(); //warm up the caches and the lazy initializations
+    uint64_t batch = 1, iterations = 0;
+    double seconds = 0;
+    while (seconds < min_seconds) {
+        auto start = chrono::steady_clock::now();
+        for (uint64_t i = 0; i < batch; i++) op();
+        seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        iterations += batch;
+        if (batch < (1u << 20)) batch *= 2;
+    }
+    return {name, iterations, seconds * 1e9 / iterations, 0, {}};
+}
+
+vector<uint8_t> random_bytes(size_t len) {
+    mt19937 rng(0x1021);
+    vector<uint8_t> data(len);
+    for (auto &byte : data) byte = static_cast<uint8_t>(rng());
+    return data;
+}
+
+void bench_crc(const bench_options_t &options, vector<result_t> &results) {
+    auto data = random_bytes(xmodem1kDataSize);
+    for (size_t len : {static_cast<size_t>(xmodemDataSize), static_cast<size_t>(xmodem1kDataSize)}) {
+        results.push_back(measure("crc/sliced/" + to_string(len), options.min_seconds,
+                                  [&] { sink += Crc16::compute_sliced(data.data(), len); }));
+        results.back().bytes_per_op = len;
+        if (Crc16::has_clmul()) {
+            results.push_back(measure("crc/clmul/" + to_string(len), options.min_seconds,
+                                      [&] { sink += Crc16::compute_clmul(data.data(), len); }));
+            results.back().bytes_per_op = len;
+        }
+        //a whole packet, as the send loop prepares it
+        MemoryImage image(vector<uint8_t>(data.begin(), data.begin() + len));
+        results.push_back(measure("crc/packet/" + to_string(len), options.min_seconds, [&] {
+            XmodemPacket pkt;
+            pkt.read_from_image(image, 0, len == xmodem1kDataSize);
+            pkt.compute_crc();
+            sink += pkt.get_block_num();
+        }));
+        results.back().bytes_per_op = len;
+    }
+}
+
+void bench_packets(const bench_options_t &options, vector<result_t> &results) {
+    //an image of the typical size, the last packet needing padding
+    MemoryImage image(random_bytes(200 * 1024 + 77));
+    for (bool use_1k : {false, true}) {
+        string kind = use_1k ? "1k" : "128";
+        results.push_back(measure("packets/build/" + kind, options.min_seconds, [&] {
+            XmodemPacket pkt;
+            struct iovec buffers[xmodemPacketBuffers];
+            for (size_t offset = 0, got; (got = pkt.read_from_image(image, offset, use_1k)); offset += got) {
+                pkt.compute_crc();
+                pkt.get_buffers(buffers);
+                sink += buffers[2].iov_len;
+                pkt = pkt.next();
+            }
+        }));
+        results.back().bytes_per_op = image.size();
+        //the same stream, prepared by the background thread of the send loop
+        results.push_back(measure("packets/producer/" + kind, options.min_seconds, [&] {
+            PacketProducer producer(image, use_1k);
+            XmodemPacket pkt;
+            while (producer.pop(pkt)) sink += pkt.get_block_num();
+        }));
+        results.back().bytes_per_op = image.size();
+    }
+}
+
+void bench_image(const bench_options_t &options, vector<result_t> &results) {
+    char path[] = "/tmp/wandstem-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) throw runtime_error("Cannot create a temporary image");
+    ::close(fd);
+    auto data = random_bytes(200 * 1024);
+    //the erased tail of a real image, trimmed while loading
+    data.resize(256 * 1024, 0xFF);
+    ofstream(path, ios::binary).write(reinterpret_cast<const char *>(data.data()), data.size());
+    try {
+        results.push_back(measure("image/load/raw", options.min_seconds, [&] {
+            sink += ImageLoader::load(path)->size();
+        }));
+        results.back().bytes_per_op = data.size();
+        results.push_back(measure("image/digest/raw", options.min_seconds, [&] {
+            sink += ImageLoader::load(path)->digest().size();
+        }));
+        results.back().bytes_per_op = data.size();
+    } catch (...) {
+        unlink(path);
+        throw;
+    }
+    unlink(path);
+}
+
+void bench_banner(const bench_options_t &options, vector<result_t> &results) {
+    //what the utility reads while waiting for the bootloader: the firmware chatter, the echo of a command, the banner
+    vector<string> transcript;
+    for (int i = 0; i < 16; i++)
+        transcript.push_back("[" + to_string(1000 + i * 8123) + "] sample " + to_string(i) + " " + string(48, '=') +
+                             "\r");
+    transcript.push_back("?\r");
+    transcript.push_back("BOOTLOADER version 1.0 Chip ID 0123456789ABCDEF\r");
+    transcript.push_back("Ready\r");
+    regex strict(bootloaderRegexStrict), lenient(bootloaderRegexNoStrict);
+    results.push_back(measure("banner/match/strict", options.min_seconds, [&] {
+        for (auto &line : transcript) sink += regex_match(line, strict);
+    }));
+    results.back().extra.push_back({"lines", transcript.size()});
+    results.push_back(measure("banner/match/lenient", options.min_seconds, [&] {
+        for (auto &line : transcript) sink += regex_match(line, lenient);
+    }));
+    results.back().extra.push_back({"lines", transcript.size()});
+    //the regex was compiled on every wait for a reply
+    results.push_back(measure("banner/compile/strict", options.min_seconds, [&] {
+        regex r(bootloaderRegexStrict);
+        sink += r.mark_count();
+    }));
+    results.push_back(measure("banner/parse", options.min_seconds, [&] {
+        smatch match;
+        sink += regex_match(transcript[17], match, strict) ? match[2].length() : 0;
+    }));
+    //what the handshake does now: every byte through the scanner, no line copied
+    string stream;
+    for (auto &line : transcript) stream += line + "\n";
+    BootloaderScanner scanner;
+    results.push_back(measure("banner/scan", options.min_seconds, [&] {
+        unsigned int tokens = 0;
+        for (char c : stream) tokens += scanner.feed(static_cast<uint8_t>(c), false);
+        sink += tokens;
+    }));
+    results.back().bytes_per_op = stream.size();
+    results.back().extra.push_back({"lines", transcript.size()});
+}
+
+void bench_triggers(const bench_options_t &options, vector<result_t> &results) {
+    //a firmware log, as printed while a test runs
+    string stream;
+    for (int i = 0; stream.size() < 64 * 1024; i++)
+        stream += "[" + to_string(1000 + i * 8123) + "] sample " + to_string(i) + " " + string(48, '=') + "\r\n";
+    //what a test run watches for: verdicts, faults and events to count, none of them printed
+    vector<string> patterns;
+    for (int i = 0; i < 48; i++) patterns.push_back("event " + to_string(i) + (i % 2 ? " failed" : " passed"));
+    //each pattern looked for on its own
+    results.push_back(measure("triggers/find", options.min_seconds, [&] {
+        size_t found = 0;
+        for (auto &pattern : patterns) found += stream.find(pattern) != string::npos;
+        sink += found;
+    }));
+    results.back().bytes_per_op = stream.size();
+    results.back().extra.push_back({"patterns", patterns.size()});
+    //every pattern at once, as ConsoleCapture does
+    PatternMatcher matcher;
+    for (auto &pattern : patterns) matcher.add(pattern);
+    matcher.build();
+    results.push_back(measure("triggers/scan", options.min_seconds, [&] {
+        size_t found = 0;
+        matcher.scan(stream.data(), stream.size(), [&found](size_t, size_t) {
+            found++;
+            return true;
+        });
+        sink += found;
+    }));
+    results.back().bytes_per_op = stream.size();
+    results.back().extra.push_back({"patterns", patterns.size()});
+}
+
+void bench_pty(const bench_options_t &options, vector<result_t> &results) {
+    MemoryImage image(random_bytes(options.pty_bytes), false);
+    for (auto baud : options.bauds) {
+        SimulatorOptions sim_options;
+        sim_options.baud = baud;
+        BootloaderSimulator sim(sim_options);
+        thread server([&sim] { sim.run(); });
+        ostream discard(nullptr);
+        flash_report_t report;
+        string error;
+        try {
+            UARTDevice device(sim.get_device_path(), baud ? baud : 115200);
+            device.set_console(discard);
+            report = device.flash(image);
+        } catch (exception &ex) {
+            error = ex.what();
+        }
+        sim.stop();
+        server.join();
+        if (!error.empty()) throw runtime_error("pty flash at " + to_string(baud) + " baud failed: " + error);
+
+        //a cycle is writing a packet and reading its ACK
+        double cycles = report.packets + report.retransmissions;
+        result_t result{"pty/" + (baud ? to_string(baud) : string("unpaced")), report.packets + report.retransmissions,
+                        report.transfer_seconds * 1e9 / cycles, 0, {}};
+        result.extra.push_back({"transfer_seconds", report.transfer_seconds});
+        result.extra.push_back({"payload_bytes_per_s", report.bytes / report.transfer_seconds});
+        result.extra.push_back({"retransmissions", report.retransmissions});
+        if (baud) {
+            //the time the bytes of the packets and of the ACKs take on the wire, 10 bits per byte
+            double wire = cycles * (xmodemPacketSize + 1) * 10.0 / baud;
+            result.extra.push_back({"link_efficiency", wire / report.transfer_seconds});
+        }
+        results.push_back(result);
+    }
+}
+
+void print_json(ostream &out, const vector<result_t> &results) {
+    out << setprecision(6) << "{\"benchmark\":\"wandstem-bench\",\"clmul\":" << (Crc16::has_clmul() ? "true" : "false")
+        << ",\"results\":[";
+    for (size_t i = 0; i < results.size(); i++) {
+        auto &result = results[i];
+        out << (i ? "," : "") << "\n{\"name\":";
+        write_json_string(out, result.name);
+        out << ",\"iterations\":" << result.iterations << ",\"ns_per_op\":" << result.ns_per_op;
+        if (result.bytes_per_op)
+            out << ",\"bytes_per_op\":" << result.bytes_per_op << ",\"mb_per_s\":"
+                << result.bytes_per_op * 1e3 / result.ns_per_op;
+        for (auto &extra : result.extra)
+            out << ",\"" << extra.first << "\":" << extra.second;
+        out << '}';
+    }
+    out << "\n]}" << endl;
+}
+
+void print_text(ostream &out, const vector<result_t> &results) {
+    out << left << setw(26) << "benchmark" << right << setw(12) << "iterations" << setw(14) << "ns/op" << setw(12)
+        << "MB/s" << endl << fixed;
+    for (auto &result : results) {
+        out << left << setw(26) << result.name << right << setw(12) << result.iterations << setw(14)
+            << setprecision(1) << result.ns_per_op << setw(12);
+        if (result.bytes_per_op) out << setprecision(1) << result.bytes_per_op * 1e3 / result.ns_per_op;
+        else out << "-";
+        for (auto &extra : result.extra)
+            out << "  " << extra.first << "=" << setprecision(3) << extra.second;
+        out << endl;
+    }
+}
+
+}
+
+int main(int argc, const char *argv[]) {
+    bench_options_t options;
+    string format;
+
+    po::options_description total("Arguments");
+    total.add_options()
+            ("help,h", "Produces this message")
+            ("filter", po::value<string>(&options.filter),
+             "Runs only the groups whose name contains this string: crc, packets, image, banner, triggers, pty")
+            ("min-time", po::value<double>(&options.min_seconds)->default_value(options.min_seconds),
+             "Seconds every benchmark is repeated for")
+            ("baud,b", po::value<vector<unsigned int>>(&options.bauds)->multitoken(),
+             "Baud rates emulated by the pty benchmark, 0 for unpaced\nDefault: 0 115200 230400 460800 921600")
+            ("pty-bytes", po::value<size_t>(&options.pty_bytes)->default_value(options.pty_bytes),
+             "Size of the image flashed by the pty benchmark")
+            ("format", po::value<string>(&format)->default_value("json"), "Output format: json or text");
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, total), vm);
+        po::notify(vm);
+    } catch (po::error &ex) {
+        cerr << ex.what() << endl << total << endl;
+        return 1;
+    }
+    if (vm.count("help") || (format != "json" && format != "text")) {
+        cout << total << endl;
+        return 1;
+    }
+
+    const vector<pair<string, void (*)(const bench_options_t &, vector<result_t> &)>> groups = {
+            {"crc",      bench_crc},
+            {"packets",  bench_packets},
+            {"image",    bench_image},
+            {"banner",   bench_banner},
+            {"triggers", bench_triggers},
+            {"pty",      bench_pty}};
+    vector<result_t> results;
+    try {
+        for (auto &group : groups) {
+            if (group.first.find(options.filter) == string::npos) continue;
+            cerr << " :: Running the " << group.first << " benchmarks ::" << endl;
+            group.second(options, results);
+        }
+    } catch (exception &ex) {
+        cerr << ex.what() << endl;
+        return 1;
+    }
+    if (format == "json") print_json(cout, results);
+    else print_text(cout, results);
+}
@@ -0,0 +1,111 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+#include <iostream>
+#include <csignal>
+#include <boost/program_options.hpp>
+#include "BootloaderSimulator.h"
+
+namespace po = boost::program_options;
+using namespace std;
+
+static BootloaderSimulator *simulator = nullptr;
+
+static void stop(int) {
+    if (simulator != nullptr) simulator->stop();
+}
+
+int main(int argc, const char *argv[]) {
+    SimulatorOptions options;
+
+    po::options_description total("Arguments");
+    total.add_options()
+            ("help,h", "Produces this message")
+            ("link,l", po::value<string>(&options.link_path),
+             "Creates a symlink to the pseudo-terminal at the specified path")
+            ("version", po::value<string>(&options.version)->default_value(options.version),
+             "The bootloader version printed in the banner")
+            ("chip-id", po::value<string>(&options.chip_id)->default_value(options.chip_id),
+             "The Chip ID printed in the banner")
+            ("baud,b", po::value<unsigned int>(&options.baud)->default_value(0),
+             "Emulates the transfer time of the specified baud rate (0 disables)")
+            ("line-baud", "Emulates the transfer time of the baud rate set by the utility, when --baud is 0")
+            ("max-baud", po::value<unsigned int>(&options.max_baud)->default_value(0),
+             "Highest baud rate the autobaud locks on, faster bytes are lost (0 for no limit)")
+            ("noisy-baud", po::value<unsigned int>(&options.noisy_baud)->default_value(0),
+             "Baud rate above which packets get corrupted (0 for never)")
+            ("noise-rate", po::value<double>(&options.noise_rate)->default_value(options.noise_rate),
+             "Probability of corrupting a packet above --noisy-baud")
+            ("byte-delay", po::value<unsigned int>(&options.byte_delay_us)->default_value(0),
+             "Additional delay in microseconds for every byte crossing the link")
+            ("turnaround", po::value<unsigned int>(&options.turnaround_us)->default_value(0),
+             "Delay in microseconds before every reply to a packet")
+            ("no-autobaud", "Accepts commands without waiting for the 'U' autobaud character")
+            ("no-1k", "Refuses XMODEM-1K packets replying NAK")
+            ("cancel-1k", "Refuses XMODEM-1K packets cancelling the transfer")
+            ("nak-rate", po::value<double>(&options.nak_rate)->default_value(0),
+             "Probability of replying NAK to a correct packet")
+            ("drop-rate", po::value<double>(&options.drop_rate)->default_value(0),
+             "Probability of not replying to a correct packet")
+            ("cancel-at", po::value<unsigned int>(&options.cancel_at)->default_value(0),
+             "Cancels the transfer when the specified packet is received (0 disables)")
+            ("seed", po::value<unsigned int>(&options.seed)->default_value(1), "Seed of the fault injection")
+            ("firmware-time", po::value<unsigned int>(&options.firmware_msec)->default_value(0),
+             "Milliseconds the firmware runs before falling back to the bootloader (0 for forever)")
+            ("firmware", "Starts running the firmware instead of the bootloader")
+            ("firmware-stream", "The firmware prints log lines as fast as the link allows")
+            ("window", po::value<unsigned int>(&options.window)->default_value(0),
+             "Supports the windowed upload mode with up to this many frames in flight (0 disables)")
+            ("output,o", po::value<string>(&options.output_path), "Stores every received image at this path");
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, total), vm);
+        po::notify(vm);
+    } catch (po::error &ex) {
+        cerr << ex.what() << endl << total << endl;
+        return 1;
+    }
+    if (vm.count("help")) {
+        cout << total << endl;
+        return 1;
+    }
+    options.line_baud = static_cast<bool>(vm.count("line-baud"));
+    options.start_in_firmware = static_cast<bool>(vm.count("firmware"));
+    options.firmware_stream = static_cast<bool>(vm.count("firmware-stream"));
+    options.require_autobaud = !vm.count("no-autobaud");
+    options.accept_1k = !vm.count("no-1k") && !vm.count("cancel-1k");
+    options.cancel_1k = static_cast<bool>(vm.count("cancel-1k"));
+
+    try {
+        BootloaderSimulator sim(options);
+        simulator = &sim;
+        signal(SIGINT, stop);
+        signal(SIGTERM, stop);
+        //the path goes alone on stdout so scripts can capture it
+        cout << sim.get_device_path() << endl;
+        sim.run();
+        simulator = nullptr;
+
+        auto &stats = sim.get_statistics();
+        cerr << "sim: " << stats.transfers << " transfers, " << stats.packets << " packets, " << stats.bytes
+             << " bytes, " << stats.duplicates << " duplicates, " << stats.bad_packets << " bad packets, "
+             << stats.injected_naks << " injected NAKs, " << stats.injected_drops << " injected drops, "
+             << stats.injected_cancels << " injected cancels, " << stats.noise_errors << " noise errors, "
+             << stats.autobauds << " autobauds, " << stats.firmware_lines << " firmware log lines" << endl;
+    } catch (runtime_error &ex) {
+        cerr << ex.what() << endl;
+        return 1;
+    }
+}
@@ -0,0 +1,164 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include <iostream>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <boost/program_options.hpp>
+#include "DaemonProtocol.h"
+
+namespace po = boost::program_options;
+using namespace std;
+
+/**
+ * Connects to the daemon.
+ * \return the connection, -1 on failure.
+ */
+static int connect_daemon(const string &path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr))) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+int main(int argc, const char *argv[]) {
+    string socket_path = daemon_socket_path();
+    string command;
+    vector<string> operands;
+    double seconds = 0;
+
+    po::options_description total("Arguments");
+    total.add_options()
+            ("help,h", "Produces this message")
+            ("socket", po::value<string>(&socket_path), "The socket of the daemon")
+            ("xmodem-1k,k", "flash: sends the image in 1024 bytes packets")
+            ("skip-unchanged", "flash: only reboots the device if it already has the image")
+            ("no-trim", "flash: sends the trailing erased (0xFF) blocks of the image too")
+            ("format", po::value<string>(), "flash: the format of the image file, raw, elf, ihex or srec")
+            ("time", po::value<double>(&seconds), "monitor: stops after the specified seconds")
+            ("command", po::value<string>(&command), "")
+            ("operands", po::value<vector<string>>(&operands), "");
+    po::positional_options_description positional;
+    positional.add("command", 1).add("operands", -1);
+
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(total).positional(positional).run(), vm);
+        po::notify(vm);
+    } catch (po::error &ex) {
+        cerr << ex.what() << endl;
+        return 2;
+    }
+    vector<string> request;
+    if (command == "flash" && operands.size() == 2) {
+        //the daemon runs elsewhere, it needs the absolute path
+        char real[PATH_MAX];
+        if (realpath(operands[1].c_str(), real) == nullptr) {
+            cerr << "Cannot find " << operands[1] << endl;
+            return 2;
+        }
+        request = {"flash", operands[0], real};
+        if (vm.count("xmodem-1k")) request.push_back("xmodem-1k");
+        if (vm.count("skip-unchanged")) request.push_back("skip-unchanged");
+        if (vm.count("no-trim")) request.push_back("no-trim");
+        if (vm.count("format")) request.push_back("format=" + vm["format"].as<string>());
+    } else if (command == "reboot" && operands.size() == 1) {
+        request = {"reboot", operands[0]};
+    } else if (command == "monitor" && operands.size() == 1) {
+        request = {"monitor", operands[0], to_string(seconds)};
+    } else if (command == "status" && operands.empty()) {
+        request = {"status"};
+    }
+    if (vm.count("help") || request.empty()) {
+        cout << "Usage: wandstem-flashctl [options] flash <port> <image>" << endl
+             << "       wandstem-flashctl [options] reboot <port>" << endl
+             << "       wandstem-flashctl [options] monitor <port>" << endl
+             << "       wandstem-flashctl [options] status" << endl << total << endl;
+        return 2;
+    }
+
+    int fd = connect_daemon(socket_path);
+    if (fd < 0) {
+        cerr << "Cannot connect to the daemon at " << socket_path << ": " << strerror(errno) << endl;
+        return 2;
+    }
+    string line = join_fields(request);
+    if (write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+        cerr << "Cannot send the request" << endl;
+        return 2;
+    }
+
+    string pending;
+    char buffer[4096];
+    bool progress_shown = false;
+    for (;;) {
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        pending.append(buffer, static_cast<size_t>(got));
+        size_t start = 0;
+        for (auto end = pending.find('\n'); end != string::npos; end = pending.find('\n', start)) {
+            auto fields = split_fields(pending.substr(start, end - start));
+            start = end + 1;
+            auto &kind = fields[0];
+            string text = fields.size() > 1 ? fields[1] : "";
+            if (kind == "progress" && fields.size() == 3) {
+                auto sent = strtoull(fields[1].c_str(), nullptr, 10);
+                auto size = strtoull(fields[2].c_str(), nullptr, 10);
+                if (size) cerr << "\r :: " << sent * 100 / size << "% of " << size << " bytes ::" << flush;
+                else cerr << "\r :: " << sent << " bytes sent ::" << flush;
+                progress_shown = true;
+                continue;
+            }
+            if (progress_shown) {
+                cerr << endl;
+                progress_shown = false;
+            }
+            if (kind == "output") {
+                //when nobody reads the output anymore, closing the connection aborts the job
+                if (!(cout << text << '\n')) return 1;
+            } else if (kind == "log") {
+                cerr << " :: " << text << " ::" << endl;
+            } else if (kind == "queued") {
+                if (text != "0") cerr << " :: Waiting for " << text << " jobs on the port ::" << endl;
+            } else if (kind == "status" && fields.size() == 6) {
+                cout << fields[1] << "  " << fields[2] << ", " << fields[3] << " queued, " << fields[4] << " done"
+                     << (fields[5].empty() ? "" : ", Chip ID " + fields[5]) << endl;
+            } else if (kind == "ok") {
+                cout << flush;
+                cerr << " :: " << text << " ::" << endl;
+                return 0;
+            } else if (kind == "error") {
+                cout << flush;
+                cerr << "Error: " << text << endl;
+                return 1;
+            }
+        }
+        pending.erase(0, start);
+    }
+    cout << flush;
+    cerr << "The daemon closed the connection" << endl;
+    return 1;
+}
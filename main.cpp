@@ -32,7 +32,23 @@ int main(int argc, const char *argv[]) {
     } catch (DeviceNotFoundException &ex) {
         cout << ex.what();
         return 1;
+    } catch (exception &ex) {
+        //malformed arguments, either rejected by boost::program_options (po::error) or by the checks of init
+        cout << "Error: " << ex.what() << endl << endl << p.get_usage() << endl;
+        return 1;
+    }
+    try {
+        if (!p.self_test_if_needed())
+            return 1;
+        p.discover_if_needed();
+        p.flash_if_needed();
+        p.read_to_end();
+        p.verify_replay_if_needed();
+        p.monitor_if_needed();
+        p.serve_if_needed();
+    } catch (exception &ex) {
+        cout << "Error: " << ex.what() << endl;
+        return 1;
     }
-    p.flash_if_needed();
-    p.read_to_end();
+    return p.get_exit_code();
 }
\ No newline at end of file
@@ -0,0 +1,166 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <boost/program_options.hpp>
+#include "RingLog.h"
+#include "Exceptions.h"
+
+namespace po = boost::program_options;
+using namespace std;
+
+/**
+ * Parses a point in time given on the command line.
+ * \throws runtime_error If the time is not understood.
+ * \param text the time: "YYYY-MM-DD HH:MM:SS[.frac]" in local time, "@seconds" since the epoch (or since the boot of
+ * the host with --monotonic), or "-N[s|m|h|d]" before the newest line
+ * \param monotonic if the time refers to CLOCK_MONOTONIC
+ * \param newest the time of the newest line in nanoseconds
+ * \return the time in nanoseconds.
+ */
+static int64_t parse_time(const string &text, bool monotonic, int64_t newest) {
+    char *end = nullptr;
+    if (!text.empty() && text[0] == '@') {
+        double seconds = strtod(text.c_str() + 1, &end);
+        if (end == text.c_str() + 1 || *end != '\0') throw runtime_error("Invalid time: " + text);
+        return static_cast<int64_t>(seconds * 1e9);
+    }
+    if (!text.empty() && text[0] == '-') {
+        double value = strtod(text.c_str() + 1, &end);
+        if (end == text.c_str() + 1) throw runtime_error("Invalid time: " + text);
+        double unit;
+        switch (*end) {
+            case '\0': unit = 1; break;
+            case 's': unit = 1; end++; break;
+            case 'm': unit = 60; end++; break;
+            case 'h': unit = 3600; end++; break;
+            case 'd': unit = 86400; end++; break;
+            default: throw runtime_error("Invalid time: " + text);
+        }
+        if (*end != '\0') throw runtime_error("Invalid time: " + text);
+        return newest - static_cast<int64_t>(value * unit * 1e9);
+    }
+    if (monotonic) throw runtime_error("Monotonic times are @seconds or relative: " + text);
+    tm date{};
+    const char *rest = strptime(text.c_str(), "%Y-%m-%d %H:%M:%S", &date);
+    if (rest == nullptr) rest = strptime(text.c_str(), "%Y-%m-%dT%H:%M:%S", &date);
+    if (rest == nullptr) throw runtime_error("Invalid time: " + text);
+    date.tm_isdst = -1;
+    int64_t result = static_cast<int64_t>(mktime(&date)) * 1000000000ll;
+    if (*rest == '.') {
+        double fraction = strtod(rest, &end);
+        rest = end;
+        result += static_cast<int64_t>(fraction * 1e9);
+    }
+    if (*rest != '\0') throw runtime_error("Invalid time: " + text);
+    return result;
+}
+
+/**
+ * Formats a wall clock time, in local time with microseconds.
+ * \return the text.
+ */
+static string format_time(int64_t real_ns) {
+    time_t seconds = static_cast<time_t>(real_ns / 1000000000ll);
+    tm date{};
+    localtime_r(&seconds, &date);
+    char text[64];
+    size_t len = strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &date);
+    snprintf(text + len, sizeof(text) - len, ".%06lld", static_cast<long long>(real_ns % 1000000000ll / 1000));
+    return text;
+}
+
+static string format_monotonic(int64_t mono_ns) {
+    char text[32];
+    snprintf(text, sizeof(text), "%lld.%06lld", static_cast<long long>(mono_ns / 1000000000ll),
+             static_cast<long long>(mono_ns % 1000000000ll / 1000));
+    return text;
+}
+
+int main(int argc, const char *argv[]) {
+    string path, from, to;
+
+    po::options_description total("Arguments");
+    total.add_options()
+            ("help,h", "Produces this message")
+            ("log", po::value<string>(&path), "The ring log written by wandstem-flash --print --ring")
+            ("from", po::value<string>(&from), "Prints the lines received from this time: \"YYYY-MM-DD HH:MM:SS[.frac]\" "
+                                                "in local time, @seconds since the epoch, or -N[s|m|h|d] before the "
+                                                "newest line")
+            ("to", po::value<string>(&to), "Prints the lines received up to this time, in the same formats")
+            ("monotonic", "Times refer to the host CLOCK_MONOTONIC (@seconds since boot) instead of the wall clock")
+            ("raw", "Prints only the lines, without timestamps")
+            ("info", "Prints a summary of the log");
+    po::positional_options_description positional;
+    positional.add("log", 1);
+
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(total).positional(positional).run(), vm);
+        po::notify(vm);
+    } catch (po::error &ex) {
+        cerr << ex.what() << endl << total << endl;
+        return 1;
+    }
+    if (vm.count("help") || path.empty()) {
+        cout << "Usage: wandstem-ringlog [options] <log>" << endl << total << endl;
+        return 1;
+    }
+
+    try {
+        RingLog log(path);
+        auto info = log.get_info();
+        if (vm.count("info")) {
+            cout << "capacity: " << info.capacity << " bytes, " << info.used << " used" << endl
+                 << "lines: " << info.lines << " stored, " << info.appended << " appended" << endl;
+            if (info.lines)
+                cout << "first: " << format_time(info.first.real_ns) << " (monotonic "
+                     << format_monotonic(info.first.mono_ns) << ")" << endl
+                     << "last: " << format_time(info.last.real_ns) << " (monotonic "
+                     << format_monotonic(info.last.mono_ns) << ")" << endl;
+            return 0;
+        }
+        bool monotonic = static_cast<bool>(vm.count("monotonic"));
+        bool raw = static_cast<bool>(vm.count("raw"));
+        int64_t newest = monotonic ? info.last.mono_ns : info.last.real_ns;
+        int64_t start = from.empty() ? INT64_MIN : parse_time(from, monotonic, newest);
+        int64_t end = to.empty() ? INT64_MAX : parse_time(to, monotonic, newest);
+
+        string out;
+        log.read(monotonic ? RingLog::MONOTONIC : RingLog::REALTIME, start, end, [&](const RingLog::line_t &line) {
+            out.clear();
+            if (!raw) {
+                out += format_time(line.stamp.real_ns);
+                out += ' ';
+                out += format_monotonic(line.stamp.mono_ns);
+                out += ' ';
+            }
+            out.append(line.data, line.length);
+            out += '\n';
+            cout.write(out.data(), static_cast<streamsize>(out.size()));
+            return static_cast<bool>(cout);
+        });
+    } catch (FileIOException &ex) {
+        cerr << ex.what() << endl;
+        return 1;
+    } catch (runtime_error &ex) {
+        cerr << ex.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,593 @@
+/***************************************************************************
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/crc.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include "Crc16.h"
+#include "ImageLoader.h"
+#include "PatternMatcher.h"
+#include "RingLog.h"
+#include "Monitor.h"
+#include "Transcript.h"
+#include "Device.h"
+#include "BootloaderSimulator.h"
+#include "Exceptions.h"
+
+using namespace std;
+
+namespace {
+
+int failures = 0;
+
+/**
+ * Records the outcome of a check, printing the ones that failed.
+ * \param passed if the check passed
+ * \param what the condition checked
+ * \param line the line of the check
+ * \return
+ */
+void check(bool passed, const char *what, int line) {
+    if (passed) return;
+    cout << "tests.cpp:" << line << ": check failed: " << what << endl;
+    failures++;
+}
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+/**
+ * Checks that an operation throws an exception.
+ * \tparam E the type of the exception
+ * \param operation the operation
+ * \return if it threw.
+ */
+template<class E, typename Operation>
+bool throws(Operation operation) {
+    try {
+        operation();
+    } catch (E &ex) {
+        return true;
+    }
+    return false;
+}
+
+vector<uint8_t> random_bytes(size_t len, unsigned int seed) {
+    mt19937 rng(seed);
+    vector<uint8_t> bytes(len);
+    for (auto &byte : bytes) byte = static_cast<uint8_t>(rng());
+    return bytes;
+}
+
+void write_file(const string &path, const void *data, size_t len) {
+    ofstream file(path, ios::binary | ios::trunc);
+    file.write(static_cast<const char *>(data), static_cast<streamsize>(len));
+}
+
+void write_file(const string &path, const string &text) {
+    write_file(path, text.data(), text.size());
+}
+
+void write_gzip(const string &path, const string &text) {
+    ofstream file(path, ios::binary | ios::trunc);
+    boost::iostreams::filtering_ostream out;
+    out.push(boost::iostreams::gzip_compressor());
+    out.push(file);
+    out << text;
+}
+
+vector<uint8_t> contents(ImageSource &image) {
+    vector<uint8_t> bytes;
+    const uint8_t *data;
+    while (bytes.size() < image.size()) {
+        size_t got = image.view(bytes.size(), image.size() - bytes.size(), data);
+        if (!got) break;
+        bytes.insert(bytes.end(), data, data + got);
+    }
+    return bytes;
+}
+
+void test_crc() {
+    typedef boost::crc_optimal<16, crc16Polynomial, 0, 0, false, false> reference_t;
+    const uint8_t check_string[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    CHECK(Crc16::compute(check_string, sizeof(check_string)) == 0x31c3);
+
+    //every length around the block sizes of the kernels, at every alignment
+    auto data = random_bytes(4096 + 8, 1);
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t len = 0; len <= 300; len++) {
+            reference_t reference;
+            reference.process_bytes(data.data() + offset, len);
+            auto expected = reference.checksum();
+            CHECK(Crc16::compute(data.data() + offset, len) == expected);
+            CHECK(Crc16::compute_sliced(data.data() + offset, len) == expected);
+            if (Crc16::has_clmul()) CHECK(Crc16::compute_clmul(data.data() + offset, len) == expected);
+        }
+    }
+
+    //a CRC computed incrementally, split anywhere, is the one of the whole
+    reference_t whole;
+    whole.process_bytes(data.data(), data.size());
+    for (size_t split : {0, 1, 7, 128, 1029, 4096}) {
+        uint16_t crc = Crc16::compute(data.data(), split);
+        CHECK(Crc16::compute(data.data() + split, data.size() - split, crc) == whole.checksum());
+        crc = Crc16::compute_sliced(data.data(), split);
+        CHECK(Crc16::compute_sliced(data.data() + split, data.size() - split, crc) == whole.checksum());
+    }
+    CHECK(Crc16::self_test());
+}
+
+///The image every fixture describes: 16 bytes, a gap of 4 and 4 bytes more, at 0x08000000.
+const uint8_t fixtureImage[] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d,
+                                0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xde, 0xad, 0xbe, 0xef};
+
+const char ihexFixture[] = ":020000040800F2\n"
+                           ":10000000000102030405060708090A0B0C0D0E0F78\n"
+                           ":04001400DEADBEEFB0\n"
+                           ":0400000508000009E6\n"
+                           ":00000001FF\n";
+
+const char srecFixture[] = "S00700007465737438\r\n"
+                           "S31508000000000102030405060708090A0B0C0D0E0F6A\r\n"
+                           "S30908000014DEADBEEFA2\r\n"
+                           "S5030002FA\r\n"
+                           "S70508000009E9\r\n";
+
+///An ARM ELF with the text at 0x08000000, the initialized data loaded at 0x08000014 to run at 0x20000000, and a
+///.bss segment with no contents.
+const uint8_t elfFixture[] = {
+        0x7f, 0x45, 0x4c, 0x46, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x02, 0x00, 0x28, 0x00, 0x01, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x08, 0x34, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x05, 0x34, 0x00, 0x20, 0x00, 0x03, 0x00, 0x28, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x94, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08,
+        0x00, 0x00, 0x00, 0x08, 0x10, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00,
+        0x04, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0xa4, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20,
+        0x14, 0x00, 0x00, 0x08, 0x04, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00,
+        0x04, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0xa8, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x20,
+        0x18, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00,
+        0x04, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+        0x0c, 0x0d, 0x0e, 0x0f, 0xde, 0xad, 0xbe, 0xef};
+
+void test_image_formats() {
+    vector<uint8_t> expected(fixtureImage, fixtureImage + sizeof(fixtureImage));
+    write_file("test-image.hex", ihexFixture);
+    write_file("test-image.srec", srecFixture);
+    write_file("test-image.elf", elfFixture, sizeof(elfFixture));
+    //without a telling extension the format is detected from the contents
+    write_file("test-image-hex.dat", ihexFixture);
+    write_file("test-image-srec.dat", srecFixture);
+    write_file("test-image-elf.dat", elfFixture, sizeof(elfFixture));
+    const pair<const char *, ImageLoader::image_format> fixtures[] = {
+            {"test-image.hex", ImageLoader::IHEX}, {"test-image.srec", ImageLoader::SREC},
+            {"test-image.elf", ImageLoader::ELF}, {"test-image-hex.dat", ImageLoader::IHEX},
+            {"test-image-srec.dat", ImageLoader::SREC}, {"test-image-elf.dat", ImageLoader::ELF}};
+    for (auto &fixture : fixtures) {
+        ImageLoader::image_format format = ImageLoader::AUTO;
+        auto image = ImageLoader::load(fixture.first, true, &format);
+        CHECK(format == fixture.second);
+        CHECK(contents(*image) == expected);
+    }
+
+    //a raw binary starting like a text format is sent as is
+    write_file("test-image.bin", ihexFixture);
+    ImageLoader::image_format format = ImageLoader::AUTO;
+    auto raw = ImageLoader::load("test-image.bin", true, &format);
+    CHECK(format == ImageLoader::RAW);
+    CHECK(raw->size() == sizeof(ihexFixture) - 1);
+    auto forced = ImageLoader::load("test-image-hex.dat", true, &format, ImageLoader::RAW);
+    CHECK(format == ImageLoader::RAW);
+    CHECK(contents(*forced) == contents(*raw));
+
+    //compressed images are streamed, their format guessed from the name without the compression suffix
+    write_gzip("test-image.hex.gz", ihexFixture);
+    auto compressed = ImageLoader::load("test-image.hex.gz", true, &format);
+    CHECK(format == ImageLoader::IHEX);
+    CHECK(contents(*compressed) == expected);
+    write_gzip("test-empty.bin.gz", "");
+    CHECK(throws<FileIOException>([] { ImageLoader::load("test-empty.bin.gz"); }));
+
+    //damaged files are refused rather than flashed
+    string bad_sum = ihexFixture;
+    bad_sum[bad_sum.find("78")] = '0';
+    write_file("test-bad-sum.hex", bad_sum);
+    CHECK(throws<FileIOException>([] { ImageLoader::load("test-bad-sum.hex"); }));
+    write_file("test-overlap.srec", string("S30908000002DEADBEEF9A\n") + srecFixture);
+    CHECK(throws<FileIOException>([] { ImageLoader::load("test-overlap.srec"); }));
+    write_file("test-truncated.elf", elfFixture, sizeof(elfFixture) - 2);
+    CHECK(throws<FileIOException>([] { ImageLoader::load("test-truncated.elf"); }));
+    CHECK(throws<BinaryNotFoundException>([] { ImageLoader::load("test-missing.hex"); }));
+    //the header values of an ELF are bounded by the file size, and its magic is checked even when the format
+    //comes from the extension
+    vector<uint8_t> far_headers(elfFixture, elfFixture + sizeof(elfFixture));
+    far_headers[0x1c] = far_headers[0x1d] = far_headers[0x1e] = far_headers[0x1f] = 0xff;
+    write_file("test-far-headers.elf", far_headers.data(), far_headers.size());
+    CHECK(throws<FileIOException>([] { ImageLoader::load("test-far-headers.elf"); }));
+    vector<uint8_t> far_segment(elfFixture, elfFixture + sizeof(elfFixture));
+    far_segment[0x38] = far_segment[0x39] = far_segment[0x3a] = far_segment[0x3b] = 0xff;
+    write_file("test-far-segment.elf", far_segment.data(), far_segment.size());
+    CHECK(throws<FileIOException>([] { ImageLoader::load("test-far-segment.elf"); }));
+    write_file("test-not-elf.elf", ihexFixture);
+    CHECK(throws<FileIOException>([] { ImageLoader::load("test-not-elf.elf"); }));
+
+    //an image always has a packet to send: an empty one is refused, an erased one keeps its first block
+    write_file("test-empty.bin", "");
+    CHECK(throws<FileIOException>([] { ImageLoader::load("test-empty.bin"); }));
+    vector<uint8_t> erased(1000, 0xff);
+    write_file("test-erased.bin", erased.data(), erased.size());
+    CHECK(ImageLoader::load("test-erased.bin")->size() == 128);
+    CHECK(ImageLoader::load("test-erased.bin", false)->size() == erased.size());
+
+    for (auto &fixture : fixtures) unlink(fixture.first);
+    for (auto path : {"test-image.bin", "test-bad-sum.hex", "test-overlap.srec", "test-truncated.elf",
+                      "test-far-headers.elf", "test-far-segment.elf", "test-not-elf.elf", "test-empty.bin",
+                      "test-erased.bin", "test-image.hex.gz", "test-empty.bin.gz"})
+        unlink(path);
+}
+
+/**
+ * Scans chunks of a stream.
+ * \return the matches, as pairs of pattern id and offset past their end in the whole stream.
+ */
+vector<pair<size_t, size_t>> scan_all(PatternMatcher &matcher, const vector<string> &chunks) {
+    vector<pair<size_t, size_t>> matches;
+    size_t base = 0;
+    for (auto &chunk : chunks) {
+        matcher.scan(chunk.data(), chunk.size(), [&matches, base](size_t id, size_t end) {
+            matches.emplace_back(id, base + end);
+            return true;
+        });
+        base += chunk.size();
+    }
+    return matches;
+}
+
+void test_pattern_matcher() {
+    PatternMatcher matcher;
+    auto he = matcher.add("he"), she = matcher.add("she"), his = matcher.add("his"), hers = matcher.add("hers");
+    matcher.build();
+    //patterns ending at the same byte, or contained in each other, are all found
+    auto matches = scan_all(matcher, {"ushers"});
+    vector<pair<size_t, size_t>> expected = {{she, 4}, {he, 4}, {hers, 6}};
+    sort(matches.begin(), matches.end());
+    sort(expected.begin(), expected.end());
+    CHECK(matches == expected);
+    //the same, split at every byte
+    matcher.reset();
+    matches = scan_all(matcher, {"u", "s", "h", "e", "r", "s"});
+    sort(matches.begin(), matches.end());
+    CHECK(matches == expected);
+    matcher.reset();
+    matches = scan_all(matcher, {"this his"});
+    CHECK(matches.size() == 2 && matches[0] == make_pair(his, size_t(4)) && matches[1] == make_pair(his, size_t(8)));
+
+    //overlapping occurrences of the same pattern
+    PatternMatcher repeated;
+    auto aa = repeated.add("aa");
+    auto aba = repeated.add("aba");
+    repeated.build();
+    matches = scan_all(repeated, {"aaaba", "ba"});
+    expected = {{aa, 2}, {aa, 3}, {aba, 5}, {aba, 7}};
+    CHECK(matches == expected);
+
+    //a match cannot span a reset
+    repeated.reset();
+    scan_all(repeated, {"a"});
+    repeated.reset();
+    CHECK(scan_all(repeated, {"a"}).empty());
+
+    //stopping at the first match leaves the rest of the chunk to the next scan
+    repeated.reset();
+    string text = "xaaxaa";
+    size_t found = 0;
+    size_t scanned = repeated.scan(text.data(), text.size(), [&found](size_t, size_t) {
+        found++;
+        return false;
+    });
+    CHECK(scanned == 3 && found == 1);
+    scanned += repeated.scan(text.data() + scanned, text.size() - scanned, [&found](size_t, size_t) {
+        found++;
+        return true;
+    });
+    CHECK(scanned == text.size() && found == 2);
+
+    //bytes no pattern contains share a class, every byte value must still be told apart
+    PatternMatcher binary;
+    string high = {'\xff', '\x00', '\x80'};
+    auto id = binary.add(high);
+    binary.build();
+    matches = scan_all(binary, {string("\x7f\xff\x00\x80\xff\x00", 6)});
+    CHECK(matches.size() == 1 && matches[0] == make_pair(id, size_t(4)));
+}
+
+///The start of the header of a ring log file, as laid out by RingLog.cpp.
+struct ring_file_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t index_slots;
+    uint64_t capacity;
+    uint64_t index_stride;
+    uint64_t tail;
+    uint64_t head;
+    uint64_t last;
+};
+
+///Where the ring starts in a file with ringLogIndexSlots index slots of 24 bytes.
+const off_t ringFileStart = 4096 + ((ringLogIndexSlots * 24 + 4095) & ~static_cast<size_t>(4095));
+
+string ring_line(uint64_t seq) {
+    return "line " + to_string(seq) + " " + string(seq % 97, static_cast<char>('a' + seq % 26));
+}
+
+/**
+ * Reads a whole ring log, checking every line against ring_line.
+ * \return the sequence numbers read.
+ */
+vector<uint64_t> read_ring(const string &path) {
+    RingLog reader(path);
+    vector<uint64_t> seqs;
+    reader.read(RingLog::MONOTONIC, INT64_MIN, INT64_MAX, [&seqs](const RingLog::line_t &line) {
+        CHECK(string(line.data, line.length) == ring_line(line.seq));
+        CHECK(line.stamp.mono_ns == static_cast<int64_t>(line.seq * 1000));
+        seqs.push_back(line.seq);
+        return true;
+    });
+    return seqs;
+}
+
+void test_ring_log() {
+    const string path = "test-ring.log";
+    unlink(path.c_str());
+    const uint64_t appended = 40000;
+    RingLog::info_t info;
+    {
+        RingLog log(path, ringLogMinCapacity);
+        for (uint64_t seq = 0; seq < appended; seq++) {
+            ring_stamp_t stamp;
+            stamp.mono_ns = static_cast<int64_t>(seq * 1000);
+            stamp.real_ns = stamp.mono_ns + 1000000000;
+            auto line = ring_line(seq);
+            log.append(stamp, line.data(), line.size());
+        }
+        info = log.get_info();
+    }
+    //the ring wrapped several times, keeping the newest lines only
+    CHECK(info.appended == appended);
+    CHECK(info.lines > 0 && info.lines < appended / 2);
+    CHECK(info.used <= info.capacity);
+    auto seqs = read_ring(path);
+    CHECK(seqs.size() == info.lines);
+    for (size_t i = 0; i < seqs.size(); i++) CHECK(seqs[i] == appended - info.lines + i);
+
+    //a time window, located through the index
+    {
+        RingLog reader(path);
+        vector<uint64_t> window;
+        reader.read(RingLog::MONOTONIC, 39000 * 1000, 39010 * 1000, [&window](const RingLog::line_t &line) {
+            window.push_back(line.seq);
+            return true;
+        });
+        CHECK(window.size() == 11 && window.front() == 39000 && window.back() == 39010);
+        window.clear();
+        reader.read(RingLog::REALTIME, 1000000000 + 39990 * 1000, INT64_MAX, [&window](const RingLog::line_t &line) {
+            window.push_back(line.seq);
+            return true;
+        });
+        CHECK(window.size() == 10 && window.front() == 39990);
+    }
+
+    //a crash in the middle of appending the newest line, tearing it
+    int fd = open(path.c_str(), O_RDWR);
+    CHECK(fd >= 0);
+    ring_file_header_t header{};
+    CHECK(pread(fd, &header, sizeof(header), 0) == sizeof(header));
+    char garbage = '#';
+    CHECK(pwrite(fd, &garbage, 1, ringFileStart + static_cast<off_t>(header.last % header.capacity) + 40) == 1);
+    close(fd);
+    {
+        RingLog log(path, ringLogMinCapacity);
+        //the torn line is dropped, the next one follows the lost sequence number
+        seqs = read_ring(path);
+        CHECK(!seqs.empty() && seqs.back() == appended - 2);
+        ring_stamp_t stamp;
+        stamp.mono_ns = static_cast<int64_t>(appended * 1000);
+        auto line = ring_line(appended);
+        log.append(stamp, line.data(), line.size());
+    }
+    seqs = read_ring(path);
+    CHECK(seqs.size() >= 2 && seqs[seqs.size() - 2] == appended - 2 && seqs.back() == appended);
+
+    //a damaged header makes the records untrustworthy: the log starts over
+    fd = open(path.c_str(), O_RDWR);
+    CHECK(pread(fd, &header, sizeof(header), 0) == sizeof(header));
+    header.head = header.tail - 8;
+    CHECK(pwrite(fd, &header, sizeof(header), 0) == sizeof(header));
+    close(fd);
+    {
+        RingLog log(path, ringLogMinCapacity);
+        CHECK(log.get_info().lines == 0);
+        ring_stamp_t stamp;
+        stamp.mono_ns = static_cast<int64_t>((appended + 1) * 1000);
+        auto line = ring_line(appended + 1);
+        log.append(stamp, line.data(), line.size());
+    }
+    seqs = read_ring(path);
+    CHECK(seqs.size() == 1 && seqs[0] == appended + 1);
+
+    CHECK(throws<FileIOException>([] { RingLog reader("test-image-missing.log"); }));
+    unlink(path.c_str());
+}
+
+
+/**
+ * Reads a whole file.
+ * \return the contents.
+ */
+string read_file(const string &path) {
+    ifstream file(path, ios::binary);
+    return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+void test_monitor() {
+    const string out_path = "test-monitor.txt";
+    //a pseudo-terminal stands for the board, and a port that does not exist for one unplugged
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    CHECK(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0);
+    string port = ptsname(master);
+    const string missing = "/dev/wandstem-test-missing";
+    int out_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    CHECK(out_fd >= 0);
+    {
+        Monitor monitor({missing, port}, {115200, 115200}, out_fd);
+        const string input = "hello\r\nworld\n" + string(monitorMaxLine + 100, 'x') + "\npartial";
+        thread board([master, &input] {
+            CHECK(write(master, input.data(), input.size()) == static_cast<ssize_t>(input.size()));
+            //the port fails once the board goes away, ending the monitoring
+            this_thread::sleep_for(chrono::milliseconds(300));
+            close(master);
+        });
+        monitor.run();
+        board.join();
+        auto counters = monitor.get_counters();
+        CHECK(counters.size() == 2);
+        CHECK(!counters[0].open && !counters[0].error.empty() && counters[0].lines == 0);
+        CHECK(!counters[1].open && counters[1].bytes == input.size() && counters[1].lines == 5);
+    }
+    close(out_fd);
+
+    //every line is whole and prefixed with its port, padded to the longest name; an endless line is split
+    string name = port.substr(port.rfind('/') + 1);
+    string padding(strlen("wandstem-test-missing") - name.size(), ' ');
+    string prefix = "[" + name + "] " + padding;
+    vector<string> lines;
+    istringstream output(read_file(out_path));
+    for (string line; getline(output, line);) lines.push_back(line);
+    CHECK(lines.size() == 7);
+    if (lines.size() == 7) {
+        CHECK(lines[0].find("[wandstem-test-missing] *** cannot open the port") == 0);
+        CHECK(lines[1] == prefix + "hello");
+        CHECK(lines[2] == prefix + "world");
+        CHECK(lines[3] == prefix + string(monitorMaxLine, 'x'));
+        CHECK(lines[4] == prefix + string(100, 'x'));
+        CHECK(lines[5] == prefix + "partial");
+        CHECK(lines[6].find(prefix + "*** port closed") == 0);
+    }
+
+    //with no port to read the monitoring cannot start
+    CHECK(throws<ios_base::failure>([&missing] { Monitor monitor({missing}, {115200}); }));
+    unlink(out_path.c_str());
+}
+
+void test_transcript() {
+    const string transcript_path = "test-transcript.bin";
+    const string received_path = "test-received.bin";
+    unlink(received_path.c_str());
+    MemoryImage image(random_bytes(20000, 2), false);
+    ostream discard(nullptr);
+
+    //record a flash on the simulator, with lost and refused packets
+    SimulatorOptions sim_options;
+    sim_options.output_path = received_path;
+    sim_options.nak_rate = 0.05;
+    sim_options.drop_rate = 0.02;
+    flash_report_t recorded;
+    {
+        BootloaderSimulator sim(sim_options);
+        thread server([&sim] { sim.run(); });
+        try {
+            UARTDevice device(sim.get_device_path(), 115200u);
+            device.set_console(discard);
+            device.set_transport(unique_ptr<Transport>(
+                    new RecordingTransport(unique_ptr<Transport>(new SerialPort), transcript_path)));
+            recorded = device.flash(image);
+        } catch (exception &ex) {
+            cout << "recording failed: " << ex.what() << endl;
+            failures++;
+        }
+        sim.stop();
+        server.join();
+        CHECK(sim.get_statistics().transfers == 1);
+    }
+    ifstream received(received_path, ios::binary);
+    vector<uint8_t> bytes((istreambuf_iterator<char>(received)), istreambuf_iterator<char>());
+    auto sent = contents(image);
+    CHECK(bytes.size() >= sent.size() && equal(sent.begin(), sent.end(), bytes.begin()));
+    CHECK(recorded.retransmissions > 0);
+
+    //the transcript alone plays the flash back, with the same outcome
+    auto replay = new ReplayTransport(transcript_path, false);
+    CHECK(replay->get_recorded_baud() == 115200);
+    UARTDevice device(replay->get_recorded_path(), replay->get_recorded_baud());
+    device.set_console(discard);
+    device.set_transport(unique_ptr<Transport>(replay));
+    flash_report_t replayed;
+    try {
+        replayed = device.flash(image);
+    } catch (exception &ex) {
+        cout << "replay failed: " << ex.what() << endl;
+        failures++;
+    }
+    CHECK(replayed.packets == recorded.packets);
+    CHECK(replayed.retransmissions == recorded.retransmissions);
+    CHECK(replayed.bytes == recorded.bytes);
+
+    //a different image diverges from the transcript
+    MemoryImage other(random_bytes(20000, 3), false);
+    auto diverging = new ReplayTransport(transcript_path, false);
+    UARTDevice other_device(diverging->get_recorded_path(), diverging->get_recorded_baud());
+    other_device.set_console(discard);
+    other_device.set_transport(unique_ptr<Transport>(diverging));
+    CHECK(throws<TranscriptDivergenceException>([&] { other_device.flash(other); }));
+
+    unlink(transcript_path.c_str());
+    unlink(received_path.c_str());
+}
+}
+
+int main(int argc, const char *argv[]) {
+    const map<string, void (*)()> suites = {
+            {"crc", test_crc},
+            {"image-formats", test_image_formats},
+            {"pattern-matcher", test_pattern_matcher},
+            {"ring-log", test_ring_log},
+            {"monitor", test_monitor},
+            {"transcript", test_transcript}};
+    if (argc > 2 || (argc == 2 && !suites.count(argv[1]))) {
+        cout << "Usage: wandstem-tests [suite]" << endl << "Suites:";
+        for (auto &suite : suites) cout << " " << suite.first;
+        cout << endl;
+        return 2;
+    }
+    for (auto &suite : suites) {
+        if (argc == 2 && suite.first != argv[1]) continue;
+        try {
+            suite.second();
+        } catch (exception &ex) {
+            cout << suite.first << ": unexpected exception: " << ex.what() << endl;
+            failures++;
+        }
+    }
+    cout << (failures ? to_string(failures) + " checks failed" : "All checks passed") << endl;
+    return failures ? 1 : 0;
+}